@@ -107,5 +107,6 @@ class CWalking_StCrash: public CWalkingState
 
 extern CWalkingController		gWalkingController;
 extern CWalking_StGetReady		gWalking_StGetReady;
+extern CWalking_StCrash			gWalking_StCrash;
 
 #endif
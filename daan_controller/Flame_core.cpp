@@ -27,7 +27,6 @@
 #include <stdarg.h>
 #include <signal.h>
 #include <sys/types.h>
-#include <regex.h>
 
 #if USE_DMALLOC
 #include <dmalloc.h>   // malloc debugging
@@ -93,6 +92,32 @@ static CSysVars system_vars;
 // *****************************************************************************************************************VRAGEN AAN ERIK
 static dataset_t *ring_buffer = NULL;
 
+// The variables left out of the data files when there is no LOGVARS
+// file; see ring_buffer_select_variables.
+static const char *default_log_rules[] = {
+  "-offset*", "-scale*", "-taumax*", "-exercise*", "-timing*", "-imu*",
+  "-standing*", "-demo*", "-k.*", "-dt*", "-LEDS*",
+  NULL
+};
+
+// The ring buffer is streamed to a data file by a background thread
+// during the run, so the recording length is not limited by RINGLEN;
+// the ring only has to cover delays in writing.  If the stream can't
+// be started this is NULL and the ring is saved at shutdown as before.
+static ring_buffer_stream_t *ring_stream = NULL;
+
+// The seconds of data saved before and after each fall, in a file of
+// its own, while the run goes on.
+#define CRASH_PRE_SECONDS  5
+#define CRASH_POST_SECONDS 2
+static ring_buffer_trigger_t *crash_trigger = NULL;
+
+static int
+walking_crashed(void *arg)
+{
+  return gWalkingController.IsInState(&gWalking_StCrash);
+}
+
 /****************************************************************/
 
 // Pointers to message queues.
@@ -466,7 +491,11 @@ static int realtime_thread( long long timestamp, void *userdata )
   // Log data whenever anything is happening.
 
 //  if ( !gFlameController.IsInState(&gFlame_StIdle)) 
+  if ( ring_stream != NULL )
+    ring_buffer_stream_snapshot(system_vars.mData, ring_stream, system_vars.GetNumElements() );
+  else
     ring_buffer_snapshot(system_vars.mData, ring_buffer, system_vars.GetNumElements() );
+  ring_buffer_trigger_snapshot(system_vars.mData, crash_trigger, system_vars.GetNumElements() );
 
   /****************************************************************/
   // General front panel interface (i.e., non-mode dependent)
@@ -478,8 +507,13 @@ static int realtime_thread( long long timestamp, void *userdata )
       button_debounce++;
       s.LEDS |= LED3;
       if ( button_debounce == 5 ) {
-	logprintf("Clearing record buffer.\n");
-	clear_ring_buffer( ring_buffer );
+	if ( ring_stream != NULL ) {
+	  // streamed data is already on disk and can't be taken back
+	  logprintf("Data is being streamed to %s, not cleared.\n", ring_stream->filename);
+	} else {
+	  logprintf("Clearing record buffer.\n");
+	  clear_ring_buffer( ring_buffer );
+	}
       }
     } else {
       button_debounce = 0;
@@ -626,49 +660,74 @@ int main(int argc, char **argv)
 #endif
 
   
-  // Create a ring buffer to log data.  This will create a
-  // storage buffer for every variable, including those which are
-  // not written to files because the archivable bit is cleared.
-  // If memory becomes a limitation, this function could be
-  // extended to skip creating the data buffer for marked
-  // variables, however, the snapshot code also would need to be
-  // fixed, since it depends upon a one to one correspondence
-  // between system_vars and the rows the ring buffer.
-
-  ring_buffer = create_ring_buffer( system_vars.mData, RINGLEN, system_vars.GetNumElements() );
-
-  // Unmark some of the static variables so they won't be
-  // recorded in the data file; this keeps the data files
-  // smaller.
+  // Create a ring buffer to log data.  The variables to record are
+  // selected by the rules in the LOGVARS file, or by the defaults if
+  // there isn't one.  Leaving out the static variables keeps the data
+  // files smaller, and they take neither memory in the ring buffer
+  // nor time in each snapshot.
   {
-    int v;
-    regex_t pattern1;
-    int pattern1_valid = 0;
-    int err;
-
-    for ( v = 0; v < ring_buffer->variables; v++ ) {
-      char *varname = ring_buffer->vars[v].name;
-      
-      // Now mention the parts that are not needed to store in data-files:
-      if ( !strncmp( varname, "offset", 6) ||
-	   !strncmp( varname, "scale", 5) || 
-	   !strncmp( varname, "taumax", 6) ||
-	   !strncmp( varname, "exercise", 8) ||
-	   !strncmp( varname, "timing", 6) ||
-	   !strncmp( varname, "imu", 3) ||
-	   !strncmp( varname, "standing", 8) ||
-	   !strncmp( varname, "demo", 4) ||
-	   !strncmp( varname, "k.", 2) ||
-	   !strncmp( varname, "dt", 2) ||
-	   !strncmp( varname, "LEDS", 4) ||
-	   ( pattern1_valid && !regexec( &pattern1, varname, 0, NULL, 0 )) ||
-	   0 ) {
-	// printf("%s will not be saved in files.\n", varname );
-	ring_buffer->vars[v].archivable = 0;
-      }
+    int v, recorded = 0, decimated = 0, quantized;
+    int NumVars = system_vars.GetNumElements();
+    unsigned char *record = (unsigned char *) malloc( NumVars + 1 );
+
+    memset( record, 1, NumVars );
+    if ( ring_buffer_select_from_file( system_vars.mData, NumVars, record, "LOGVARS" ) < 0 ) {
+      logprintf("No LOGVARS file, using the default logging selection.\n");
+      for ( v = 0; default_log_rules[v] != NULL; v++ )
+	ring_buffer_select_variables( system_vars.mData, NumVars, record, default_log_rules[v] );
+    }
+    for ( v = 0; v < NumVars; v++ ) {
+      if ( record[v] ) recorded++;
+      if ( record[v] > 1 ) decimated++;
     }
-    // Omitting the regfree is a minor memory leak, but for some reason it is segfaulting.
-    // if (pattern1_valid) regfree( &pattern1 );
+    logprintf("Recording %d of %d variables, %d at a reduced rate.\n", recorded, NumVars, decimated);
+
+    ring_buffer = create_masked_ring_buffer( system_vars.mData, RINGLEN, NumVars, record );
+
+    // Hold the variables given a step in LOGVARS as 16 bit counts.
+    ring_buffer_quantize_from_file( ring_buffer, "LOGVARS" );
+    for ( v = 0, quantized = 0; v < (int) ring_buffer->variables; v++ ) 
+      if ( ring_buffer->vars[v].scale != 0.0 ) quantized++;
+    if ( quantized ) logprintf("Recording %d variables quantized to 16 bits.\n", quantized);
+
+    // Capture the same variables around each fall.
+    crash_trigger = start_ring_buffer_trigger( system_vars.mData, NumVars, record,
+					       CRASH_PRE_SECONDS * SAMPLING_RATE, CRASH_POST_SECONDS * SAMPLING_RATE,
+					       walking_crashed, NULL );
+    if ( crash_trigger != NULL ) 
+      ds_set_file_flags( crash_trigger->d, DS_FILE_COMPRESSED | DS_FILE_CHECKSUMMED );
+    else
+      errprintf("Unable to start capturing falls.\n");
+    free( record );
+  }
+
+  // Keep each snapshot in one contiguous record; with a few hundred
+  // variables this is several times faster than filling a separate
+  // buffer for each, which costs a cache miss per variable.
+  ring_buffer_frame_layout( ring_buffer, 1 );
+
+  // Publish the frames in shared memory, so that the helper, plotter
+  // and trigger processes can follow the recording without copying
+  // it through messages.
+  if ( share_ring_buffer( ring_buffer, FLAME_RING_SHM_NAME ) == 0 )
+    logprintf("%s: sharing the ring buffer as %s.\n", NAME, FLAME_RING_SHM_NAME);
+  else
+    errprintf("Unable to share the ring buffer.\n");
+
+  // Save the data files with compressed frames; they are several
+  // times smaller, which shortens the write to flash and the copy
+  // off the robot.  The dataset readers expand them transparently.
+  // Each block also carries a checksum, so that dsrecover can salvage
+  // a file damaged by a crash.
+  ds_set_file_flags( ring_buffer, DS_FILE_COMPRESSED | DS_FILE_CHECKSUMMED );
+
+  // Start streaming the data to a file.  This must follow the
+  // file flags, since the file header is written now.
+  ring_stream = start_ring_buffer_stream( ring_buffer, 0 );
+  if ( ring_stream != NULL ) {
+    logprintf("%s: streaming data to %s.\n", NAME, ring_stream->filename);
+  } else {
+    errprintf("Unable to stream data, it will be saved at shutdown.\n");
   }
 
 #if USE_DMALLOC
@@ -743,7 +802,35 @@ int main(int argc, char **argv)
   // the threads have been moved out of this file, so this may
   // not matter.
 
-  if ( FLAME_TOGGLE_UP(s.front_panel_sw, TOGGLE3) && ring_buffer != NULL) {
+  if ( crash_trigger != NULL ) {
+    unsigned int missed = crash_trigger->missed;
+    unsigned int captures = stop_ring_buffer_trigger( crash_trigger );
+    crash_trigger = NULL;
+
+    if ( captures > 0 ) logprintf("Saved %u captures of falls.\n", captures);
+    if ( missed > 0 ) errprintf("%u falls occurred while a capture was being saved.\n", missed);
+  }
+
+  if ( ring_stream != NULL ) {
+    // Most of the data is already on disk; this writes the rest, or
+    // deletes the file if logging is not enabled.
+    int keep = FLAME_TOGGLE_UP(s.front_panel_sw, TOGGLE3);
+    unsigned int overruns = ring_stream->overruns;
+    char *name = stop_ring_buffer_stream( ring_stream, keep );
+    ring_stream = NULL;
+
+    if ( overruns > 0 ) errprintf("%u samples were dropped while streaming data.\n", overruns);
+
+    if ( !keep ) {
+      logprintf("Logging not enabled, nothing saved.\n");
+    } else if ( name == NULL ) {
+      errprintf("Failed to write data file.\n");
+    } else {
+      logprintf("Saved data in %s.\n", name);
+      free ( name );
+    }
+
+  } else if ( FLAME_TOGGLE_UP(s.front_panel_sw, TOGGLE3) && ring_buffer != NULL) {
     char *name;
 
     logprintf( "%s: Saving data.\n", NAME);
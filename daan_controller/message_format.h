@@ -23,6 +23,10 @@
 #define MSG_SENSOR_DATA (MSG_LASTMESSAGENUM + 1)
 #define MSG_IMU_DATA    (MSG_SENSOR_DATA+1)      // IMU data from helper process to real time
 
+// Name of the shared memory segment holding the logging ring buffer;
+// other processes map it read-only with ds_attach_shared.
+#define FLAME_RING_SHM_NAME "/flame_ring"
+
 // The state structures must have been previously declared by including system.h 
 // and real_time_support/FlameIO_defs.h
 
@@ -0,0 +1,80 @@
+// dsconvert.c : rewrite a state variable trajectory recording in a
+// different file format version.
+//
+// Copyright (C) 1995-2001 Garth Zeglin.  Provided under the terms of the
+// GNU General Public License as included in the top level directory.
+//
+// The controller records data frame by frame (version 1), which
+// suits streaming but means every frame must be parsed to extract a
+// single variable.  Converting a recording to the columnar version 2
+// format allows tools such as dsplot -r to load only the variables
+// they need.  Version 1 files can also be written with compressed
+// frames, or expanded back to plain frames for older readers.
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <utility/dataset.h>
+
+static int version = 2;
+static int compress = 0;
+
+static void
+usage(void)
+{
+  fprintf(stderr, "Usage: dsconvert [-1|-2] [-c] infile outfile\n");
+  fprintf(stderr, "  -1   write the frame-oriented version 1 format.\n");
+  fprintf(stderr, "  -2   write the columnar version 2 format (default).\n");
+  fprintf(stderr, "  -c   compress the frames of a version 1 file.\n");
+  exit(1);
+}
+
+int main (int argc, char **argv)
+{
+  char *names[2];
+  int count = 0, r;
+  dataset_t *d;
+  FILE *out;
+
+  while (--argc > 0) {
+    ++argv;
+    if (**argv == '-') {
+      if (isdigit((*argv)[1])) version = atoi(*argv + 1);
+      else if ((*argv)[1] == 'c' && (*argv)[2] == 0) compress = 1;
+      else usage();
+    } else if (count < 2) names[count++] = *argv;
+    else usage();
+  }
+  if (count != 2 || (version != 1 && version != 2) || (compress && version != 1)) usage();
+
+  // enable more verbose debugging
+  ds_error_stream( stderr );
+
+  d = new_dataset_from_file_parallel(names[0], 0);
+  if (d == NULL) {
+    fprintf(stderr, "Unable to read %s.\n", names[0]);
+    exit(1);
+  }
+
+  // The "b" is for non-UNIX systems.
+  out = fopen(names[1], "wb");
+  if (out == NULL) {
+    fprintf(stderr, "Unable to open %s: ", names[1]);
+    perror("");
+    exit(1);
+  }
+
+  ds_set_file_flags(d, compress ? DS_FILE_COMPRESSED : 0);
+
+  if (version == 2) r = ds_write_dataset_v2(d, out);
+  else              r = ds_write_dataset(d, out);
+
+  if (fclose(out) != 0) r = 1;
+  delete_dataset(d);
+
+  if (r) {
+    fprintf(stderr, "Error writing %s.\n", names[1]);
+    exit(1);
+  }
+  return 0;
+}
@@ -12,7 +12,9 @@
 
 static int verbose = 0;
 
-void
+// Print the information about one file.  Returns 0 on success,
+// else nonzero.
+int
 file_info(char *name)
 {
   FILE *in;
@@ -23,27 +25,30 @@ file_info(char *name)
   if (in == NULL) {
     fprintf(stderr, "Unable to open %s: ", name);
     perror("");
-    return;
+    return 1;
   }
   // enable more verbose debugging
   ds_error_stream( stderr );
 
-  // read in the entire data file
-  d = new_dataset_from_stream(in, DS_UNSPECIFIED_LENGTH);
+  // Only a listing of every value needs the data itself; otherwise
+  // the header is read and the samples counted.
+  if (verbose > 2) d = new_dataset_from_stream(in, DS_UNSPECIFIED_LENGTH);
+  else d = ds_read_info(name);
   fclose(in);
 
   if (d == NULL) {
     fprintf(stderr, "Unable to read %s.\n", name);
-  } else {
-    ds_print_info(d, stdout, verbose);
+    return 1;
   }
+  ds_print_info(d, stdout, verbose);
   delete_dataset(d);
+  return 0;
 }
 
-
 int main (int argc, char **argv)
 {
   char **arg = argv;       /* pointer to walk down argument list */
+  int failed = 0;          /* whether any file could not be read */
   /* interpret the flags as a script */
 
   while (--argc > 0) {
@@ -64,7 +69,7 @@ int main (int argc, char **argv)
     }
 
     // else a bare name, treat as a filename
-    else file_info(*arg);
+    else if (file_info(*arg)) failed = 1;
   }
-  return 0;
+  return failed;
 }
@@ -19,23 +19,45 @@
 enum {
   GNUPLOT,
   PARAMETRIC,
-  MRDPLOT 
+  MRDPLOT,
+  NUMPY
 };
 
 // global flags
 static int verbose = 0;  
 
+// The output being generated.  It is set up from the header of the
+// data by plot_header and then written a window of samples at a time
+// by plot_samples, so that a stream of any length can be converted
+// as it is read.
+typedef struct {
+  int format;
+  int argc;
+  char **argv;
+  char *filename;
+  int vars;             // number of variables in the output
+  int *var;             // their rows
+  int timevar;          // the row of the time variable, for gnuplot
+  FILE **out;           // the file of each variable for gnuplot, else just out[0]
+  unsigned samples;     // number of samples written
+  double freq;          // mrdplot: the sampling frequency
+  int started;          // whether the variables have been looked up
+  int header_written;   // mrdplot: whether the file header has been written
+  char *names;          // mrdplot: the names and units for the file header
+  char **descr;         // numpy: the array type of each output file
+} plot_t;
+
 // forward declarations
-void generate_plotfiles(dataset_t * ds, int argc, char **argv);
-void generate_parametric(dataset_t * ds, int argc, char **argv, char *filename);
-void generate_mrdplot(dataset_t * ds, int argc, char **argv, char *filename);
+static void plot_init(plot_t *p, int format, int argc, char **argv, char *filename);
+static int plot_window(dataset_t *d, void *arg);
+static void plot_finish(plot_t *p);
 
 static char *ProgName;
 
 void usage (void)
 {
   fprintf(stderr,"\n");
-  fprintf(stderr,"Usage: %s [-g|-p|-m] [-v][-i][-f<name>] [<vn> ...] <infile >outfile\n", ProgName);
+  fprintf(stderr,"Usage: %s [-g|-p|-m|-n] [-v][-i][-f<name>][-r<name>][-s<first>,<n>] [<vn> ...] <infile >outfile\n", ProgName);
   fprintf(stderr,"\n");
   fprintf(stderr,"  Format options, only one may be included:\n");
   fprintf(stderr,"    [-g] <varname> [<varname> ...]  output files for gnuplot.\n");
@@ -43,13 +65,23 @@ void usage (void)
   fprintf(stderr,"    [-m] [ <varname> ...]           data file for mrdplot.  With no names all\n");
   fprintf(stderr,"                                    channels are included. The default output\n");
   fprintf(stderr,"                                    is a file named mrddata.fig\n");
+  fprintf(stderr,"    [-n] [ <varname> ...]           NumPy arrays, each named numeric variable\n");
+  fprintf(stderr,"                                    in its own <varname>.npy file.  With -f, or\n");
+  fprintf(stderr,"                                    with no names, a single structured array with\n");
+  fprintf(stderr,"                                    a field per variable instead, by default in\n");
+  fprintf(stderr,"                                    dsdata.npy; with no names it holds all numeric\n");
+  fprintf(stderr,"                                    channels.\n");
   fprintf(stderr,"\n");
   fprintf(stderr,"  Modifier options:\n");
   fprintf(stderr,"    [-v]            for verbose output.\n");
   fprintf(stderr,"    [-i]            to print file information. Use more than once for verbose output.\n");
   fprintf(stderr,"    [-f]<filename>  to specify a filename for single file output formats, including \n");
-  fprintf(stderr,"                    mrdplot and gnuplot files.  There must be no space between -f\n");
+  fprintf(stderr,"                    mrdplot, gnuplot and NumPy files.  There must be no space between -f\n");
   fprintf(stderr,"                    and the name.\n");
+  fprintf(stderr,"    [-r]<filename>  to read the named data file instead of standard input.  For\n");
+  fprintf(stderr,"                    version 2 (columnar) files only the named variables are loaded.\n");
+  fprintf(stderr,"    [-s]<first>,<n> with -r, to read only the <n> samples starting at sample <first>.\n");
+  fprintf(stderr,"                    The samples are located without reading the rest of the file.\n");
   exit(1);
 }
 /****************************************************************/
@@ -61,7 +93,11 @@ int main (int argc, char *argv[])
   int info = -1;
   char **agv = argv;
   char *filename = NULL;
+  char *infile = NULL;
+  unsigned window_first = 0, window_samples = 0;
+  int window = 0;
   dataset_t *d;
+  plot_t plot;
 
   /**************** process arguments ****************/
 
@@ -75,11 +111,20 @@ int main (int argc, char *argv[])
 	else if ((*agv)[1] == 'g') format = GNUPLOT;
 	else if ((*agv)[1] == 'p') format = PARAMETRIC;
 	else if ((*agv)[1] == 'm') format = MRDPLOT;
+	else if ((*agv)[1] == 'n') format = NUMPY;
 	else if ((*agv)[1] == 'f') filename = *agv + 2;
+	else if ((*agv)[1] == 'r') infile = *agv + 2;
+	else if ((*agv)[1] == 's') {
+	  if (sscanf(*agv + 2, "%u,%u", &window_first, &window_samples) != 2) usage();
+	  window = 1;
+	}
 	else usage();
       } 	
     }
   }
+  if (window && infile == NULL) usage();
+  if (filename == NULL && format == PARAMETRIC) filename = "output.data";
+  if (filename == NULL && format == MRDPLOT) filename = "mrddata.fig";
   /****************/
   
   if (verbose) ds_error_stream(stderr);
@@ -88,7 +133,48 @@ int main (int argc, char *argv[])
   setmode(fileno(stdin), O_BINARY); // to read binary files correctly
 #endif
 
-  d = new_dataset_from_stream(stdin, DS_UNSPECIFIED_LENGTH);
+  if (infile != NULL) {
+    // Load only what the output needs: the named variables, plus
+    // the time base and sampling interval used by the generators.
+    // With no names, the mrdplot and NumPy formats include every
+    // channel.
+    const char **names = (const char **) calloc(argc + 2, sizeof(char *));
+    int count = 0, i;
+
+    for (i = 1; i < argc; i++) 
+      if (argv[i][0] != '-') names[count++] = argv[i];
+
+    if (count == 0 && (format == MRDPLOT || format == NUMPY)) {
+      free(names);
+      names = NULL;
+    } else {
+      names[count++] = "t";
+      names[count++] = "record_dt";
+    }
+
+    if (window) {
+      ds_file_t *f = ds_open_file(infile);
+      d = ds_read_window(f, window_first, window_samples, names, count);
+      ds_close_file(f);
+    } else d = new_dataset_from_file(infile, names, count);
+
+    if (names != NULL) free(names);
+
+  } else if (info < 0) {
+    // Convert standard input a window at a time as it arrives, so
+    // the output starts at once and a stream of any length fits in
+    // memory.  The file information needs the whole file, below.
+    int r;
+    plot_init(&plot, format, argc, argv, filename);
+    r = ds_read_stream(stdin, 0, plot_window, &plot);
+    plot_finish(&plot);
+    if (r) {
+      fprintf(stderr, "Error reading input stream.\n"); 
+      exit(1);
+    }
+    return 0;
+
+  } else d = new_dataset_from_stream(stdin, DS_UNSPECIFIED_LENGTH);
 
   if (d == NULL) {
     fprintf(stderr, "Error reading input stream.\n"); 
@@ -97,26 +183,85 @@ int main (int argc, char *argv[])
 
   if (info >= 0) ds_print_info(d, stderr, info);
 
-  switch(format) {
-  case GNUPLOT:
-    generate_plotfiles(d, argc, argv);
-    break;
-
-  case PARAMETRIC:
-    if (filename == NULL) filename = "output.data";
-    generate_parametric(d, argc, argv, filename);
-    break;
+  // The whole dataset is a single window.
+  plot_init(&plot, format, argc, argv, filename);
+  plot_window(d, &plot);
+  plot_finish(&plot);
+  return 0;
+}
+/****************************************************************/
 
-  case MRDPLOT:
-    if (filename == NULL) filename = "mrddata.fig";
-    generate_mrdplot(d, argc, argv, filename);
-    break;
+static void gnuplot_header(plot_t *p, dataset_t *ds);
+static void gnuplot_samples(plot_t *p, dataset_t *ds);
+static void parametric_header(plot_t *p, dataset_t *ds);
+static void parametric_samples(plot_t *p, dataset_t *ds);
+static void mrdplot_header(plot_t *p, dataset_t *ds);
+static void mrdplot_samples(plot_t *p, dataset_t *ds);
+static void mrdplot_finish(plot_t *p);
+static void numpy_header(plot_t *p, dataset_t *ds);
+static void numpy_samples(plot_t *p, dataset_t *ds);
+static void numpy_finish(plot_t *p);
+
+static void plot_init(plot_t *p, int format, int argc, char **argv, char *filename)
+{
+  memset(p, 0, sizeof(plot_t));
+  p->format   = format;
+  p->argc     = argc;
+  p->argv     = argv;
+  p->filename = filename;
+  p->timevar  = -1;
+  p->var      = (int *) calloc(argc + 1, sizeof(int));
+  p->out      = (FILE **) calloc(argc + 1, sizeof(FILE *));
+  p->descr    = (char **) calloc(argc + 1, sizeof(char *));
+}
 
-  default:
-    break;
+// Take a window of samples; the first call also sets up the output
+// from the variable descriptions.  This is the ds_read_stream
+// callback.
+static int plot_window(dataset_t *d, void *arg)
+{
+  plot_t *p = (plot_t *) arg;
+
+  if (!p->started) {
+    p->started = 1;
+    switch(p->format) {
+    case GNUPLOT:    gnuplot_header(p, d);    break;
+    case PARAMETRIC: parametric_header(p, d); break;
+    case MRDPLOT:    mrdplot_header(p, d);    break;
+    case NUMPY:      numpy_header(p, d);      break;
+    default: break;
+    }
   }
+  if (d->samples == 0) return 0;
+
+  switch(p->format) {
+  case GNUPLOT:    gnuplot_samples(p, d);    break;
+  case PARAMETRIC: parametric_samples(p, d); break;
+  case MRDPLOT:    mrdplot_samples(p, d);    break;
+  case NUMPY:      numpy_samples(p, d);      break;
+  default: break;
+  }
+  p->samples += d->samples;
   return 0;
 }
+
+// Complete and close the output files.
+static void plot_finish(plot_t *p)
+{
+  int v;
+
+  if (p->format == MRDPLOT) mrdplot_finish(p);
+  if (p->format == NUMPY) numpy_finish(p);
+  for (v = 0; v < p->argc; v++) {
+    if (p->out[v] != NULL) fclose(p->out[v]);
+    free(p->descr[v]);
+  }
+  free(p->var);
+  free(p->out);
+  free(p->descr);
+  free(p->names);
+}
+
 /****************************************************************/
 
 /* Generate a set of files for plotting. Each file contains one
@@ -124,14 +269,13 @@ int main (int argc, char *argv[])
    numbers in ASCII. The first number is the domain, and the second
    is the data.
 */
-void generate_plotfiles(dataset_t * ds, int argc, char **argv)
+static void gnuplot_header(plot_t *p, dataset_t *ds)
 {
-  int idx;
-  int timevar, var;
-  FILE *out;
+  int argc = p->argc, var;
+  char **argv = p->argv;
 
   // Look up the time variable to use as the ordinate (domain) variable.
-  if ((timevar = ds_find_variable(ds, "t")) == -1) {
+  if ((p->timevar = ds_find_variable(ds, "t")) == -1) {
     fprintf(stderr, "Unable to find the time variable \"t\" to use for the ordinate axis.\n");
     return;
   }
@@ -148,64 +292,67 @@ void generate_plotfiles(dataset_t * ds, int argc, char **argv)
       }
 
       // open output file
-      if ((out = fopen(*argv, "wb")) == NULL) {   // The "b" is for non-Unix systems. 
+      if ((p->out[p->vars] = fopen(*argv, "wb")) == NULL) {   // The "b" is for non-Unix systems. 
 	fprintf(stderr, "Error: cannot open output file %s.\n", *argv);
 	continue;
       }
-
-      // print out all values, one set per line
-      for (idx = 0; idx < ds->samples; idx++) {
-	ds_print_value(ds, out, timevar, idx);
-	fprintf(out, " ");
-	ds_print_value(ds, out, var, idx);
-	fprintf(out, "\n");
-      }
-      fclose(out);
+      p->var[p->vars++] = var;
     }
   }
 }
 
-#define MAXVARS 100
+static void gnuplot_samples(plot_t *p, dataset_t *ds)
+{
+  int first, step, v;
+  int rows[2];
+
+  rows[0] = p->timevar;
+  for (v = 0; v < p->vars; v++) {
+    rows[1] = p->var[v];
+
+    // Print out all values, one set per line.  A decimated variable
+    // is stored repeated, so only the samples at which it was
+    // recorded are printed, each at its own time.  Every file starts
+    // on a group boundary (see clear_ring_buffer), and filepos counts
+    // from the start of the file even in joined streams.
+    step = (ds->vars[rows[1]].decimation > 1) ? ds->vars[rows[1]].decimation : 1;
+    first = (step - ds->filepos % step) % step;
+    if (first < ds->samples) ds_print_columns(ds, p->out[v], rows, 2, first, ds->samples - first, step);
+  }
+}
 
 /* Generate a single file with multicolumn data for plotting. 
 */
-void generate_parametric(dataset_t * ds, int argc, char **argv, char *filename)
+static void parametric_header(plot_t *p, dataset_t *ds)
 {
-  int idx, v, vars;
-  int var[MAXVARS];
-  FILE *out;
+  int argc = p->argc;
+  char **argv = p->argv;
 
   // find all the variables
-
-  vars = 0;
   while (--argc > 0) {
     ++argv;
     if (**argv != '-') {
 
       // look up the name
-      if ((var[vars] = ds_find_variable(ds, *argv)) == -1) {
+      if ((p->var[p->vars] = ds_find_variable(ds, *argv)) == -1) {
 	fprintf(stderr, "Unable to find variable \"%s\"\n", *argv);
 	continue;
       }
-      vars++;
+      p->vars++;
     }
   }
 
   // Open the single multi-column output file.
-  if ((out = fopen(filename, "wb")) == NULL) {
-    fprintf(stderr, "Error: cannot open output file %s.\n", filename);
-    return;
-  }
+  if ((p->out[0] = fopen(p->filename, "wb")) == NULL) 
+    fprintf(stderr, "Error: cannot open output file %s.\n", p->filename);
+}
+
+static void parametric_samples(plot_t *p, dataset_t *ds)
+{
+  if (p->out[0] == NULL) return;
 
   // Generate each row of the output from a column of the data.
-  for (idx = 0; idx < ds->samples; idx++) {
-    for (v = 0; v < vars; v++) {
-      ds_print_value(ds, out, var[v], idx);
-      fprintf(out, " ");
-    }
-    fprintf(out, "\n");
-  }
-  fclose(out);
+  ds_print_columns(ds, p->out[0], p->var, p->vars, 0, ds->samples, 1);
 }
 
 /****************************************************************/
@@ -216,91 +363,71 @@ void generate_parametric(dataset_t * ds, int argc, char **argv, char *filename)
 // Internally the data values are stored as a 32 bit integer.
 #define BIN_DATA_TYPE unsigned
 
-// Convert native number to MRD binary format.
-static inline BIN_DATA_TYPE mrd_datum(float f)
-{
-  union {
-    float f;      // IEEE little-endian float
-    unsigned char c[4];
-    unsigned u;
-  } little, big;
-  
-  // assume an Intel machine 
-  little.f = f;
-  
-  big.c[0] = little.c[3];   // swap all bytes 
-  big.c[1] = little.c[2];
-  big.c[2] = little.c[1];
-  big.c[3] = little.c[0];
+// Width of the counts in the file header.  They are only known at
+// the end of a stream, so they are written padded and then filled in.
+#define MRD_COUNT_WIDTH 11
 
-  return big.u;
-}
+// Number of samples converted at a time, which bounds the buffer.
+#define MRD_RECORDS 1024
 
-// Structure to define an MRD data set. 
-typedef struct _MRD_DATA
+// Convert "n" values of variable v from column "first" on to MRD
+// binary format.  The loops are simple enough for the compiler to
+// vectorize.
+static void mrd_column(dataset_t *ds, int v, unsigned first, unsigned n, BIN_DATA_TYPE *column)
 {
-  BIN_DATA_TYPE *data;      // array of 'data_len' data values in column order 
-  int data_len;             // samples*dim
-  int dim;                  // dimension of data vector
-  int samples;              // total number of samples
-  double freq;              // sampling frequency
-  char **varNames;          // strings to save variable names
-  const char **varUnits;    // strings to save variable units
-} MRD_DATA;
-
-// Create the buffers associated with the MRD data.
-static void allocate_MRD(MRD_DATA *mrd)
-{
-  // Allocate a single large array for the numeric data.
-  mrd->data = (BIN_DATA_TYPE *) malloc(sizeof (BIN_DATA_TYPE) * mrd->samples * mrd->dim);
+  float values[MRD_RECORDS];
+  unsigned one = 1, c;
 
-  // Allocate an array of character pointers for the names and
-  // the units.  Note that the strings themselves are not
-  // allocated here.
+  switch(ds->vars[v].type) {
+  case DS_INT:
+    for (c = 0; c < n; c++) values[c] = (float) ds_int(ds, v)[first + c];
+    break;
+  case DS_FLOAT:
+    memcpy(values, ds_float(ds, v) + first, n * sizeof(float));
+    break;
+  case DS_DOUBLE:
+    for (c = 0; c < n; c++) values[c] = (float) ds_double(ds, v)[first + c];
+    break;
+  default:
+    fprintf(stderr, "Warning: an unsupported type slipped through, mrdplot file invalid.\n");
+    memset(values, 0, n * sizeof(float));
+    break;
+  }
+  memcpy(column, values, n * sizeof(float));
 
-  mrd->varNames = (char **) calloc(mrd->dim, sizeof(char *));
-  mrd->varUnits = (const char **) calloc(mrd->dim, sizeof(char *));
+  // swap all bytes on a little-endian machine
+  if (*(unsigned char *) &one) 
+    for (c = 0; c < n; c++) column[c] = __builtin_bswap32(column[c]);
 }
 
-// Write out the MRD data set to a file.  This must match the
-// matlab code (in one case including space characters).
-
-static int write_MRD_data(char *filename, MRD_DATA *mrd)
+// Write the three counts which begin the MRD file header.  The
+// matlab reader skips the padding.
+static void mrdplot_counts(plot_t *p, FILE *fp)
 {
-  int i;
-  FILE *fp;
-  fp = fopen(filename, "wb");
-  if(fp == NULL) return 0;
-
-  // write header
-  fprintf(fp, "%d %d %d %g", mrd->data_len, mrd->dim, mrd->samples, mrd->freq);
-  for(i = 0; i < mrd->dim; i++)
-    fprintf(fp, "%s  %s  ", mrd->varNames[i], mrd->varUnits[i]);
-
-  fprintf(fp, "\n");  // This whitespace length is assumed to be three chars(2 spc+cr). 
-
-  // write binary data
-  fwrite(mrd->data, sizeof(BIN_DATA_TYPE), mrd->samples*mrd->dim, fp);
-
-  fclose(fp);
-
-  if (verbose > 0) 
-    printf("%d samples of numeric data of dimension %d written to '%s'.\n", 
-	   mrd->samples, mrd->dim, filename);
+  fprintf(fp, "%*d %*d %*d", MRD_COUNT_WIDTH, p->samples * p->vars, MRD_COUNT_WIDTH, p->vars, 
+	  MRD_COUNT_WIDTH, p->samples);
+}
 
-  return 1;
+// Return the units of a variable as named in the MRD file header.
+static const char *mrdplot_units(dataset_t *ds, int v)
+{
+  if ( ds->vars[v].units == DS_DIMENSIONLESS ) {
+    return "-";   // this is easier on the eyes
+  } else {
+    return ds_get_units_string(ds->vars[v].units);
+  }
 }
 
-/* Generate a mrdplot data file from the numeric variables within
-   a data set. */
+/* Select the numeric variables of a data set for a mrdplot data file. */
 
-void generate_mrdplot(dataset_t * ds, int argc, char **argv, char *filename)
+static void mrdplot_header(plot_t *p, dataset_t *ds)
 {
-  MRD_DATA mrd;
-  int v, s, count = 0, mrdvar = 0, datum = 0;
+  int v, argc = p->argc;
+  char **argv = p->argv;
 
   // allocate a list large enough for all variables
-  int *var = (int *) calloc( ds->variables, sizeof (int *));
+  free(p->var);
+  p->var = (int *) calloc( ds->variables + 1, sizeof (int));
 
   // Find all the variables specified on the command line, and include only those in the output.
   while (--argc > 0) {
@@ -314,7 +441,7 @@ void generate_mrdplot(dataset_t * ds, int argc, char **argv, char *filename)
       } else if (ds->vars[v].type == DS_INT || 
 		 ds->vars[v].type == DS_FLOAT || 
 		 ds->vars[v].type == DS_DOUBLE) {
-	var[count++] = v;
+	p->var[p->vars++] = v;
       } else {
 	fprintf(stderr, "Found variable \"%s\", but it is not numeric, ignoring it.\n", *argv);
       }
@@ -322,7 +449,7 @@ void generate_mrdplot(dataset_t * ds, int argc, char **argv, char *filename)
   }
 
   // If no variables were found, just assume that all numeric variables should be included.
-  if ( count == 0 ) {
+  if ( p->vars == 0 ) {
     fprintf(stderr, "No (valid) variables specified, so all numeric channels will be included.\n");
 
     // Count the number of numeric variables, and include all in the output file
@@ -330,90 +457,295 @@ void generate_mrdplot(dataset_t * ds, int argc, char **argv, char *filename)
       if (ds->vars[v].type == DS_INT || 
 	  ds->vars[v].type == DS_FLOAT || 
 	  ds->vars[v].type == DS_DOUBLE) {
-	var[count++] = v;
+	p->var[p->vars++] = v;
       }
     }
   }
 
-  fprintf(stderr, "Including %d variables in mrdplot file.\n", count);
-
-  mrd.samples  = ds->samples;
-  mrd.dim      = count;
-  mrd.data_len = mrd.samples * mrd.dim;
+  fprintf(stderr, "Including %d variables in mrdplot file.\n", p->vars);
+  p->freq = 1000;
 
   // Determine the sampling rate from the usual controlling variable.
+  // It is read from the first window of samples.
+  p->timevar = ds_find_variable(ds, "record_dt");
+  // if ( p->timevar == -1 ) fprintf(stderr, "Warning: no record_dt variable found, assuming 1000 Hz sampling.\n");
+
+  // Collect the names and units for the file header.
   {
-    int timestep_var = ds_find_variable(ds, "record_dt");
-    if ( timestep_var == -1 ) {
-      // fprintf(stderr, "Warning: no record_dt variable found, assuming 1000 Hz sampling.\n");
-      mrd.freq     = 1000;
-    } else {
-      if ( ds->samples != 0 ) {
-	double dt;
-	switch ( ds->vars[ timestep_var ].type ) {
-	case DS_FLOAT:  dt = (ds_float(ds, timestep_var))[0]; break;
-	case DS_DOUBLE: dt = (ds_double(ds, timestep_var))[0]; break;
-	default: 
-	  // fprintf(stderr, "Warning: record_dt not a real number, assuming 1000 Hz sampling.\n");
-	  dt = 0.001;
-	  break;
-	}
-	mrd.freq = 1.0 / dt;
-	fprintf(stderr, "Using sampling rate of %f Hz.\n", mrd.freq);
-      } 
-      else mrd.freq = 1000;  // no samples, doesn't matter
+    size_t length = 1;
+    int i;
+
+    for (i = 0; i < p->vars; i++) 
+      length += strlen(ds->vars[p->var[i]].name) + strlen(mrdplot_units(ds, p->var[i])) + 4;
+    p->names = (char *) malloc(length);
+    p->names[0] = 0;
+
+    for (i = 0; i < p->vars; i++) {
+      int v = p->var[i];  // look up associated variable index
+      sprintf(p->names + strlen(p->names), "%s  %s  ", ds->vars[v].name, mrdplot_units(ds, v));
     }
   }
 
-  // create data buffers
-  allocate_MRD(&mrd);
+  if ((p->out[0] = fopen(p->filename, "wb")) == NULL) 
+    fprintf(stderr, "Error writing MRD file.\n");
+}
 
-  // Copy dataset to MRD structure.
+// Write out the MRD file header.  This must match the matlab code
+// (in one case including space characters).
+static void mrdplot_file_header(plot_t *p)
+{
+  p->header_written = 1;
+  mrdplot_counts(p, p->out[0]);
+  fprintf(p->out[0], " %g%s\n", p->freq, p->names);  // This whitespace length is assumed to be three chars(2 spc+cr). 
+}
 
-  // copy over pointers to the variable and units names
-  for (mrdvar = 0; mrdvar < count; mrdvar++) {
-    int v = var[mrdvar];  // look up associated variable index
+/* Append a window of samples to the mrdplot data file. */
 
-    mrd.varNames[mrdvar] = ds->vars[v].name;
+static void mrdplot_samples(plot_t *p, dataset_t *ds)
+{
+  BIN_DATA_TYPE *data, *column;
+  int s, n, c, mrdvar;
+
+  if (p->out[0] == NULL) return;
+
+  if (!p->header_written) {
+    if ( p->timevar != -1 ) {
+      double dt;
+      switch ( ds->vars[ p->timevar ].type ) {
+      case DS_FLOAT:  dt = (ds_float(ds, p->timevar))[0]; break;
+      case DS_DOUBLE: dt = (ds_double(ds, p->timevar))[0]; break;
+      default: 
+	// fprintf(stderr, "Warning: record_dt not a real number, assuming 1000 Hz sampling.\n");
+	dt = 0.001;
+	break;
+      }
+      p->freq = 1.0 / dt;
+      fprintf(stderr, "Using sampling rate of %f Hz.\n", p->freq);
+    }
+    mrdplot_file_header(p);
+  }
 
-    if ( ds->vars[v].units == DS_DIMENSIONLESS ) {
-      mrd.varUnits[mrdvar] = "-";   // this is easier on the eyes
-    } else {
-      mrd.varUnits[mrdvar] = ds_get_units_string(ds->vars[v].units);
+  // Convert a block of samples a variable at a time, and interleave
+  // them into rows in a buffer of bounded size.
+  data = (BIN_DATA_TYPE *) malloc(sizeof (BIN_DATA_TYPE) * MRD_RECORDS * (p->vars + 1));
+  column = data + MRD_RECORDS * p->vars;
+
+  for (s = 0; s < ds->samples; s += n) {
+    n = (ds->samples - s < MRD_RECORDS) ? ds->samples - s : MRD_RECORDS;
+    for (mrdvar = 0; mrdvar < p->vars; mrdvar++) {
+      BIN_DATA_TYPE *dst = data + mrdvar;
+
+      mrd_column(ds, p->var[mrdvar], s, n, column);
+      for (c = 0; c < n; c++, dst += p->vars) *dst = column[c];
     }
+    fwrite(data, sizeof(BIN_DATA_TYPE), (size_t) n * p->vars, p->out[0]);
   }
+  free(data);
+}
 
-  // and copy the data over by columns
+/* Complete the mrdplot file with the final counts. */
 
-  datum = 0;             // index into output array
+static void mrdplot_finish(plot_t *p)
+{
+  FILE *fp = p->out[0];
 
-  for (s = 0; s < ds->samples; s++) {
-    for (mrdvar = 0; mrdvar < count; mrdvar++ ) {
-      int v = var[mrdvar];  // look up associated variable index
+  if (fp == NULL) return;
+  if (!p->header_written) mrdplot_file_header(p);   // no samples, so the rate doesn't matter
+  else if (fseek(fp, 0, SEEK_SET) == 0) mrdplot_counts(p, fp);
+  else fprintf(stderr, "Error writing MRD file.\n");
 
+  if (verbose > 0) 
+    printf("%d samples of numeric data of dimension %d written to '%s'.\n", 
+	   p->samples, p->vars, p->filename);
+}
 
-      switch(ds->vars[v].type) {
-      case DS_INT:
-	mrd.data[datum++] = mrd_datum ((float) ((ds_int(ds, v))[s]));
-	break;
+/****************************************************************/
+/* Functions to generate NumPy .npy files, which numpy.load can map
+   straight into memory.  The values are written in the native byte
+   order exactly as they are held in the data set. */
 
-      case DS_FLOAT:
-	mrd.data[datum++] = mrd_datum ((float) ((ds_float(ds, v))[s]));
-	break;
+// Width of the length in the array header.  It is only known at the
+// end of a stream, so it is written padded and then filled in.
+#define NUMPY_COUNT_WIDTH 10
 
-      case DS_DOUBLE:
-	mrd.data[datum++] = mrd_datum ((float) ((ds_double(ds, v))[s]));
-	break;
+// Number of samples of a structured array assembled at a time.
+#define NUMPY_RECORDS 1024
 
-      default: // oops
-	fprintf(stderr, "Warning: an unsupported type slipped through, mrdplot file invalid.\n");
-	break;
+// Return the NumPy type code of a numeric variable, and its size.
+static const char *numpy_type(dataset_t *ds, int v, int *size)
+{
+  switch(ds->vars[v].type) {
+  case DS_INT:    *size = sizeof(int);    return "i4";
+  case DS_FLOAT:  *size = sizeof(float);  return "f4";
+  case DS_DOUBLE: *size = sizeof(double); return "f8";
+  default:        *size = 0;              return NULL;
+  }
+}
+
+// Return the NumPy byte order character of this machine.
+static char numpy_byte_order(void)
+{
+  unsigned one = 1;
+  return (*(unsigned char *) &one) ? '<' : '>';
+}
+
+// Write the .npy header of an array of the given type and length.
+// The header is the same size for any length so that it can be
+// rewritten once the length is known.  Format version 1.0 is used
+// unless the header is too long for it.
+static void numpy_file_header(FILE *fp, const char *descr, unsigned samples)
+{
+  size_t length = strlen(descr) + 80, prefix, total;
+  char *dict = (char *) malloc(length);
+  unsigned char magic[12] = { 0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0 };
+
+  length = sprintf(dict, "{'descr': %s, 'fortran_order': False, 'shape': (%*u,), }", 
+		   descr, NUMPY_COUNT_WIDTH, samples);
+
+  // The data begins on a 64 byte boundary; the header ends in a newline.
+  prefix = (length + 11 > 0xffff) ? 12 : 10;
+  total = (prefix + length + 1 + 63) & ~((size_t) 63);
+  if (prefix == 12) {
+    magic[6] = 2;
+    magic[8] = (total - prefix) & 0xff;
+    magic[9] = ((total - prefix) >> 8) & 0xff;
+    magic[10] = ((total - prefix) >> 16) & 0xff;
+    magic[11] = ((total - prefix) >> 24) & 0xff;
+  } else {
+    magic[8] = (total - prefix) & 0xff;
+    magic[9] = ((total - prefix) >> 8) & 0xff;
+  }
+  fwrite(magic, 1, prefix, fp);
+  fwrite(dict, 1, length, fp);
+  for (length += prefix; length < total - 1; length++) fputc(' ', fp);
+  fputc('\n', fp);
+  free(dict);
+}
+
+/* Select the numeric variables and open the files. */
+
+static void numpy_header(plot_t *p, dataset_t *ds)
+{
+  int v, i, size, argc = p->argc;
+  char **argv = p->argv;
+  char order = numpy_byte_order();
+
+  // allocate a list large enough for all variables
+  free(p->var);
+  p->var = (int *) calloc(ds->variables + 1, sizeof(int));
+
+  // Find all the numeric variables specified on the command line.
+  while (--argc > 0) {
+    ++argv;
+    if (**argv != '-') {
+      if ((v = ds_find_variable(ds, *argv)) == -1) {
+	fprintf(stderr, "Unable to find variable \"%s\"\n", *argv);
+	continue;
+      } else if (numpy_type(ds, v, &size) == NULL) {
+	fprintf(stderr, "Found variable \"%s\", but it is not numeric, ignoring it.\n", *argv);
+	continue;
       }
+      for (i = 0; i < p->vars && p->var[i] != v; i++);
+      if (i == p->vars) p->var[p->vars++] = v;
     }
   }
 
-  // write the file
-  if (!write_MRD_data(filename, &mrd)) {
-    fprintf(stderr, "Error writing MRD file.\n");
-  }    
+  if (p->vars > 0 && p->filename == NULL) {
+    // one array file for each variable
+    for (i = 0; i < p->vars; i++) {
+      const char *name = ds->vars[p->var[i]].name;
+      char *filename = (char *) malloc(strlen(name) + 5);
+
+      sprintf(filename, "%s.npy", name);
+      p->descr[i] = (char *) malloc(8);
+      sprintf(p->descr[i], "'%c%s'", order, numpy_type(ds, p->var[i], &size));
+      if ((p->out[i] = fopen(filename, "wb")) == NULL) 
+	fprintf(stderr, "Error: cannot open output file %s.\n", filename);
+      else numpy_file_header(p->out[i], p->descr[i], 0);
+      free(filename);
+    }
+    return;
+  }
+
+  // Otherwise a single structured array, by default of all the
+  // numeric channels.
+  if (p->vars == 0) {
+    fprintf(stderr, "No (valid) variables specified, so all numeric channels will be included.\n");
+    for (v = 0; v < ds->variables; v++) 
+      if (numpy_type(ds, v, &size) != NULL) p->var[p->vars++] = v;
+  }
+  if (p->filename == NULL) p->filename = (char *) "dsdata.npy";
+
+  {
+    size_t length = 3;
+    for (i = 0; i < p->vars; i++) length += strlen(ds->vars[p->var[i]].name) + 14;
+    p->descr[0] = (char *) malloc(length);
+    strcpy(p->descr[0], "[");
+    for (i = 0; i < p->vars; i++) 
+      sprintf(p->descr[0] + strlen(p->descr[0]), "%s('%s', '%c%s')", (i > 0) ? ", " : "",
+	      ds->vars[p->var[i]].name, order, numpy_type(ds, p->var[i], &size));
+    strcat(p->descr[0], "]");
+  }
+  if ((p->out[0] = fopen(p->filename, "wb")) == NULL) 
+    fprintf(stderr, "Error: cannot open output file %s.\n", p->filename);
+  else numpy_file_header(p->out[0], p->descr[0], 0);
+}
+
+/* Append a window of samples to the arrays. */
+
+static void numpy_samples(plot_t *p, dataset_t *ds)
+{
+  int i, size, record = 0;
+  unsigned char *data;
+  unsigned s, n, c;
+
+  if (p->filename == NULL) {
+    // each array is a copy of the column of values
+    for (i = 0; i < p->vars; i++) 
+      if (p->out[i] != NULL) {
+	numpy_type(ds, p->var[i], &size);
+	fwrite(ds->data[p->var[i]], size, ds->samples, p->out[i]);
+      }
+    return;
+  }
+  if (p->out[0] == NULL) return;
+
+  // Assemble the records a block at a time, a field at a time.
+  for (i = 0; i < p->vars; i++) {
+    numpy_type(ds, p->var[i], &size);
+    record += size;
+  }
+  data = (unsigned char *) malloc((size_t) record * NUMPY_RECORDS + 1);
+
+  for (s = 0; s < (unsigned) ds->samples; s += n) {
+    unsigned field = 0;
+
+    n = (ds->samples - s < NUMPY_RECORDS) ? ds->samples - s : NUMPY_RECORDS;
+    for (i = 0; i < p->vars; i++) {
+      const unsigned char *src;
+      unsigned char *dst = data + field;
+
+      numpy_type(ds, p->var[i], &size);
+      src = (const unsigned char *) ds->data[p->var[i]] + (size_t) s * size;
+      for (c = 0; c < n; c++, src += size, dst += record) memcpy(dst, src, size);
+      field += size;
+    }
+    fwrite(data, record, n, p->out[0]);
+  }
+  free(data);
+}
+
+/* Complete the arrays with their final lengths. */
+
+static void numpy_finish(plot_t *p)
+{
+  int i;
+
+  for (i = 0; i < p->argc; i++) {
+    if (p->out[i] == NULL) continue;
+    if (fseek(p->out[i], 0, SEEK_SET) == 0) numpy_file_header(p->out[i], p->descr[i], p->samples);
+    else fprintf(stderr, "Error writing NumPy file.\n");
+  }
+  if (verbose > 0) 
+    printf("%d samples of %d numeric variables written.\n", p->samples, p->vars);
 }
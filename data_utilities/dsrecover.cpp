@@ -0,0 +1,62 @@
+// dsrecover.c : salvage the valid frames of a damaged state variable
+// trajectory recording.
+//
+// Copyright (C) 1995-2001 Garth Zeglin.  Provided under the terms of the
+// GNU General Public License as included in the top level directory.
+//
+// A recording which was being written when the controller crashed or
+// lost power may end in a torn frame, or hold damaged frames where
+// data was still in flight.  This rewrites every frame that can be
+// read back, skipping forward to the next frame sentinel after each
+// damaged one.  Recordings made with DS_FILE_CHECKSUMMED carry a CRC
+// on every frame, so that damaged frames are reliably detected.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <utility/dataset.h>
+
+static void
+usage(void)
+{
+  fprintf(stderr, "Usage: dsrecover infile outfile\n");
+  exit(1);
+}
+
+int main (int argc, char **argv)
+{
+  unsigned long long discarded;
+  dataset_t *d;
+  FILE *out;
+  int r;
+
+  if (argc != 3 || argv[1][0] == '-') usage();
+
+  // enable more verbose debugging
+  ds_error_stream( stderr );
+
+  d = ds_recover_file(argv[1], &discarded);
+  if (d == NULL) {
+    fprintf(stderr, "Unable to recover %s.\n", argv[1]);
+    exit(1);
+  }
+  printf("Recovered %u samples from %s, discarding %llu bytes.\n", d->samples, argv[1], discarded);
+
+  // The "b" is for non-UNIX systems.
+  out = fopen(argv[2], "wb");
+  if (out == NULL) {
+    fprintf(stderr, "Unable to open %s: ", argv[2]);
+    perror("");
+    exit(1);
+  }
+
+  // The frames keep the encoding of the original file.
+  r = ds_write_dataset(d, out);
+  if (fclose(out) != 0) r = 1;
+  delete_dataset(d);
+
+  if (r) {
+    fprintf(stderr, "Error writing %s.\n", argv[2]);
+    exit(1);
+  }
+  return 0;
+}
@@ -0,0 +1,362 @@
+// test_dataset_files.c : write datasets in each file encoding and read
+// them back through each of the readers.
+//
+// Copyright (c) 2005 Garth Zeglin. Provided under the terms of the
+// GNU General Public License as included in the top level directory.
+//
+// Covers version 1 files (plain, compressed, checksummed, and both),
+// version 2 files, and version 1 files of unspecified length left
+// behind by an appending writer which was never closed, with and
+// without strings, and a stream of two files joined.  Prints a line
+// for each failure and exits nonzero if there were any.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <utility/dataset.h>
+
+#define TEST_FILE "test_dataset_files.data"
+#define SAMPLES 5000
+
+static int failures = 0;
+
+// Create a dataset of an int, a float, a double and optionally a string.
+static dataset_t *
+make_dataset(int strings, int columns)
+{
+  dataset_t *d = new_dataset( strings ? 4 : 3 );
+  ds_set_columns( d, columns );
+  ds_init_variable( d, 0, (char *) "i", (char *) "sample index", DS_INT, DS_DIMENSIONLESS, 0, SAMPLES );
+  ds_init_variable( d, 1, (char *) "f", (char *) "half index", DS_FLOAT, DS_DIMENSIONLESS, 0, SAMPLES );
+  ds_init_variable( d, 2, (char *) "x", (char *) "quarter index", DS_DOUBLE, DS_DIMENSIONLESS, 0, SAMPLES );
+  if ( strings ) ds_init_variable( d, 3, (char *) "s", (char *) "label", DS_STRING, DS_DIMENSIONLESS, 0, 0 );
+  return d;
+}
+
+// Store sample k in the column it occupies in a ring of d->columns.
+static void
+fill_sample(dataset_t *d, int k)
+{
+  int col = k % d->columns;
+  ds_int( d, 0 )[col]    = k;
+  ds_float( d, 1 )[col]  = k * 0.5f;
+  ds_double( d, 2 )[col] = k * 0.25;
+  if ( d->variables > 3 ) {
+    char label[20];
+    sprintf( label, "s%d", k % 7 );
+    ds_set_string( d, 3, col, label );
+  }
+}
+
+// Check that a dataset holds samples first..first+n-1.
+static void
+check(const char *test, dataset_t *d, int first, int n)
+{
+  int j, si, sf, sx, ss;
+
+  if ( d == NULL ) {
+    printf("%s: unable to read\n", test);
+    failures++;
+    return;
+  }
+  if ( (int) d->samples != n ) {
+    printf("%s: read %u samples instead of %d\n", test, d->samples, n);
+    failures++;
+    delete_dataset( d );
+    return;
+  }
+  si = ds_find_variable( d, "i" );
+  sf = ds_find_variable( d, "f" );
+  sx = ds_find_variable( d, "x" );
+  ss = ds_find_variable( d, "s" );
+  if ( si < 0 || sf < 0 || sx < 0 ) {
+    printf("%s: variables missing\n", test);
+    failures++;
+    delete_dataset( d );
+    return;
+  }
+  for ( j = 0; j < n; j++ ) {
+    int k = first + j;
+    int col = (d->startpos + j) % d->columns;
+    if ( ds_int( d, si )[col] != k || ds_float( d, sf )[col] != k * 0.5f || ds_double( d, sx )[col] != k * 0.25 ) {
+      printf("%s: wrong values in sample %d\n", test, k);
+      failures++;
+      break;
+    }
+    if ( ss >= 0 ) {
+      char label[20];
+      const char *s = ds_get_string( d, ss, col );
+      sprintf( label, "s%d", k % 7 );
+      if ( s == NULL || strcmp( s, label ) ) {
+	printf("%s: wrong string in sample %d\n", test, k);
+	failures++;
+	break;
+      }
+    }
+  }
+  delete_dataset( d );
+}
+
+// The samples expected from a stream read with ds_read_stream.
+typedef struct {
+  int first;                       // value of the first sample
+  int next;                        // index of the sample expected next
+  int file;                        // index of the first sample of the current file
+  int files;                       // number of files seen
+} stream_check_t;
+
+// Check each window of a stream against the samples expected next.
+// The samples run on across files joined in the stream, while
+// filepos starts again at zero in each.
+static int
+check_stream_window(dataset_t *d, void *arg)
+{
+  stream_check_t *s = (stream_check_t *) arg;
+  int j, si = ds_find_variable( d, "i" ), sx = ds_find_variable( d, "x" );
+
+  if ( s->files == 0 || ( d->filepos == 0 && s->next > s->file ) ) {
+    s->file = s->next;
+    s->files++;
+  }
+  if ( si < 0 || sx < 0 || (int) d->filepos != s->next - s->file ) return 1;
+  for ( j = 0; j < (int) d->samples; j++, s->next++ ) {
+    int k = s->first + s->next;
+    if ( ds_int( d, si )[j] != k || ds_double( d, sx )[j] != k * 0.25 ) return 1;
+  }
+  return 0;
+}
+
+// Read a stream with ds_read_stream in windows of 300 samples.
+// Returns the number of files it held, or -1 on failure.
+static int
+read_stream(const char *test, int first, int n)
+{
+  stream_check_t stream;
+  FILE *f;
+
+  stream.first = first;
+  stream.next  = 0;
+  stream.file  = 0;
+  stream.files = 0;
+  f = fopen( TEST_FILE, "rb" );
+  if ( f == NULL || ds_read_stream( f, 300, check_stream_window, &stream ) ) {
+    printf("%s: unable to read\n", test);
+    failures++;
+    stream.files = -1;
+  } else if ( stream.next != n ) {
+    printf("%s: read %d samples instead of %d\n", test, stream.next, n);
+    failures++;
+    stream.files = -1;
+  }
+  if ( f ) fclose( f );
+  return stream.files;
+}
+
+// Read a file back through every reader.
+static void
+read_all_ways(const char *encoding, int first, int n)
+{
+  char test[100];
+  FILE *f;
+  ds_file_t *file;
+  dataset_t *d;
+  const char *names[] = { "x", "i", "f", "s" };
+
+  // a stream of unspecified length can only be read with a bound
+  sprintf( test, "%s stream", encoding );
+  f = fopen( TEST_FILE, "rb" );
+  d = f ? new_dataset_from_stream( f, n ) : NULL;
+  if ( f ) fclose( f );
+  check( test, d, first, n );
+
+  sprintf( test, "%s windowed stream", encoding );
+  read_stream( test, first, n );
+
+  sprintf( test, "%s file", encoding );
+  check( test, new_dataset_from_file( TEST_FILE, NULL, 0 ), first, n );
+
+  sprintf( test, "%s file by name", encoding );
+  check( test, new_dataset_from_file( TEST_FILE, names, 4 ), first, n );
+
+  sprintf( test, "%s mapped", encoding );
+  check( test, ds_map_file( TEST_FILE ), first, n );
+
+  sprintf( test, "%s parallel", encoding );
+  check( test, new_dataset_from_file_parallel( TEST_FILE, 4 ), first, n );
+
+  // the header alone gives the variables and the sample count
+  sprintf( test, "%s info", encoding );
+  d = ds_read_info( TEST_FILE );
+  if ( d == NULL || (int) d->samples != n ) {
+    printf("%s: header reports %d samples instead of %d\n", test, d ? (int) d->samples : -1, n);
+    failures++;
+  } else if ( ds_find_variable( d, "i" ) < 0 || ds_find_variable( d, "f" ) < 0 || ds_find_variable( d, "x" ) < 0 ) {
+    printf("%s: variables missing\n", test);
+    failures++;
+  }
+  if ( d ) delete_dataset( d );
+
+  sprintf( test, "%s window", encoding );
+  file = ds_open_file( TEST_FILE );
+  if ( file == NULL ) {
+    printf("%s: unable to open\n", test);
+    failures++;
+    return;
+  }
+  check( test, ds_read_window( file, 0, n, NULL, 0 ), first, n );
+  check( test, ds_read_window( file, n / 3, 1000, names, 4 ), first + n / 3, 1000 );
+  check( test, ds_read_window( file, n - 10, 1000, NULL, 0 ), first + n - 10, 10 );
+  ds_close_file( file );
+}
+
+// Write a whole dataset in one of the encodings and read it back.
+static void
+test_write(int strings, int version, unsigned int flags)
+{
+  char encoding[100];
+  dataset_t *d;
+  FILE *f;
+  int k, r;
+
+  sprintf( encoding, "v%d%s%s%s", version,
+	   ( flags & DS_FILE_COMPRESSED ) ? " compressed" : "",
+	   ( flags & DS_FILE_CHECKSUMMED ) ? " checksummed" : "",
+	   strings ? " with strings" : "" );
+
+  // leave the ring wrapped around the end of the matrix
+  d = make_dataset( strings, SAMPLES );
+  for ( k = 0; k < SAMPLES + 1234; k++ ) fill_sample( d, k );
+  d->startpos = 1234 % SAMPLES;
+  d->samples  = SAMPLES;
+  ds_set_file_flags( d, flags );
+
+  f = fopen( TEST_FILE, "wb" );
+  if ( f == NULL ) {
+    perror( TEST_FILE );
+    exit( 1 );
+  }
+  r = ( version == 2 ) ? ds_write_dataset_v2( d, f ) : ds_write_dataset( d, f );
+  if ( fclose( f ) ) r = 1;
+  delete_dataset( d );
+  if ( r ) {
+    printf("%s: write failed\n", encoding);
+    failures++;
+    return;
+  }
+  read_all_ways( encoding, 1234, SAMPLES );
+}
+
+// Append to a file in several pieces and read it back before and
+// after closing it.
+static void
+test_append(int strings, unsigned int flags)
+{
+  char encoding[100];
+  dataset_t *d;
+  ds_append_t *a;
+  int k, total = 0;
+
+  sprintf( encoding, "appended%s%s%s",
+	   ( flags & DS_FILE_COMPRESSED ) ? " compressed" : "",
+	   ( flags & DS_FILE_CHECKSUMMED ) ? " checksummed" : "",
+	   strings ? " with strings" : "" );
+
+  unlink( TEST_FILE );
+  d = make_dataset( strings, 500 );
+  ds_set_file_flags( d, flags );
+  a = ds_open_append( TEST_FILE, d );
+  if ( a == NULL ) {
+    printf("%s: unable to open\n", encoding);
+    failures++;
+    delete_dataset( d );
+    return;
+  }
+  while ( total < SAMPLES ) {
+    int n = 317;
+    if ( total + n > SAMPLES ) n = SAMPLES - total;
+    for ( k = total; k < total + n; k++ ) fill_sample( d, k );
+    if ( ds_append_frames( d, a, total % d->columns, n ) ) {
+      printf("%s: append failed\n", encoding);
+      failures++;
+      break;
+    }
+    total += n;
+  }
+
+  // the header still holds DS_UNSPECIFIED_LENGTH
+  fflush( a->file );
+  strcat( encoding, " unclosed" );
+  read_all_ways( encoding, 0, total );
+
+  ds_close_append( a );
+  encoding[strlen( encoding ) - strlen( " unclosed" )] = 0;
+  read_all_ways( encoding, 0, total );
+  delete_dataset( d );
+}
+
+// Write two files one after the other, as cat would join them, and
+// read them as one stream.
+static void
+test_joined(void)
+{
+  const char *test = "joined";
+  dataset_t *d;
+  FILE *f;
+  int k, r;
+
+  f = fopen( TEST_FILE, "wb" );
+  if ( f == NULL ) {
+    perror( TEST_FILE );
+    exit( 1 );
+  }
+  d = make_dataset( 0, 1000 );
+  for ( k = 0; k < 1000; k++ ) fill_sample( d, k );
+  d->samples = 1000;
+  r = ds_write_dataset( d, f );
+  delete_dataset( d );
+
+  // the second file starts in the middle of its ring and is
+  // compressed, so its header has to be read afresh
+  d = make_dataset( 0, 2000 );
+  for ( k = 1000; k < 2500; k++ ) fill_sample( d, k );
+  d->startpos = 1000;
+  d->samples = 1500;
+  ds_set_file_flags( d, DS_FILE_COMPRESSED );
+  r = r || ds_write_dataset( d, f );
+  delete_dataset( d );
+  if ( fclose( f ) || r ) {
+    printf("%s: write failed\n", test);
+    failures++;
+    return;
+  }
+
+  k = read_stream( test, 0, 2500 );
+  if ( k >= 0 && k != 2 ) {
+    printf("%s: read %d files instead of 2\n", test, k);
+    failures++;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int strings;
+
+  ds_error_stream( stderr );
+
+  for ( strings = 0; strings < 2; strings++ ) {
+    test_write( strings, 1, 0 );
+    test_write( strings, 1, DS_FILE_COMPRESSED );
+    test_write( strings, 1, DS_FILE_CHECKSUMMED );
+    test_write( strings, 1, DS_FILE_COMPRESSED | DS_FILE_CHECKSUMMED );
+    test_write( strings, 2, 0 );
+    test_append( strings, 0 );
+    test_append( strings, DS_FILE_COMPRESSED | DS_FILE_CHECKSUMMED );
+  }
+  test_joined();
+  unlink( TEST_FILE );
+
+  if ( failures ) printf("%d failures.\n", failures);
+  else printf("All dataset file tests passed.\n");
+  return failures != 0;
+}
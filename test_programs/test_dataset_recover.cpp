@@ -0,0 +1,185 @@
+// test_dataset_recover.c : salvage damaged dataset files the way
+// dsrecover does and check what is recovered.
+//
+// Copyright (c) 2005 Garth Zeglin. Provided under the terms of the
+// GNU General Public License as included in the top level directory.
+//
+// Each version 1 encoding is written, cut short in the middle of its
+// last frame or block, and for checksummed files also damaged in the
+// middle.  The recovered samples must be a run of the samples written
+// with at most the damaged ones missing, and must read back the same
+// after being written out again.  Prints a line for each failure and
+// exits nonzero if there were any.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <utility/dataset.h>
+
+#define TEST_FILE      "test_dataset_recover.data"
+#define RECOVERED_FILE "test_dataset_recover.out"
+#define SAMPLES 5000
+
+static int failures = 0;
+
+// Write samples 0..SAMPLES-1 of an int, a double and optionally a string.
+static int
+write_file(int strings, unsigned int flags)
+{
+  dataset_t *d = new_dataset( strings ? 3 : 2 );
+  FILE *f;
+  int k, r;
+
+  ds_set_columns( d, SAMPLES );
+  ds_init_variable( d, 0, (char *) "i", (char *) "sample index", DS_INT, DS_DIMENSIONLESS, 0, SAMPLES );
+  ds_init_variable( d, 1, (char *) "x", (char *) "half index", DS_DOUBLE, DS_DIMENSIONLESS, 0, SAMPLES );
+  if ( strings ) ds_init_variable( d, 2, (char *) "s", (char *) "label", DS_STRING, DS_DIMENSIONLESS, 0, 0 );
+  for ( k = 0; k < SAMPLES; k++ ) {
+    ds_int( d, 0 )[k]    = k;
+    ds_double( d, 1 )[k] = k * 0.5;
+    if ( strings ) ds_set_string( d, 2, k, ( k & 1 ) ? "odd" : "even" );
+  }
+  d->samples = SAMPLES;
+  ds_set_file_flags( d, flags );
+
+  f = fopen( TEST_FILE, "wb" );
+  if ( f == NULL ) {
+    perror( TEST_FILE );
+    exit( 1 );
+  }
+  r = ds_write_dataset( d, f );
+  if ( fclose( f ) ) r = 1;
+  delete_dataset( d );
+  return r;
+}
+
+// Check that the samples of a dataset are increasing, consistent,
+// and include the first "head" samples written.  Returns the number
+// of samples, or -1 on failure.
+static int
+check_samples(const char *test, dataset_t *d, int head)
+{
+  int j, prev = -1;
+
+  if ( d == NULL ) {
+    printf("%s: nothing recovered\n", test);
+    failures++;
+    return -1;
+  }
+  for ( j = 0; j < (int) d->samples; j++ ) {
+    int k = ds_int( d, 0 )[j];
+    if ( k <= prev || k >= SAMPLES || ds_double( d, 1 )[j] != k * 0.5 || ( j < head && k != j ) ||
+	 ( d->variables > 2 && strcmp( ds_get_string( d, 2, j ), ( k & 1 ) ? "odd" : "even" ) ) ) {
+      printf("%s: wrong values in recovered sample %d\n", test, j);
+      failures++;
+      return -1;
+    }
+    prev = k;
+  }
+  return d->samples;
+}
+
+// Recover the damaged file, write it out as dsrecover would, and
+// read that back.  At least "least" samples should survive.
+static void
+recover(const char *test, int least, int head)
+{
+  unsigned long long discarded = 0;
+  dataset_t *d, *e;
+  FILE *out;
+  int n, r;
+
+  d = ds_recover_file( TEST_FILE, &discarded );
+  n = check_samples( test, d, head );
+  if ( n < 0 ) {
+    if ( d ) delete_dataset( d );
+    return;
+  }
+  if ( n < least || n == SAMPLES || discarded == 0 ) {
+    printf("%s: recovered %d samples discarding %llu bytes\n", test, n, discarded);
+    failures++;
+  }
+
+  out = fopen( RECOVERED_FILE, "wb" );
+  r = ( out == NULL ) || ds_write_dataset( d, out );
+  if ( out && fclose( out ) ) r = 1;
+  delete_dataset( d );
+  if ( r ) {
+    printf("%s: unable to write the recovered file\n", test);
+    failures++;
+    return;
+  }
+  e = new_dataset_from_file( RECOVERED_FILE, NULL, 0 );
+  if ( check_samples( test, e, head ) != n ) {
+    printf("%s: recovered file does not read back\n", test);
+    failures++;
+  }
+  if ( e ) delete_dataset( e );
+}
+
+// Write, damage and recover a file in one of the encodings.
+static void
+test_encoding(int strings, unsigned int flags)
+{
+  char test[100];
+  struct stat st;
+  FILE *f;
+  int blocks = ( flags & DS_FILE_COMPRESSED ) != 0;
+
+  sprintf( test, "v1%s%s%s",
+	   ( flags & DS_FILE_COMPRESSED ) ? " compressed" : "",
+	   ( flags & DS_FILE_CHECKSUMMED ) ? " checksummed" : "",
+	   strings ? " with strings" : "" );
+
+  if ( write_file( strings, flags ) || stat( TEST_FILE, &st ) ) {
+    printf("%s: write failed\n", test);
+    failures++;
+    return;
+  }
+
+  // Cut the file a few bytes into its last frame or block.  Only the
+  // last block of a compressed file is lost, and only the last frame
+  // of any other.
+  if ( truncate( TEST_FILE, st.st_size - 7 ) ) {
+    perror( TEST_FILE );
+    exit( 1 );
+  }
+  strcat( test, " truncated" );
+  recover( test, blocks ? SAMPLES / 2 : SAMPLES - 1, blocks ? SAMPLES / 2 : SAMPLES - 1 );
+
+  // Damage a few bytes in the middle, which the checksums detect.
+  if ( flags & DS_FILE_CHECKSUMMED ) {
+    f = fopen( TEST_FILE, "r+b" );
+    if ( f == NULL ) {
+      perror( TEST_FILE );
+      exit( 1 );
+    }
+    fseek( f, st.st_size / 2, SEEK_SET );
+    fwrite( "\x55\xaa\x55", 1, 3, f );
+    fclose( f );
+    strcat( test, " and damaged" );
+    recover( test, blocks ? SAMPLES / 2 : SAMPLES - 4, SAMPLES / 4 );
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int strings;
+
+  ds_error_stream( stderr );
+
+  for ( strings = 0; strings < 2; strings++ ) {
+    test_encoding( strings, 0 );
+    test_encoding( strings, DS_FILE_COMPRESSED );
+    test_encoding( strings, DS_FILE_CHECKSUMMED );
+    test_encoding( strings, DS_FILE_COMPRESSED | DS_FILE_CHECKSUMMED );
+  }
+  unlink( TEST_FILE );
+  unlink( RECOVERED_FILE );
+
+  if ( failures ) printf("%d failures.\n", failures);
+  else printf("All dataset recovery tests passed.\n");
+  return failures != 0;
+}
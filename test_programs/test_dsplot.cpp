@@ -0,0 +1,445 @@
+// test_dsplot.c : check the text written by ds_print_columns, which
+// formats the output of dsplot, and the files dsplot writes.
+//
+// Copyright (c) 2005 Garth Zeglin. Provided under the terms of the
+// GNU General Public License as included in the top level directory.
+//
+// Each number of the text must read back as the same value.  Where
+// the library has std::to_chars, it must also have no more
+// significant digits than the shortest text which does.  The NumPy
+// arrays and mrdplot files are written by running
+// ../data_utilities/dsplot, which must have been built, on a file read
+// both with -r and from standard input, in a directory of their own
+// which is removed afterwards.
+// Prints a line for each failure and exits nonzero if there were any.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <unistd.h>
+#include <utility/dataset.h>
+
+#if defined(__has_include) && __cplusplus >= 201703L
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+#endif
+
+#define TEXT_FILE "test_dsplot.txt"
+#define DATA_FILE "test_dsplot.data"
+
+// dsplot as seen from the directory of the files it writes
+#define DSPLOT "../../data_utilities/dsplot"
+
+// more samples than the tool converts at a time
+#define SAMPLES 3000
+
+static int failures = 0;
+
+// The values printed.
+#define VALUES 16
+static const double values[VALUES] = { 0.0, 0.1, 1.0 / 3, -2.5, 0.30000000000000004, 1e-7, 1e21, 1e-300, 5e-324,
+				       1e300, DBL_MAX, 123456789012345678.0, 100.0, NAN, INFINITY, -INFINITY };
+static const int ints[VALUES] = { 0, 1, -1, 42, INT_MAX, INT_MIN, 100, -100, 7, 1000000, 999999999, -12345, 10, 3, 2, 1 };
+
+// Create a dataset of an int, a float, a double and a string holding
+// the values.
+static dataset_t *
+make_dataset(void)
+{
+  dataset_t *d = new_dataset( 4 );
+  char label[20];
+  int j;
+
+  ds_set_columns( d, VALUES );
+  ds_init_variable( d, 0, (char *) "i", NULL, DS_INT, DS_DIMENSIONLESS, 0, 1 );
+  ds_init_variable( d, 1, (char *) "f", NULL, DS_FLOAT, DS_DIMENSIONLESS, 0, 1 );
+  ds_init_variable( d, 2, (char *) "x", NULL, DS_DOUBLE, DS_DIMENSIONLESS, 0, 1 );
+  ds_init_variable( d, 3, (char *) "s", NULL, DS_STRING, DS_DIMENSIONLESS, 0, 1 );
+  for ( j = 0; j < VALUES; j++ ) {
+    ds_int( d, 0 )[j]    = ints[j];
+    ds_float( d, 1 )[j]  = (float) values[j];
+    ds_double( d, 2 )[j] = values[j];
+    sprintf( label, "s%d", j );
+    ds_set_string( d, 3, j, label );
+  }
+  d->samples = VALUES;
+  return d;
+}
+
+// The number of significant digits in the text of a number.
+static int
+significant_digits(const char *text)
+{
+  int n = 0, zeros = 0, leading = 1;
+
+  for ( ; *text && *text != 'e' && *text != 'E'; text++ ) {
+    if ( *text < '0' || *text > '9' || ( *text == '0' && leading ) ) continue;
+    leading = 0;
+    if ( *text == '0' ) zeros++;
+    else {
+      n += zeros + 1;
+      zeros = 0;
+    }
+  }
+  return n;
+}
+
+// The fewest significant digits which read back as the value, as a
+// float or as a double.
+static int
+shortest_digits(double value, int single)
+{
+  char text[40];
+  int p;
+
+  for ( p = 1; p < 17; p++ ) {
+    sprintf( text, "%.*g", p, value );
+    if ( single ? strtof( text, NULL ) == (float) value : strtod( text, NULL ) == value ) break;
+  }
+  return p;
+}
+
+// Check the text of a floating point number against its value.
+static int
+check_number(const char *text, double value, int single)
+{
+  double back = single ? strtof( text, NULL ) : strtod( text, NULL );
+
+  if ( value != value ) return back != back;
+  if ( back != value ) return 0;
+#ifdef __cpp_lib_to_chars
+  return value == 0.0 || isinf( value ) || significant_digits( text ) <= shortest_digits( value, single );
+#else
+  return 1;
+#endif
+}
+
+// Print every "step"th column from "first" of the dataset and check
+// the text.
+static void
+check_columns(const char *test, dataset_t *d, int first, int step)
+{
+  int rows[4] = { 0, 1, 2, 3 };
+  char line[200], i[40], f[40], x[40], s[40], label[20];
+  FILE *file;
+  int j = first, r;
+
+  file = fopen( TEXT_FILE, "w+" );
+  if ( file == NULL ) {
+    perror( TEXT_FILE );
+    exit( 1 );
+  }
+  r = ds_print_columns( d, file, rows, 4, first, VALUES - first, step );
+  rewind( file );
+  while ( !r && fgets( line, sizeof( line ), file ) != NULL ) {
+    sprintf( label, "\"s%d\"", j );
+    if ( j >= VALUES || sscanf( line, "%39s %39s %39s %39s", i, f, x, s ) != 4 ) break;
+    if ( strtol( i, NULL, 10 ) != ints[j] || !check_number( f, (float) values[j], 1 ) ||
+	 !check_number( x, values[j], 0 ) || strcmp( s, label ) ) {
+      printf("%s: column %d printed as %s", test, j, line);
+      failures++;
+    }
+    j += step;
+  }
+  if ( r || j < VALUES || !feof( file ) ) {
+    printf("%s: printed up to column %d of %d\n", test, j, VALUES);
+    failures++;
+  }
+  fclose( file );
+  unlink( TEXT_FILE );
+}
+
+// The value of a variable of the data file in sample k, and the
+// NumPy type and size of the variable.
+static double
+file_value(const char *name, int k)
+{
+  if ( !strcmp( name, "t" ) ) return k * 0.002;
+  if ( !strcmp( name, "record_dt" ) ) return 0.002;
+  if ( !strcmp( name, "i" ) ) return k;
+  if ( !strcmp( name, "f" ) ) return k * 0.5f;
+  return k * 0.25;
+}
+
+static int
+file_type(const char *name, char *descr)
+{
+  unsigned one = 1;
+  char order = ( *(unsigned char *) &one ) ? '<' : '>';
+  int size = !strcmp( name, "i" ) ? 4 : !strcmp( name, "f" ) ? 4 : 8;
+
+  sprintf( descr, "'%c%s'", order, !strcmp( name, "i" ) ? "i4" : size == 4 ? "f4" : "f8" );
+  return size;
+}
+
+// Write the data file: a time base, the sampling interval, an int, a
+// float, a double and a string.
+static void
+write_data_file(void)
+{
+  dataset_t *d = new_dataset( 6 );
+  FILE *f;
+  int k, r;
+
+  ds_set_columns( d, SAMPLES );
+  ds_init_variable( d, 0, (char *) "t", (char *) "time", DS_DOUBLE, DS_DIMENSIONLESS, 0, 1 );
+  ds_init_variable( d, 1, (char *) "record_dt", (char *) "sampling interval", DS_DOUBLE, DS_DIMENSIONLESS, 0, 1 );
+  ds_init_variable( d, 2, (char *) "i", (char *) "sample index", DS_INT, DS_DIMENSIONLESS, 0, 1 );
+  ds_init_variable( d, 3, (char *) "f", (char *) "half index", DS_FLOAT, DS_DIMENSIONLESS, 0, 1 );
+  ds_init_variable( d, 4, (char *) "x", (char *) "quarter index", DS_DOUBLE, DS_METERS, 0, 1 );
+  ds_init_variable( d, 5, (char *) "s", (char *) "label", DS_STRING, DS_DIMENSIONLESS, 0, 0 );
+  for ( k = 0; k < SAMPLES; k++ ) {
+    ds_double( d, 0 )[k] = file_value( "t", k );
+    ds_double( d, 1 )[k] = file_value( "record_dt", k );
+    ds_int( d, 2 )[k]    = k;
+    ds_float( d, 3 )[k]  = (float) file_value( "f", k );
+    ds_double( d, 4 )[k] = file_value( "x", k );
+    ds_set_string( d, 5, k, ( k & 1 ) ? "odd" : "even" );
+  }
+  d->samples = SAMPLES;
+
+  f = fopen( DATA_FILE, "wb" );
+  if ( f == NULL ) {
+    perror( DATA_FILE );
+    exit( 1 );
+  }
+  r = ds_write_dataset( d, f );
+  if ( fclose( f ) || r ) {
+    printf("unable to write %s\n", DATA_FILE);
+    exit( 1 );
+  }
+  delete_dataset( d );
+}
+
+// Run dsplot with the given arguments.  Returns 0 if it succeeded.
+static int
+run_dsplot(const char *test, const char *args)
+{
+  char command[200];
+
+  sprintf( command, "%s %s 2>/dev/null >/dev/null", DSPLOT, args );
+  if ( system( command ) ) {
+    printf("%s: %s failed\n", test, command);
+    failures++;
+    return 1;
+  }
+  return 0;
+}
+
+// Check the named variables, one after another in each record of
+// "data", against the data file.
+static void
+check_records(const char *test, const unsigned char *data, const char **names, int count)
+{
+  char descr[10];
+  int k, v, size;
+  int i;
+  float f;
+  double x;
+
+  for ( k = 0; k < SAMPLES; k++ ) {
+    for ( v = 0; v < count; v++, data += size ) {
+      size = file_type( names[v], descr );
+      if ( !strcmp( names[v], "i" ) ) { memcpy( &i, data, size ); x = i; }
+      else if ( size == 4 ) { memcpy( &f, data, size ); x = f; }
+      else memcpy( &x, data, size );
+      if ( x != file_value( names[v], k ) ) {
+	printf("%s: wrong %s in sample %d\n", test, names[v], k);
+	failures++;
+	return;
+      }
+    }
+  }
+}
+
+// Read a .npy file of SAMPLES records of the given type, checking the
+// header.  Returns the records, or NULL on failure.
+static unsigned char *
+read_npy(const char *test, const char *filename, const char *descr, int size)
+{
+  unsigned char prefix[10], *data = NULL;
+  char *header = NULL, expected[200];
+  unsigned length = 0, shape = 0;
+  FILE *f = fopen( filename, "rb" );
+
+  sprintf( expected, "{'descr': %s, 'fortran_order': False, 'shape': (", descr );
+  if ( f == NULL || fread( prefix, 1, 10, f ) != 10 || memcmp( prefix, "\x93NUMPY\x01\x00", 8 ) ) {
+    printf("%s: %s is not a version 1.0 array\n", test, filename);
+  } else if ( ( length = prefix[8] | ( prefix[9] << 8 ) ), ( 10 + length ) % 64 ) {
+    printf("%s: data of %s does not start on a 64 byte boundary\n", test, filename);
+  } else if ( ( header = (char *) calloc( length + 1, 1 ) ) == NULL || fread( header, 1, length, f ) != length ||
+	      header[length - 1] != '\n' || strncmp( header, expected, strlen( expected ) ) ||
+	      sscanf( header + strlen( expected ), "%u", &shape ) != 1 || shape != SAMPLES ) {
+    printf("%s: %s has the header %s", test, filename, header ? header : "\n");
+  } else {
+    data = (unsigned char *) malloc( (size_t) size * SAMPLES + 1 );
+    if ( fread( data, size, SAMPLES, f ) != SAMPLES || fgetc( f ) != EOF ) {
+      printf("%s: %s does not hold %d records\n", test, filename, SAMPLES);
+      free( data );
+      data = NULL;
+    }
+  }
+  if ( data == NULL ) failures++;
+  if ( header ) free( header );
+  if ( f ) fclose( f );
+  unlink( filename );
+  return data;
+}
+
+// Check a structured array of the named variables.
+static void
+check_structured(const char *test, const char *filename, const char **names, int count)
+{
+  char descr[200], type[10];
+  unsigned char *data;
+  int v, size = 0;
+
+  strcpy( descr, "[" );
+  for ( v = 0; v < count; v++ ) {
+    size += file_type( names[v], type );
+    sprintf( descr + strlen( descr ), "%s('%s', %s)", v ? ", " : "", names[v], type );
+  }
+  strcat( descr, "]" );
+  data = read_npy( test, filename, descr, size );
+  if ( data ) check_records( test, data, names, count );
+  free( data );
+}
+
+// Write NumPy arrays with dsplot -n: an array per named variable, or
+// a structured array of the named variables or of all the numeric
+// ones.  A string variable is left out.
+static void
+test_numpy(const char *test, const char *input)
+{
+  const char *names[] = { "x", "i", "f" };
+  const char *all[] = { "t", "record_dt", "i", "f", "x" };
+  char args[100], descr[10];
+  unsigned char *data;
+  int v;
+
+  sprintf( args, "-n %s x i f s", input );
+  if ( !run_dsplot( test, args ) ) {
+    for ( v = 0; v < 3; v++ ) {
+      char filename[20];
+      sprintf( filename, "%s.npy", names[v] );
+      data = read_npy( test, filename, descr, file_type( names[v], descr ) );
+      if ( data ) check_records( test, data, names + v, 1 );
+      free( data );
+    }
+  }
+
+  sprintf( args, "-n -fnamed.npy %s x i f", input );
+  if ( !run_dsplot( test, args ) ) check_structured( test, "named.npy", names, 3 );
+
+  sprintf( args, "-n %s", input );
+  if ( !run_dsplot( test, args ) ) check_structured( test, "dsdata.npy", all, 5 );
+}
+
+// Check an mrdplot file of the named variables: the header of counts,
+// sampling rate, names and units, then the samples as rows of big
+// endian floats.
+static void
+check_mrdplot(const char *test, const char *filename, const char **names, int count)
+{
+  char header[300], name[40], units[40], *p;
+  const char *expected;
+  unsigned char value[4];
+  unsigned bits;
+  int total, vars, samples, k, v, n;
+  double freq;
+  float f;
+  FILE *file = fopen( filename, "rb" );
+
+  if ( file == NULL || fgets( header, sizeof( header ), file ) == NULL ||
+       sscanf( header, "%d %d %d%n", &total, &vars, &samples, &n ) != 3 ) {
+    printf("%s: %s has no header\n", test, filename);
+    failures++;
+    if ( file ) fclose( file );
+    unlink( filename );
+    return;
+  }
+  freq = strtod( header + n, &p );
+  if ( total != count * SAMPLES || vars != count || samples != SAMPLES || fabs( freq - 500 ) > 1e-6 ) {
+    printf("%s: %s has the header %s", test, filename, header);
+    failures++;
+  }
+  for ( v = 0; v < count && v < vars; v++, p += n ) {
+    expected = strcmp( names[v], "x" ) ? "-" : ds_get_units_string( DS_METERS );
+    if ( sscanf( p, "%39s %39s%n", name, units, &n ) != 2 || strcmp( name, names[v] ) || strcmp( units, expected ) ) {
+      printf("%s: %s names %s %s instead of %s %s\n", test, filename, name, units, names[v], expected);
+      failures++;
+      break;
+    }
+  }
+
+  for ( k = 0; k < SAMPLES; k++ ) {
+    for ( v = 0; v < count; v++ ) {
+      f = (float) file_value( names[v], k );
+      memcpy( &bits, &f, sizeof( bits ) );
+      if ( fread( value, 1, 4, file ) != 4 || value[0] != ( bits >> 24 ) || value[1] != ( ( bits >> 16 ) & 0xff ) ||
+	   value[2] != ( ( bits >> 8 ) & 0xff ) || value[3] != ( bits & 0xff ) ) {
+	printf("%s: wrong %s in sample %d of %s\n", test, names[v], k, filename);
+	failures++;
+	k = SAMPLES;
+	break;
+      }
+    }
+  }
+  if ( k == SAMPLES && fgetc( file ) != EOF ) {
+    printf("%s: %s holds more than %d samples\n", test, filename, SAMPLES);
+    failures++;
+  }
+  fclose( file );
+  unlink( filename );
+}
+
+// Write mrdplot files with dsplot -m, of the named numeric variables
+// or of all of them, with the rate taken from record_dt.
+static void
+test_mrdplot(const char *test, const char *input)
+{
+  const char *names[] = { "x", "i", "f" };
+  const char *all[] = { "t", "record_dt", "i", "f", "x" };
+  char args[100];
+
+  sprintf( args, "-m %s x i f s", input );
+  if ( !run_dsplot( test, args ) ) check_mrdplot( test, "mrddata.fig", names, 3 );
+
+  sprintf( args, "-m -fnamed.fig %s", input );
+  if ( !run_dsplot( test, args ) ) check_mrdplot( test, "named.fig", all, 5 );
+}
+
+int main(int argc, char **argv)
+{
+  char directory[] = "test_dsplot.XXXXXX";
+  dataset_t *d;
+
+  ds_error_stream( stderr );
+
+  d = make_dataset();
+  check_columns( "text", d, 0, 1 );
+  check_columns( "every third", d, 1, 3 );
+  ds_set_frame_layout( d, 1 );
+  check_columns( "text of frames", d, 0, 1 );
+  delete_dataset( d );
+
+  if ( mkdtemp( directory ) == NULL || chdir( directory ) ) {
+    perror( directory );
+    exit( 1 );
+  }
+  write_data_file();
+  test_numpy( "numpy", "-r" DATA_FILE );
+  test_numpy( "numpy from standard input", "<" DATA_FILE );
+  test_mrdplot( "mrdplot", "-r" DATA_FILE );
+  test_mrdplot( "mrdplot from standard input", "<" DATA_FILE );
+  unlink( DATA_FILE );
+  if ( chdir( ".." ) || rmdir( directory ) ) perror( directory );
+
+  if ( failures ) printf("%d failures.\n", failures);
+  else printf("All dsplot tests passed.\n");
+  return failures != 0;
+}
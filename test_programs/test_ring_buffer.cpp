@@ -0,0 +1,675 @@
+// test_ring_buffer.c : record ring buffers in memory and check what
+// they hold, in the usual layout and in the frame layout.
+//
+// Copyright (c) 2005 Garth Zeglin. Provided under the terms of the
+// GNU General Public License as included in the top level directory.
+//
+// Each ring is recorded past its end so that it wraps, then checked
+// through the file written by write_ring_buffer, through the rows
+// read as arrays of doubles, and after switching back to the usual
+// layout, with and without decimated variables.  The rules which
+// choose the recorded variables are checked too, and the groups of
+// the decimated variables in files begun after a clear or a stream
+// start, the files of triggered captures, and quantized variables.  Files are written in
+// the current directory, or in data/ if it exists, and deleted
+// afterwards; the captures go in a directory of their own.  Prints a line for each failure
+// and exits nonzero if there were any.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <math.h>
+#include <utility/record.h>
+
+#define RING 100
+#define SAMPLES 250
+#define RULES_FILE "test_ring_buffer.rules"
+#define TEST_FILE "test_ring_buffer.data"
+#define PERIOD 20                  // the groups of all the divisors below
+
+static int i, offset_i;
+static float f;
+static double x, offset_x;
+static char state[SYS_STRING_LEN+1];
+
+static system_state_var_t system_vars[] = {
+  { (char *) "i", SYS_INT, &i },
+  { (char *) "f", SYS_FLOAT, &f },
+  { (char *) "x", SYS_DOUBLE, &x },
+  { (char *) "state", SYS_STRING, state },
+  { (char *) "offset.i", SYS_INT, &offset_i },
+  { (char *) "offset.x", SYS_DOUBLE, &offset_x },
+  { NULL, SYS_NOTYPE, NULL }
+};
+#define NUM_VARS 6
+
+// the divisors of the decimated rings
+static const unsigned char decimated[NUM_VARS] = { 1, 1, 1, 2, 4, 5 };
+
+static int failures = 0;
+
+// Set the variables to the values of sample k.
+static void
+set_sample(int k)
+{
+  i = k;
+  f = k * 0.5f;
+  x = k * 0.25;
+  sprintf( state, "s%d", k % 7 );
+  offset_i = k;
+  offset_x = k * 0.25;
+}
+
+// Record samples first..last-1.
+static void
+record(dataset_t *d, int first, int last)
+{
+  int k;
+
+  for ( k = first; k < last; k++ ) {
+    set_sample( k );
+    ring_buffer_snapshot( system_vars, d, NUM_VARS );
+  }
+}
+
+// The value of a numeric variable in sample k, which depends on the
+// last letter of its name.
+static double
+expected(const char *name, int k)
+{
+  switch ( name[strlen( name ) - 1] ) {
+  case 'i': return k;
+  case 'f': return k * 0.5;
+  default:  return k * 0.25;
+  }
+}
+
+// The sample whose value a variable holds in sample k.  Decimated
+// variables hold the value of the first sample of each group in the
+// frame layout, and record every sample in the usual layout.
+static int
+held_sample(dataset_t *d, int row, int k, int held)
+{
+  return held ? k - k % d->vars[row].decimation : k;
+}
+
+// Check that a dataset in the usual layout holds samples
+// first..first+n-1, with the numeric values multiplied by "sign".
+static void
+check(const char *test, dataset_t *d, int first, int n, int sign, int held)
+{
+  int j, row;
+
+  if ( (int) d->samples != n ) {
+    printf("%s: holds %u samples instead of %d\n", test, d->samples, n);
+    failures++;
+    return;
+  }
+  for ( row = 0; row < d->variables; row++ ) {
+    const char *name = d->vars[row].name;
+
+    for ( j = 0; j < n; j++ ) {
+      int k = held_sample( d, row, first + j, held );
+      int col = (d->startpos + j) % d->columns;
+      double value = sign * expected( name, k );
+      int good;
+
+      switch ( d->vars[row].type ) {
+      case DS_INT:    good = ds_int( d, row )[col] == value; break;
+      case DS_FLOAT:  good = ds_float( d, row )[col] == value; break;
+      case DS_DOUBLE: good = ds_double( d, row )[col] == value; break;
+      default: {
+	const char *s = ds_get_string( d, row, col );
+	char label[20];
+	sprintf( label, "s%d", k % 7 );
+	good = s != NULL && !strcmp( s, label );
+      }
+      }
+      if ( !good ) {
+	printf("%s: wrong value of %s in sample %d\n", test, name, first + j);
+	failures++;
+	return;
+      }
+    }
+  }
+}
+
+// Write the ring out with write_ring_buffer and check the file.
+static void
+check_file(const char *test, dataset_t *d, int first, int n, int held)
+{
+  char *filename = write_ring_buffer( d );
+  dataset_t *e = filename ? new_dataset_from_file( filename, NULL, 0 ) : NULL;
+
+  if ( e == NULL ) {
+    printf("%s: unable to write and read the file\n", test);
+    failures++;
+  } else {
+    check( test, e, first, n, 1, held );
+    delete_dataset( e );
+  }
+  if ( filename ) {
+    unlink( filename );
+    free( filename );
+  }
+}
+
+// Check the numeric rows read with ds_row_as_double_array, then
+// negate them with ds_set_row_from_double_array.
+static void
+check_rows(const char *test, dataset_t *d, int first, int n, int held)
+{
+  int row, j;
+
+  for ( row = 0; row < d->variables; row++ ) {
+    const char *name = d->vars[row].name;
+    double *a = ds_row_as_double_array( d, row );
+
+    if ( d->vars[row].type == DS_STRING ) {
+      if ( a != NULL ) {
+	printf("%s: string row %s read as numbers\n", test, name);
+	failures++;
+	free( a );
+      }
+      continue;
+    }
+    if ( a == NULL ) {
+      printf("%s: unable to read row %s\n", test, name);
+      failures++;
+      continue;
+    }
+    for ( j = 0; j < n; j++ ) {
+      if ( a[j] != expected( name, held_sample( d, row, first + j, held ) ) ) {
+	printf("%s: wrong value of %s in sample %d of the row\n", test, name, first + j);
+	failures++;
+	break;
+      }
+      a[j] = -a[j];
+    }
+    ds_set_row_from_double_array( d, row, a );
+    free( a );
+  }
+}
+
+// Record a ring in either layout, of all variables or with the
+// divisors in "flags", and check it every way.
+static void
+test_layout(const char *test, int frames, const unsigned char *flags)
+{
+  dataset_t *d;
+  int n;
+
+  if ( flags ) d = create_masked_ring_buffer( system_vars, RING, NUM_VARS, flags );
+  else d = create_ring_buffer( system_vars, RING, NUM_VARS );
+
+  ring_buffer_frame_layout( d, frames );
+  if ( frames && d->frames == NULL ) {
+    printf("%s: not in the frame layout\n", test);
+    failures++;
+  }
+  record( d, 0, SAMPLES );
+
+  // a full ring, less the columns up to a group boundary of the
+  // decimated variables
+  n = d->samples;
+  if ( flags && frames ? ( d->startpos % PERIOD != 0 || n <= RING - PERIOD ) : n != RING ) {
+    printf("%s: holds %d samples from column %u\n", test, n, d->startpos);
+    failures++;
+  }
+  check_file( test, d, SAMPLES - n, n, frames );
+  check_rows( test, d, SAMPLES - n, n, frames );
+
+  // the values survive the switch back, negated by check_rows
+  ring_buffer_frame_layout( d, 0 );
+  check( test, d, SAMPLES - n, n, -1, frames );
+  delete_dataset( d );
+}
+
+// Check that a file holds at least "least" samples and that the
+// groups of the decimated variables begin at its first sample, so
+// that each value is that of the sample which begins its group, then
+// delete the file.
+static void
+check_groups(const char *test, char *filename, int least)
+{
+  dataset_t *e = filename ? new_dataset_from_file( filename, NULL, 0 ) : NULL;
+  int row, j, si;
+
+  if ( e == NULL || ( si = ds_find_variable( e, "i" ) ) < 0 ) {
+    printf("%s: unable to write and read the file\n", test);
+    failures++;
+  } else if ( (int) e->samples < least ) {
+    printf("%s: file holds %u samples instead of %d\n", test, e->samples, least);
+    failures++;
+  } else {
+    for ( row = 0; row < e->variables; row++ ) {
+      const char *name = e->vars[row].name;
+      int divisor = e->vars[row].decimation;
+
+      for ( j = 0; j < (int) e->samples && divisor > 1; j++ ) {
+	int k = ds_int( e, si )[j - j % divisor];
+	char label[20];
+	int good;
+
+	sprintf( label, "s%d", k % 7 );
+	switch ( e->vars[row].type ) {
+	case DS_INT:    good = ds_int( e, row )[j] == expected( name, k ); break;
+	case DS_FLOAT:  good = ds_float( e, row )[j] == expected( name, k ); break;
+	case DS_DOUBLE: good = ds_double( e, row )[j] == expected( name, k ); break;
+	default:        good = !strcmp( ds_get_string( e, row, j ), label );
+	}
+	if ( !good ) {
+	  printf("%s: %s out of phase in sample %d of the file\n", test, name, j);
+	  failures++;
+	  break;
+	}
+      }
+    }
+  }
+  if ( e ) delete_dataset( e );
+  if ( filename ) {
+    unlink( filename );
+    free( filename );
+  }
+}
+
+// Write files of a decimated ring after clearing it, and stream one
+// started in the middle of a group.  A clear skips to the next group
+// boundary but keeps every sample recorded after it.
+static void
+test_groups(void)
+{
+  dataset_t *d = create_masked_ring_buffer( system_vars, RING, NUM_VARS, decimated );
+  ring_buffer_stream_t *s;
+  int k;
+
+  ring_buffer_frame_layout( d, 1 );
+  record( d, 0, 10 );
+  clear_ring_buffer( d );
+  record( d, 10, 23 );
+  check_groups( "cleared", write_ring_buffer( d ), 23 - 10 );
+
+  clear_ring_buffer( d );
+  record( d, 23, 130 );
+  check_groups( "cleared and wrapped", write_ring_buffer( d ), RING - PERIOD );
+
+  record( d, 130, 133 );
+  s = start_ring_buffer_stream( d, 5 );
+  if ( s == NULL ) {
+    printf("streamed: unable to start\n");
+    failures++;
+  } else {
+    for ( k = 133; k < 170; k++ ) {
+      set_sample( k );
+      ring_buffer_stream_snapshot( system_vars, s, NUM_VARS );
+    }
+    check_groups( "streamed", stop_ring_buffer_stream( s, 1 ), 37 - PERIOD );
+  }
+  delete_dataset( d );
+}
+
+// Check the recording flags against the expected ones, a digit for
+// each variable.
+static void
+check_flags(const char *test, const unsigned char *flags, const char *expected)
+{
+  int v;
+
+  for ( v = 0; v < NUM_VARS; v++ ) {
+    if ( flags[v] != expected[v] - '0' ) {
+      printf("%s: %s flagged %d\n", test, system_vars[v].name, flags[v]);
+      failures++;
+    }
+  }
+}
+
+// Choose variables by rules, one at a time and from a file, and
+// record a ring of just those.
+static void
+test_rules(void)
+{
+  const char *test = "rules";
+  const char *malformed[] = { "offset.i", "+", "-   ", "*x", "/0 x", "/256 x", "/ x", "/4" };
+  unsigned char flags[NUM_VARS];
+  dataset_t *d;
+  FILE *file;
+  int r;
+  unsigned k;
+
+  memset( flags, 1, sizeof( flags ) );
+  if ( ring_buffer_select_variables( system_vars, NUM_VARS, flags, "-offset*" ) ||
+       ring_buffer_select_variables( system_vars, NUM_VARS, flags, "  +offset.x  " ) ||
+       ring_buffer_select_variables( system_vars, NUM_VARS, flags, "/3 f" ) ) {
+    printf("%s: valid rule refused\n", test);
+    failures++;
+  }
+  for ( k = 0; k < sizeof( malformed ) / sizeof( malformed[0] ); k++ ) {
+    if ( ring_buffer_select_variables( system_vars, NUM_VARS, flags, malformed[k] ) != 1 ) {
+      printf("%s: malformed rule \"%s\" accepted\n", test, malformed[k]);
+      failures++;
+    }
+  }
+  check_flags( test, flags, "131101" );
+
+  // later rules override earlier ones; the bad line is reported and
+  // skipped
+  file = fopen( RULES_FILE, "w" );
+  if ( file == NULL ) {
+    perror( RULES_FILE );
+    exit( 1 );
+  }
+  fputs( "# record the state and its offsets\n"
+	 "-*\n"
+	 "\n"
+	 "+i\n"
+	 "   +f   # half the index\n"
+	 "+state\n"
+	 "bogus\n"
+	 "+offset.*\n"
+	 "-offset.i\n"
+	 "/4offset.x\n", file );
+  fclose( file );
+  memset( flags, 1, sizeof( flags ) );
+  r = ring_buffer_select_from_file( system_vars, NUM_VARS, flags, RULES_FILE );
+  if ( r != 1 ) {
+    printf("%s: rule file returned %d\n", test, r);
+    failures++;
+  }
+  check_flags( test, flags, "110104" );
+  unlink( RULES_FILE );
+  if ( ring_buffer_select_from_file( system_vars, NUM_VARS, flags, RULES_FILE ) != -1 ) {
+    printf("%s: missing rule file not reported\n", test);
+    failures++;
+  }
+
+  // only the flagged variables are recorded
+  d = create_masked_ring_buffer( system_vars, RING, NUM_VARS, flags );
+  ring_buffer_frame_layout( d, 1 );
+  if ( d->variables != 4 || ds_find_variable( d, "x" ) >= 0 || ds_find_variable( d, "offset.i" ) >= 0 ) {
+    printf("%s: recorded %d variables\n", test, d->variables);
+    failures++;
+  }
+  record( d, 0, SAMPLES );
+  check_file( test, d, SAMPLES - d->samples, d->samples, 1 );
+  delete_dataset( d );
+}
+
+// Compare two values, taking NaN as equal to itself.
+static int
+same(double a, double b)
+{
+  return a == b || ( a != a && b != b );
+}
+
+// The quantized values: a double and a float kept in steps of 0.5
+// from 10, and an int in steps of 2.  The values stored are rounded
+// to the nearest step, saturate at +/-32767 steps, and keep NaN.
+#define QUANTIZED 11
+static const double quantized_values[QUANTIZED] = { 10.0, 10.5, 10.74, 10.76, 9.76, NAN, 1e9, -1e9, 10.0 + 32767 * 0.5, 10.0 - 32768 * 0.5, INFINITY };
+static const short quantized_counts[QUANTIZED] = { 0, 1, 1, 2, 0, -32768, 32767, -32767, 32767, -32767, 32767 };
+static const int quantized_ints[QUANTIZED] = { 0, 3, 5, -5, 100000, -100000, 1, -1, 2, -2, 7 };
+static const short quantized_int_counts[QUANTIZED] = { 0, 2, 3, -2, 32767, -32767, 1, 0, 1, -1, 4 };
+
+// Check the values of a dataset in the usual layout against the
+// quantized values.
+static void
+check_quantized(const char *test, dataset_t *d)
+{
+  int j;
+
+  if ( d == NULL || d->samples != QUANTIZED ) {
+    printf("%s: unable to read the values\n", test);
+    failures++;
+    return;
+  }
+  for ( j = 0; j < QUANTIZED; j++ ) {
+    double value = ( quantized_counts[j] == -32768 ) ? NAN : 10.0 + 0.5 * quantized_counts[j];
+    if ( !same( ds_double( d, 0 )[j], value ) || !same( ds_float( d, 1 )[j], value ) ||
+	 ds_int( d, 2 )[j] != 2 * quantized_int_counts[j] ) {
+      printf("%s: wrong value %d: %g %g %d\n", test, j, ds_double( d, 0 )[j], ds_float( d, 1 )[j], ds_int( d, 2 )[j]);
+      failures++;
+      return;
+    }
+  }
+}
+
+// Quantize values of each type, and record a ring quantized by rules.
+static void
+test_quantization(void)
+{
+  const char *test = "quantized";
+  const char *malformed[] = { "~x f", "~-1 f", "~0 f", "~1f", "~0.5,f f", "~0.5", "f" };
+  dataset_t *d = new_dataset( 3 ), *e;
+  unsigned char flags[NUM_VARS];
+  double *a;
+  FILE *file;
+  int j, k, r, row;
+
+  ds_set_columns( d, QUANTIZED );
+  ds_init_variable( d, 0, (char *) "q", NULL, DS_DOUBLE, DS_DIMENSIONLESS, 0, 1 );
+  ds_init_variable( d, 1, (char *) "qf", NULL, DS_FLOAT, DS_DIMENSIONLESS, 0, 1 );
+  ds_init_variable( d, 2, (char *) "qi", NULL, DS_INT, DS_DIMENSIONLESS, 0, 1 );
+  for ( j = 0; j < QUANTIZED; j++ ) {
+    ds_double( d, 0 )[j] = quantized_values[j];
+    ds_float( d, 1 )[j]  = (float) quantized_values[j];
+    ds_int( d, 2 )[j]    = quantized_ints[j];
+  }
+  d->samples = QUANTIZED;
+  ds_set_quantization( d, 0, 0.5, 10.0 );
+  ds_set_quantization( d, 1, 0.5, 10.0 );
+  ds_set_quantization( d, 2, 2.0, 0.0 );
+
+  for ( j = 0; j < QUANTIZED; j++ ) {
+    if ( ds_quantize( d, 0, quantized_values[j] ) != quantized_counts[j] ||
+	 ds_quantize( d, 2, quantized_ints[j] ) != quantized_int_counts[j] ) {
+      printf("%s: value %d quantized to %d\n", test, j, ds_quantize( d, 0, quantized_values[j] ));
+      failures++;
+    }
+  }
+
+  // the counts are expanded as they leave the frames: as rows, as
+  // files and on the way back to the usual layout
+  ds_set_frame_layout( d, 1 );
+  for ( row = 0; row < 3; row++ ) {
+    a = ds_row_as_double_array( d, row );
+    for ( j = 0; a != NULL && j < QUANTIZED; j++ ) {
+      double value = ( row == 2 ) ? 2.0 * quantized_int_counts[j] :
+	( quantized_counts[j] == -32768 ) ? NAN : 10.0 + 0.5 * quantized_counts[j];
+      if ( !same( a[j], value ) ) break;
+    }
+    if ( a == NULL || j < QUANTIZED ) {
+      printf("%s: wrong value %d of row %s\n", test, j, d->vars[row].name);
+      failures++;
+    }
+    free( a );
+  }
+  file = fopen( TEST_FILE, "wb" );
+  if ( file == NULL ) {
+    perror( TEST_FILE );
+    exit( 1 );
+  }
+  r = ds_write_dataset( d, file );
+  if ( fclose( file ) || r ) {
+    printf("%s: unable to write the file\n", test);
+    failures++;
+  }
+  e = new_dataset_from_file( TEST_FILE, NULL, 0 );
+  check_quantized( "quantized file", e );
+  if ( e ) delete_dataset( e );
+  unlink( TEST_FILE );
+  ds_set_frame_layout( d, 0 );
+  check_quantized( test, d );
+  delete_dataset( d );
+
+  // Selection and quantization rules share a file, each function
+  // ignoring the other kind.
+  for ( k = 0; k < (int) ( sizeof( malformed ) / sizeof( malformed[0] ) ); k++ ) {
+    if ( ring_buffer_quantize_variables( NULL, malformed[k] ) != 1 ) {
+      printf("%s: malformed rule \"%s\" accepted\n", test, malformed[k]);
+      failures++;
+    }
+  }
+  file = fopen( RULES_FILE, "w" );
+  if ( file == NULL ) {
+    perror( RULES_FILE );
+    exit( 1 );
+  }
+  fputs( "-offset.*\n"
+	 "~0.5,-10 f\n"
+	 "~0.25  x   # quarters\n"
+	 "+offset.x\n"
+	 "/4 offset.x\n"
+	 "~0.25 offset.*\n", file );
+  fclose( file );
+  memset( flags, 1, sizeof( flags ) );
+  if ( ring_buffer_select_from_file( system_vars, NUM_VARS, flags, RULES_FILE ) ) {
+    printf("%s: selection refused the rule file\n", test);
+    failures++;
+  }
+  check_flags( test, flags, "111104" );
+  d = create_masked_ring_buffer( system_vars, RING, NUM_VARS, flags );
+  if ( ring_buffer_quantize_from_file( d, RULES_FILE ) ) {
+    printf("%s: quantization refused the rule file\n", test);
+    failures++;
+  }
+  unlink( RULES_FILE );
+  for ( row = 0; row < d->variables; row++ ) {
+    const char *name = d->vars[row].name;
+    double scale = !strcmp( name, "f" ) ? 0.5 : ( !strcmp( name, "x" ) || !strcmp( name, "offset.x" ) ) ? 0.25 : 0.0;
+    if ( d->vars[row].scale != scale ) {
+      printf("%s: %s quantized in steps of %g\n", test, name, d->vars[row].scale);
+      failures++;
+    }
+  }
+
+  // the values are all whole steps, so they come back exactly
+  ring_buffer_frame_layout( d, 1 );
+  record( d, 0, SAMPLES );
+  check_file( test, d, SAMPLES - d->samples, d->samples, 1 );
+  e = ring_buffer_read_recent( d, 50 );
+  if ( e == NULL ) {
+    printf("%s: unable to read the ring\n", test);
+    failures++;
+  } else {
+    check( test, e, SAMPLES - 50, 50, 1, 1 );
+    delete_dataset( e );
+  }
+  delete_dataset( d );
+}
+
+// The condition of the triggered captures.
+static int
+incident(void *arg)
+{
+  return *(int *) arg;
+}
+
+// Record with triggered captures and check the files saved.
+static void
+test_triggers(void)
+{
+  const char *test = "triggered";
+  const char *malformed[] = { "nope > 1", "x >", "x > 1 2", "> 1", "state < a" };
+  // the captures expected: the first sample and the number of
+  // samples; the last is cut short by the stop, so it holds earlier
+  // samples in place of the later ones
+  const int expected[][2] = { { 451, 70 }, { 1951, 70 }, { 2930, 70 } };
+  const unsigned char flags[NUM_VARS] = { 1, 1, 1, 1, 0, 0 };
+  char directory[] = "test_ring_buffer.XXXXXX";
+  int found[3] = { 0, 0, 0 };
+  ring_buffer_trigger_t *t;
+  unsigned int triggers, missed, captures;
+  struct dirent *entry;
+  DIR *dir;
+  int crash = 0, k, c;
+
+  if ( mkdtemp( directory ) == NULL || chdir( directory ) ) {
+    perror( directory );
+    exit( 1 );
+  }
+
+  // 50 samples up to and including the trigger, 20 after
+  t = start_ring_buffer_trigger( system_vars, NUM_VARS, flags, 50, 20, incident, &crash );
+  if ( t == NULL ) {
+    printf("%s: unable to start\n", test);
+    failures++;
+    return;
+  }
+  for ( k = 0; k < (int) ( sizeof( malformed ) / sizeof( malformed[0] ) ); k++ ) {
+    if ( ring_buffer_trigger_when( t, system_vars, NUM_VARS, malformed[k] ) != 1 ) {
+      printf("%s: malformed predicate \"%s\" accepted\n", test, malformed[k]);
+      failures++;
+    }
+  }
+  if ( ring_buffer_trigger_when( t, system_vars, NUM_VARS, "state == fallen over" ) ||
+       ring_buffer_trigger_when( t, system_vars, NUM_VARS, "x==500" ) ) {
+    printf("%s: valid predicate refused\n", test);
+    failures++;
+  }
+
+  // Incidents at 500, again within its capture at 507, at 525 while
+  // it is still being saved, at 2000 by the predicate, and at 2990
+  // just before the end.  The pauses let the writer save.
+  for ( k = 0; k < 3000; k++ ) {
+    set_sample( k );
+    crash = ( k >= 500 && k < 505 ) || ( k >= 507 && k < 510 ) || k == 525 || k >= 2990;
+    ring_buffer_trigger_snapshot( system_vars, t, NUM_VARS );
+    if ( k == 1000 || k == 2500 ) usleep( 200000 );
+  }
+  triggers = t->triggers;
+  missed = t->missed;
+  captures = stop_ring_buffer_trigger( t );
+  if ( triggers != 3 || missed != 1 || captures != 3 ) {
+    printf("%s: %u incidents, %u missed, %u captures\n", test, triggers, missed, captures);
+    failures++;
+  }
+
+  // each capture is a run of samples in a file of its own
+  dir = opendir( "." );
+  while ( dir != NULL && ( entry = readdir( dir ) ) != NULL ) {
+    dataset_t *e;
+    int first;
+
+    if ( entry->d_name[0] == '.' ) continue;
+    e = new_dataset_from_file( entry->d_name, NULL, 0 );
+    first = ( e != NULL && e->samples > 0 ) ? ds_int( e, 0 )[0] : -1;
+    for ( c = 0; c < 3 && expected[c][0] != first; c++ );
+    if ( c == 3 ) {
+      printf("%s: unexpected capture %s\n", test, entry->d_name);
+      failures++;
+    } else {
+      check( test, e, first, expected[c][1], 1, 1 );
+      found[c]++;
+    }
+    if ( e ) delete_dataset( e );
+    unlink( entry->d_name );
+  }
+  if ( dir ) closedir( dir );
+  for ( c = 0; c < 3; c++ ) {
+    if ( found[c] != 1 ) {
+      printf("%s: capture from sample %d saved %d times\n", test, expected[c][0], found[c]);
+      failures++;
+    }
+  }
+  if ( chdir( ".." ) || rmdir( directory ) ) perror( directory );
+}
+
+int main(int argc, char **argv)
+{
+  ds_error_stream( stderr );
+
+  test_layout( "usual layout", 0, NULL );
+  test_layout( "frame layout", 1, NULL );
+  test_layout( "decimated", 0, decimated );
+  test_layout( "decimated frames", 1, decimated );
+  test_rules();
+  test_groups();
+  test_triggers();
+  test_quantization();
+
+  if ( failures ) printf("%d failures.\n", failures);
+  else printf("All ring buffer tests passed.\n");
+  return failures != 0;
+}
@@ -0,0 +1,336 @@
+// test_ring_stream.c : follow a ring buffer from another thread, or
+// from another process through shared memory, while it is recorded,
+// both by ring_buffer_snapshot and by a streamed recording, and read
+// the streamed file back.
+//
+// Copyright (c) 2005 Garth Zeglin. Provided under the terms of the
+// GNU General Public License as included in the top level directory.
+//
+// The reader keeps copying the latest samples with
+// ring_buffer_read_recent until it has seen the last one, checking
+// that each copy is a consistent run.  The ring holds about a second
+// of samples, much less than the recording, so the writer thread of
+// a stream has to keep up.  The streamed file is written in the
+// current directory, or in data/ if it exists, and deleted
+// afterwards.  Prints a line for each failure and exits nonzero if
+// there were any.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <utility/record.h>
+
+#define SHARED_NAME "/test_ring_stream"
+#define RING 16384
+#define SAMPLES 20000
+
+static int i;
+static float f;
+static double x;
+
+static system_state_var_t system_vars[] = {
+  { (char *) "i", SYS_INT, &i },
+  { (char *) "f", SYS_FLOAT, &f },
+  { (char *) "x", SYS_DOUBLE, &x },
+  { NULL, SYS_NOTYPE, NULL }
+};
+#define NUM_VARS 3
+
+// Check that the samples of a dataset are a run ending at or after
+// "last".  Returns the final sample, or -1 if the run is broken.
+static int
+check_run(const char *test, dataset_t *d, int last)
+{
+  unsigned int j;
+  int k = -1;
+
+  for ( j = 0; j < d->samples; j++ ) {
+    k = ds_int( d, 0 )[j];
+    if ( ( j > 0 && k != ds_int( d, 0 )[j-1] + 1 ) || ds_float( d, 1 )[j] != k * 0.5f || ds_double( d, 2 )[j] != k * 0.25 ) {
+      printf("%s: inconsistent sample %d after %d\n", test, k, j > 0 ? ds_int( d, 0 )[j-1] : -1);
+      return -1;
+    }
+  }
+  if ( k < last ) {
+    printf("%s: went back from sample %d to %d\n", test, last, k);
+    return -1;
+  }
+  return k;
+}
+
+// Follow a ring until the last sample shows up.  Returns 0 if all
+// the copies were consistent.
+static int
+follow(const char *test, dataset_t *ring)
+{
+  dataset_t *d;
+  int last = -1, reads = 0, tries;
+
+  for ( tries = 0; last < SAMPLES - 1 && tries < 200000; tries++ ) {
+    d = ring_buffer_read_recent( ring, 500 );
+    if ( d == NULL ) continue;
+    if ( d->samples > 0 ) {
+      last = check_run( test, d, last );
+      reads++;
+    }
+    delete_dataset( d );
+    if ( last < 0 && reads > 0 ) break;
+    usleep( 100 );
+  }
+  if ( last != SAMPLES - 1 ) {
+    printf("%s: reader saw sample %d of %d after %d copies\n", test, last, SAMPLES, reads);
+    return 1;
+  }
+  return 0;
+}
+
+// A reader thread.
+typedef struct {
+  const char *test;
+  dataset_t *ring;
+  int status;
+} reader_t;
+
+static void *
+reader_thread(void *arg)
+{
+  reader_t *r = (reader_t *) arg;
+  r->status = follow( r->test, r->ring );
+  return NULL;
+}
+
+// The child process: attach to the shared ring and follow it.
+// Returns the exit status.
+static int
+shared_reader(const char *test)
+{
+  dataset_t *shared = ds_attach_shared( SHARED_NAME );
+  int status;
+
+  if ( shared == NULL ) {
+    printf("%s: unable to attach\n", test);
+    return 1;
+  }
+  status = follow( test, shared );
+  delete_dataset( shared );
+  return status;
+}
+
+// Record SAMPLES samples into a ring buffer, in the frame layout or
+// not, while another thread follows it, or in the frame layout while
+// a child process follows it through shared memory.  The ring is
+// either streamed to a file, which is then read back, or recorded by
+// ring_buffer_snapshot and cleared now and then.  Returns 0 if all
+// went well.
+static int
+test_recording(int streamed, int frames, int shared)
+{
+  char test[40];
+  ring_buffer_stream_t *s = NULL;
+  dataset_t *d, *e;
+  char *filename;
+  unsigned int overruns;
+  reader_t reader;
+  pthread_t thread;
+  pid_t child = -1;
+  int k, status, failed = 0;
+
+  sprintf( test, "%s%s%s", streamed ? "streamed" : "ring", frames ? " frames" : "", shared ? " shared" : "" );
+  d = create_ring_buffer( system_vars, RING, NUM_VARS );
+  ring_buffer_frame_layout( d, frames );
+  if ( shared && share_ring_buffer( d, SHARED_NAME ) ) {
+    printf("%s: unable to share\n", test);
+    delete_dataset( d );
+    return 1;
+  }
+  if ( streamed ) {
+    s = start_ring_buffer_stream( d, 256 );
+    if ( s == NULL ) {
+      printf("%s: unable to start\n", test);
+      delete_dataset( d );
+      return 1;
+    }
+  }
+
+  if ( shared ) {
+    fflush( stdout );
+    child = fork();
+    if ( child == 0 ) {
+      status = shared_reader( test );
+      fflush( stdout );
+      _exit( status );
+    }
+    if ( child < 0 ) {
+      printf("%s: unable to start the reader\n", test);
+      failed = 1;
+    }
+  } else {
+    reader.test = test;
+    reader.ring = d;
+    reader.status = 1;
+    if ( pthread_create( &thread, NULL, reader_thread, &reader ) ) {
+      printf("%s: unable to start the reader\n", test);
+      failed = 1;
+    }
+  }
+
+  for ( k = 0; k < SAMPLES; k++ ) {
+    i = k;
+    f = k * 0.5f;
+    x = k * 0.25;
+    if ( streamed ) ring_buffer_stream_snapshot( system_vars, s, NUM_VARS );
+    else {
+      ring_buffer_snapshot( system_vars, d, NUM_VARS );
+      if ( k % 5000 == 4999 && k < SAMPLES - 1 ) clear_ring_buffer( d );
+    }
+    // about 16 kHz, so the ring holds a second of samples for the
+    // writer, which checks for new ones every 50 msec
+    if ( k % 16 == 0 ) usleep( 1000 );
+  }
+  if ( shared ) {
+    if ( child < 0 || waitpid( child, &status, 0 ) != child || !WIFEXITED( status ) || WEXITSTATUS( status ) ) failed = 1;
+  } else if ( !failed && ( pthread_join( thread, NULL ) || reader.status ) ) failed = 1;
+
+  if ( !streamed ) {
+    delete_dataset( d );
+    return failed;
+  }
+
+  overruns = s->overruns;
+  filename = stop_ring_buffer_stream( s, 1 );
+  e = filename ? new_dataset_from_file( filename, NULL, 0 ) : NULL;
+  if ( e == NULL ) {
+    printf("%s: unable to read the file back\n", test);
+    failed = 1;
+  } else {
+    if ( e->samples != SAMPLES || check_run( test, e, 0 ) < 0 ) {
+      printf("%s: file holds %u samples, %u dropped\n", test, e->samples, overruns);
+      failed = 1;
+    }
+    delete_dataset( e );
+  }
+  if ( filename ) {
+    unlink( filename );
+    free( filename );
+  }
+  delete_dataset( d );
+  return failed;
+}
+
+// A writer which stopped in the middle of a snapshot leaves the
+// sequence count odd, and a reader must then give up rather than
+// wait for it, whether it reads the ring or attaches to its shared
+// segment.  Returns 0 if all went well.
+static int
+test_stuck(void)
+{
+  const char *test = "stuck";
+  dataset_t *d, *e, *shared;
+  int failed = 0;
+
+  d = create_ring_buffer( system_vars, RING, NUM_VARS );
+  ring_buffer_frame_layout( d, 1 );
+  if ( share_ring_buffer( d, SHARED_NAME ) ) {
+    printf("%s: unable to share\n", test);
+    delete_dataset( d );
+    return 1;
+  }
+  for ( i = 0; i < 10; i++ ) {
+    f = i * 0.5f;
+    x = i * 0.25;
+    ring_buffer_snapshot( system_vars, d, NUM_VARS );
+  }
+
+  d->sequence++;
+  ds_publish_ring( d );
+  e = ring_buffer_read_recent( d, 5 );
+  if ( e != NULL ) {
+    printf("%s: read a ring in the middle of a snapshot\n", test);
+    delete_dataset( e );
+    failed = 1;
+  }
+  e = ds_attach_shared( SHARED_NAME );
+  if ( e != NULL ) {
+    printf("%s: attached to a ring in the middle of a snapshot\n", test);
+    delete_dataset( e );
+    failed = 1;
+  }
+
+  d->sequence++;
+  ds_publish_ring( d );
+  shared = ds_attach_shared( SHARED_NAME );
+  e = shared ? ring_buffer_read_recent( shared, 5 ) : NULL;
+  if ( e == NULL || e->samples != 5 || check_run( test, e, 9 ) != 9 ) {
+    printf("%s: unable to read the ring once the snapshot was done\n", test);
+    failed = 1;
+  }
+  if ( e ) delete_dataset( e );
+  if ( shared ) delete_dataset( shared );
+  delete_dataset( d );
+  return failed;
+}
+
+// A later run shares a smaller ring under the same name while a
+// reader is still attached to the segment of the first; the reader
+// must keep its segment intact.  Returns 0 if all went well.
+static int
+test_reshare(void)
+{
+  const char *test = "reshared";
+  dataset_t *d, *later, *shared, *e;
+  int failed = 0;
+
+  d = create_ring_buffer( system_vars, RING, NUM_VARS );
+  ring_buffer_frame_layout( d, 1 );
+  later = create_ring_buffer( system_vars, 10, NUM_VARS );
+  ring_buffer_frame_layout( later, 1 );
+  if ( share_ring_buffer( d, SHARED_NAME ) ) {
+    printf("%s: unable to share\n", test);
+    delete_dataset( d );
+    delete_dataset( later );
+    return 1;
+  }
+  for ( i = 0; i < 1000; i++ ) {
+    f = i * 0.5f;
+    x = i * 0.25;
+    ring_buffer_snapshot( system_vars, d, NUM_VARS );
+  }
+  shared = ds_attach_shared( SHARED_NAME );
+  if ( share_ring_buffer( later, SHARED_NAME ) ) {
+    printf("%s: unable to share again\n", test);
+    failed = 1;
+  }
+
+  e = shared ? ring_buffer_read_recent( shared, 1000 ) : NULL;
+  if ( e == NULL || e->samples != 1000 || check_run( test, e, 999 ) != 999 ) {
+    printf("%s: unable to read the first ring\n", test);
+    failed = 1;
+  }
+  if ( e ) delete_dataset( e );
+  if ( shared ) delete_dataset( shared );
+  delete_dataset( later );
+  delete_dataset( d );
+  return failed;
+}
+
+int main(int argc, char **argv)
+{
+  int failures = 0;
+
+  ds_error_stream( stderr );
+
+  failures += test_recording( 0, 0, 0 );
+  failures += test_recording( 0, 1, 0 );
+  failures += test_recording( 1, 0, 0 );
+  failures += test_recording( 1, 1, 0 );
+  failures += test_recording( 0, 1, 1 );
+  failures += test_recording( 1, 1, 1 );
+  failures += test_stuck();
+  failures += test_reshare();
+
+  if ( failures ) printf("%d failures.\n", failures);
+  else printf("All ring buffer stream tests passed.\n");
+  return failures != 0;
+}
@@ -24,6 +24,15 @@
    NULL on an error. */
 
 char *new_data_file_name(void)
+{
+  return new_data_file_name_in( "." );
+}
+
+/* The same, searching the named directory.  The name returned does
+   not include the directory.  This leaves the current directory
+   alone, so it is safe to call while other threads are running. */
+
+char *new_data_file_name_in(const char *directory)
 {
   DIR *dir;            // directory entry stream
   time_t clock;        // various representations of the current time
@@ -35,12 +44,12 @@ char *new_data_file_name(void)
 
   struct dirent *dirp;
 
-  // Open the current directory.
-  // logprintf("new_data_file_name opening the current directory.\n");
+  // Open the directory.
+  // logprintf("new_data_file_name opening the directory %s.\n", directory);
 
-  dir = opendir( "." );
+  dir = opendir( directory );
   if ( dir == NULL ) {
-    errprintf("new_data_file_name unable to open current directory: %s\n", strerror(errno));
+    errprintf("new_data_file_name unable to open directory %s: %s\n", directory, strerror(errno));
     return NULL;
   }
 
@@ -28,6 +28,13 @@
 #include <time.h>
 #include <string.h>     // for strerror()
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>     // for offsetof
+#include <math.h>
 
 #ifdef linux
 #include <endian.h>
@@ -37,11 +44,24 @@
 #include <sys/param.h>   // for BYTE_ORDER
 #endif
 
+// std::to_chars gives the shortest text which reads back as the same
+// number; older libraries fall back to printf with enough digits.
+#if defined(__has_include) && __cplusplus >= 201703L
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+#endif
+
 #include "dataset.h"
+#include "dataset_codec.h"
 
 #define DATASET_MAGIC_NUM 0xdaaadeaf  // arbitrary 32 bit magic number for header
+#define DATASET_FOOTER_MAGIC 0xdaaaf007  // arbitrary 32 bit magic number ending a version 2 file
 #define HEADER_WORD_1     0xf63b3128  // arbitrary 48 bit data frame boundary marker
 #define HEADER_WORD_2     0xf8a50000
+#define DS_FRAME_COMPRESSED 0x0001   // frame header flag: a compressed block of frames follows
+#define DS_FRAME_CHECKSUM   0x0002   // frame header flag: a CRC-32 of the frame follows it
+#define DS_CHECKSUM_SIZE    4
 
 #define SAFE_FREE(mem)  if ((mem) != NULL) free(mem)
   
@@ -78,7 +98,7 @@ const char * ds_get_units_string(enum dsUnits t)
 static FILE *errstream = NULL;
 
 static
-void ds_errprintf(char *format, ...)
+void ds_errprintf(const char *format, ...)
 {
   va_list args;
 
@@ -130,8 +150,17 @@ dataset_t *new_dataset(int variables)
 
   d->startpos = 0;   // the ring buffer starts out empty
   d->samples = 0;
+  d->sequence = 0;
   d->filepos = 0;    // at the logical beginning of the output
 
+  d->mapping = NULL; // the data buffers are all allocated on the heap
+  d->mapping_length = 0;
+  d->flags = 0;      // plain frames
+  d->index = NULL;   // built on demand by ds_find_variable
+  d->strings = NULL; // strings are copied onto the heap
+  d->snapshot_plan = NULL;
+  d->frames = NULL;  // the usual layout, one buffer per variable
+
   // allocate an array of dsVariable structures
   d->vars = (struct dsVariable *) calloc (d->variables, sizeof(struct dsVariable));
 
@@ -140,6 +169,60 @@ dataset_t *new_dataset(int variables)
   return d;
 }
 
+/****************************************************************/
+// Test whether a data buffer points into the file mapping created by
+// ds_map_file, in which case it must not be freed.
+static int
+ds_is_mapped(dataset_t *d, void *buffer)
+{
+  return d->mapping != NULL 
+    && (char *) buffer >= (char *) d->mapping 
+    && (char *) buffer <  (char *) d->mapping + d->mapping_length;
+}
+
+// Interned strings are kept in fixed size slots of one preallocated
+// block, with an open addressing hash table of the slots in use.
+struct dsStringTable {
+  unsigned int slots;      // number of slots
+  unsigned int length;     // bytes per slot, including the terminator
+  unsigned int used;       // number of slots filled
+  char *text;              // slots * length bytes of text
+  unsigned int size;       // number of hash entries, a power of two
+  int *hash;               // slot of each hash entry, or -1 if empty
+};
+
+// Return true if a string value lies within the intern table.
+static int
+ds_is_interned(dataset_t *d, const char *s)
+{
+  return s != NULL && d->strings != NULL
+    && s >= d->strings->text
+    && s <  d->strings->text + (size_t) d->strings->slots * d->strings->length;
+}
+
+// Free a string value, unless it lies within the intern table.
+static void
+ds_free_string(dataset_t *d, char *s)
+{
+  if (s == NULL || ds_is_interned(d, s)) return;
+  free(s);
+}
+
+// Free the snapshot plan of a ring buffer.  It is a single block
+// holding pointers into the data buffers, so it must be discarded
+// whenever a buffer is reallocated.
+static void
+ds_discard_snapshot_plan(dataset_t *d)
+{
+  if (d->snapshot_plan == NULL) return;
+  free(d->snapshot_plan);
+  d->snapshot_plan = NULL;
+}
+
+static void ds_discard_index(dataset_t *d);
+static void ds_discard_frames(dataset_t *d);
+static char *ds_intern_string(struct dsStringTable *t, const char *s);
+
 /****************************************************************/
 // Delete a dataset and free up all memory.
 void delete_dataset(dataset_t *d)
@@ -149,6 +232,9 @@ void delete_dataset(dataset_t *d)
 
   // Free the global description
   SAFE_FREE(d->comment);
+  ds_discard_index(d);
+  ds_discard_snapshot_plan(d);
+  ds_discard_frames(d);
 
   // For each variable, free its strings and then its data buffer.
   for (v = 0; v < d->variables; v++) {
@@ -156,28 +242,40 @@ void delete_dataset(dataset_t *d)
     SAFE_FREE(d->vars[v].desc);
 
     // If the column size is unreasonable, no data buffers exist to 
-    // de-allocate.
-    if (d->columns == 0 || d->columns == DS_UNSPECIFIED_LENGTH) 
+    // de-allocate.  Empty buffers may still exist for zero columns.
+    if (d->columns == DS_UNSPECIFIED_LENGTH) 
       continue;
 
     // For most data types the data buffer is simply an array of
     // values.  However, for strings the buffer is an array of
     // pointers to strings, allocated separately.
 
-    if (d->vars[v].type == DS_STRING) {
+    if (d->vars[v].type == DS_STRING && d->data[v] != NULL) {
       int s;
 
       // Free each individual string.
-      for (s = 0; s < d->columns; s++) SAFE_FREE(((char **)(d->data[v])) [s]);
+      for (s = 0; s < d->columns; s++) ds_free_string(d, ((char **)(d->data[v])) [s]);
     }      
-    // Free the fixed sized row data (for any type).
-    SAFE_FREE(d->data[v]);
+    // Free the fixed sized row data (for any type), unless it lies
+    // within a mapped file.
+    if (!ds_is_mapped(d, d->data[v])) SAFE_FREE(d->data[v]);
+  }
+  if (d->mapping != NULL) munmap(d->mapping, d->mapping_length);
+
+  if (d->strings != NULL) {
+    free(d->strings->text);
+    free(d->strings->hash);
+    free(d->strings);
   }
+
   // Finally, free the array of data buffer pointers itself.
   SAFE_FREE(d->data);  
 
   // Finally, free the array of variable descriptions.
   SAFE_FREE(d->vars);
+
+  // and the object itself.
+  free(d);
 }
 
 /****************************************************************/
@@ -208,6 +306,38 @@ ds_set_timestamp(dataset_t *d)
   gettimeofday(&now, NULL);
   d->timestamp = now.tv_sec;
 }
+// Set the file encoding options.
+void
+ds_set_file_flags(dataset_t *d, unsigned int flags)
+{
+  if (d == NULL) return;
+  d->flags = flags;
+}
+// Preallocate the intern table for string values.
+void
+ds_intern_strings(dataset_t *d, unsigned int slots, unsigned int length)
+{
+  struct dsStringTable *t;
+  unsigned int i;
+
+  if (d == NULL || d->strings != NULL || slots == 0 || length == 0) return;
+
+  t = (struct dsStringTable *) malloc(sizeof(struct dsStringTable));
+  t->slots  = slots;
+  t->length = length;
+  t->used   = 0;
+  t->size   = 16;
+  while (t->size < 2 * slots) t->size *= 2;
+
+  // Touch every page now, so that no page faults occur when the
+  // strings are first stored.
+  t->text = (char *) malloc((size_t) slots * length);
+  memset(t->text, 0, (size_t) slots * length);
+  t->hash = (int *) malloc(t->size * sizeof(int));
+  for (i = 0; i < t->size; i++) t->hash[i] = -1;
+
+  d->strings = t;
+}
 /****************************************************************/
 // Allocate a data buffer for a variable, with size depending on data type.
 static void
@@ -236,6 +366,25 @@ ds_allocate_variable_data(dataset_t *d, int row)
     break;
   }
 }
+// Return the size of a single value of a fixed size type, or 0 for strings and invalid types.
+static unsigned
+ds_type_size(enum dsType type)
+{
+  switch (type) {
+  case DS_INT:    return 4;
+  case DS_FLOAT:  return 4;
+  case DS_DOUBLE: return 8;
+  default:        return 0;
+  }
+}
+// FNV-1a hash of a string.
+static unsigned int
+ds_hash_name(const char *name)
+{
+  unsigned int h = 2166136261u;
+  while (*name) h = (h ^ (unsigned char) *name++) * 16777619u;
+  return h;
+}
 /****************************************************************/
 // Initialize each individual variable entry.  
 void 
@@ -247,17 +396,23 @@ ds_init_variable(dataset_t *d, int row,
   struct dsVariable *var; 
   if (d == NULL) return;
 
+  ds_set_frame_layout(d, 0);  // the new buffer is allocated on its own
   var = & (d->vars[row]);     // Pointer to the structure we are initializating
+  ds_discard_index(d);        // the name may change
+  ds_discard_snapshot_plan(d); // the buffer is reallocated
 
   // Fill in all fields.  Strings are duplicated.
-  if (name != NULL) var->name  = strdup(name); 
-  if (desc != NULL) var->desc  = strdup(desc);
+  var->name = (name != NULL) ? strdup(name) : NULL;
+  var->desc = (desc != NULL) ? strdup(desc) : NULL;
 
   var->type  = type;
   var->units = units;
   var->upper = upper;
   var->lower = lower;
   var->archivable = 1;  // everything is saved in files by default
+  var->decimation = 1;  // and recorded at the full rate
+  var->scale = 0.0;     // at full resolution
+  var->offset = 0.0;
 
   ds_allocate_variable_data(d, row);  // create a buffer
 }
@@ -269,6 +424,7 @@ ds_add_variable( dataset_t *d, char *name, char *desc, enum dsType type, enum ds
   void *new_vars, *new_data;
 
   if ( d == NULL ) return;
+  ds_set_frame_layout( d, 0 );
   d->variables++;
   
   // Reallocate the dsVariable and data pointer arrays.
@@ -295,6 +451,7 @@ void ds_rename_variable( dataset_t *d, int row, char *newname )
   else {
     struct dsVariable *var; 
     var = & (d->vars[row]);     // Pointer to the structure we are renaming.
+    ds_discard_index( d );
     SAFE_FREE( var->name );
     var->name = strdup( newname );
   }
@@ -309,11 +466,20 @@ void ds_delete_variable( dataset_t *d, int row )
 {
   struct dsVariable *var; 
   if ( d == NULL || row < 0 || row >= d->variables ) return;
+  ds_set_frame_layout( d, 0 );
   var = & (d->vars[row]);     // Pointer to the structure we are deleting
+  ds_discard_index( d );      // subsequent rows will move
+  ds_discard_snapshot_plan( d );
   
   SAFE_FREE( var->name );
   SAFE_FREE( var->desc );
-  SAFE_FREE( d->data[row] );
+
+  // String rows also own each of their strings.
+  if ( var->type == DS_STRING && d->data[row] != NULL ) {
+    int col;
+    for ( col = 0; col < d->columns; col++ ) ds_free_string( d, ((char **) d->data[row])[col] );
+  }
+  if ( !ds_is_mapped( d, d->data[row] ) ) SAFE_FREE( d->data[row] );
   
   // Now shift all the subsequent variables up by one position.  This
   // doesn't bother reallocating the memory for the dsVariable or void*
@@ -345,6 +511,9 @@ void ds_resize_columns ( dataset_t *d, int first_column, int number_of_columns )
     if ( number_of_columns < 0 ) number_of_columns = 0;
     else if ( first_column + number_of_columns > original_columns ) number_of_columns = original_columns - first_column;
 
+    ds_discard_snapshot_plan( d );   // the buffers are reallocated
+    ds_set_frame_layout( d, 0 );
+
     d->columns = number_of_columns;
 
     // find the first valid sample within the new range, and determine how many valid samples were retained in a contiguous block
@@ -380,14 +549,688 @@ void ds_resize_columns ( dataset_t *d, int first_column, int number_of_columns )
 	memcpy( new_data, (char **) old_data + first_column, number_of_columns * sizeof(char *) ); 
 
 	// free any released strings
-	for ( col = 0; col < first_column; col++ ) SAFE_FREE( ((char **) old_data)[col] );
-	for ( col = first_column + number_of_columns; col < original_columns; col++ ) SAFE_FREE( ((char **) old_data)[col]);
+	for ( col = 0; col < first_column; col++ ) ds_free_string( d, ((char **) old_data)[col] );
+	for ( col = first_column + number_of_columns; col < original_columns; col++ ) ds_free_string( d, ((char **) old_data)[col]);
 	break;
       }
     }
   }
 }
 
+/****************************************************************/
+// Frame-major storage.  All the values of a column are kept together
+// in a fixed size record, or frame, of one buffer, at the same offset
+// in every frame.  The eight byte values come first, then the four
+// byte ones, then the two byte counts of the quantized variables, so
+// that each value is aligned.  A decimated variable is kept out of
+// the frames in a buffer of its own, holding one value for each group
+// of "decimation" columns.
+
+struct dsSharedHeader;
+
+struct dsFrameStore {
+  unsigned int size;       // bytes per frame, a multiple of 8
+  int *offset;             // offset of each variable within a frame, or -1 if it is decimated or has no type
+  unsigned char *data;     // columns * size bytes
+  struct dsSharedHeader *shared;  // header of the shared segment holding the data, or NULL
+  char *shared_name;       // name of the segment to remove, if this dataset created it
+};
+
+// Return the size of a value as held in memory.  Strings are held as pointers.
+static unsigned
+ds_value_size(enum dsType type)
+{
+  return (type == DS_STRING) ? sizeof(char *) : ds_type_size(type);
+}
+
+// Return true if a variable is kept quantized in the frame layout.
+static int
+ds_quantized(dataset_t *d, int v)
+{
+  enum dsType t = d->vars[v].type;
+  return d->vars[v].scale != 0.0 && (t == DS_INT || t == DS_FLOAT || t == DS_DOUBLE);
+}
+
+// Return the size of a value as held in the frame layout.
+static unsigned
+ds_frame_value_size(dataset_t *d, int v)
+{
+  return ds_quantized(d, v) ? sizeof(short) : ds_value_size(d->vars[v].type);
+}
+
+short
+ds_quantize(dataset_t *d, int row, double value)
+{
+  double q = floor((value - d->vars[row].offset) / d->vars[row].scale + 0.5);
+  if (q != q) return -32768;
+  if (q > 32767.0) return 32767;
+  if (q < -32767.0) return -32767;
+  return (short) q;
+}
+
+// Store a value of the type of a quantized variable.
+static void
+ds_expand_value(dataset_t *d, int v, short q, void *dst)
+{
+  double x = (q == -32768) ? NAN : d->vars[v].offset + d->vars[v].scale * q;
+
+  switch (d->vars[v].type) {
+  case DS_INT:    *(int *) dst = (x == x) ? (int) floor(x + 0.5) : 0; break;
+  case DS_FLOAT:  *(float *) dst = (float) x; break;
+  case DS_DOUBLE: *(double *) dst = x; break;
+  default: break;
+  }
+}
+
+// Store the count representing a value of the type of a quantized variable.
+static void
+ds_quantize_value(dataset_t *d, int v, const void *src, void *dst)
+{
+  short q = 0;
+
+  switch (d->vars[v].type) {
+  case DS_INT:    q = ds_quantize(d, v, *(const int *) src); break;
+  case DS_FLOAT:  q = ds_quantize(d, v, *(const float *) src); break;
+  case DS_DOUBLE: q = ds_quantize(d, v, *(const double *) src); break;
+  default: break;
+  }
+  memcpy(dst, &q, sizeof(short));
+}
+
+// Return the decimation of a variable, treating 0 as 1.
+static unsigned
+ds_divisor(dataset_t *d, int v)
+{
+  return (d->vars[v].decimation > 1) ? d->vars[v].decimation : 1;
+}
+
+// Return the address of a value in either layout.
+static void *
+ds_value_address(dataset_t *d, int v, unsigned int col)
+{
+  if (d->frames == NULL)
+    return (char *) d->data[v] + (size_t) col * ds_value_size(d->vars[v].type);
+  else if (d->frames->offset[v] >= 0)
+    return d->frames->data + (size_t) col * d->frames->size + d->frames->offset[v];
+  else
+    return (char *) d->data[v] + (size_t) (col / ds_divisor(d, v)) * ds_frame_value_size(d, v);
+}
+
+// Copy n values of variable v out of the frames, starting at column
+// col and wrapping around the end, into consecutive values.
+// Quantized values are expanded.
+static void
+ds_gather_frames(dataset_t *d, int v, unsigned int col, unsigned int n, void *buffer)
+{
+  unsigned int size = ds_value_size(d->vars[v].type), i;
+  const unsigned char *src = (const unsigned char *) ds_value_address(d, v, col);
+  char *dst = (char *) buffer;
+  int quantized = ds_quantized(d, v);
+  short q;
+
+  if (d->frames->offset[v] < 0) {
+    // a decimated value is repeated over its group
+    for (i = 0; i < n; i++, dst += size) {
+      if (!quantized) memcpy(dst, ds_value_address(d, v, col), size);
+      else {
+	memcpy(&q, ds_value_address(d, v, col), sizeof(short));
+	ds_expand_value(d, v, q, dst);
+      }
+      if (++col >= d->columns) col = 0;
+    }
+    return;
+  }
+
+  for (i = 0; i < n; i++, dst += size) {
+    if (!quantized) memcpy(dst, src, size);
+    else {
+      memcpy(&q, src, sizeof(short));
+      ds_expand_value(d, v, q, dst);
+    }
+    if (++col < d->columns) src += d->frames->size;
+    else {
+      col = 0;
+      src = (const unsigned char *) ds_value_address(d, v, 0);
+    }
+  }
+}
+
+// Return the number of values in the buffer of a decimated variable
+// in the frame layout.
+static unsigned
+ds_decimated_values(dataset_t *d, int v)
+{
+  return (d->columns + ds_divisor(d, v) - 1) / ds_divisor(d, v);
+}
+
+// Free a frame store.  If it lies in a shared segment the segment,
+// which is the dataset mapping, is unmapped and, if this dataset
+// created it, removed.
+static void
+ds_free_frame_store(dataset_t *d, struct dsFrameStore *f)
+{
+  free(f->offset);
+  if (f->shared == NULL) free(f->data);
+  else {
+    munmap(d->mapping, d->mapping_length);
+    d->mapping = NULL;
+    d->mapping_length = 0;
+    if (f->shared_name != NULL) {
+      shm_unlink(f->shared_name);
+      free(f->shared_name);
+    }
+  }
+  free(f);
+}
+
+// Free the frames and decimated buffers, and the strings they own.
+static void
+ds_discard_frames(dataset_t *d)
+{
+  unsigned int v, c;
+
+  if (d->frames == NULL) return;
+  for (v = 0; v < d->variables; v++) {
+    if (d->frames->offset[v] >= 0) {
+      if (d->vars[v].type == DS_STRING) 
+	for (c = 0; c < d->columns; c++) ds_free_string(d, *(char **) ds_value_address(d, v, c));
+    } else if (d->data[v] != NULL) {
+      if (d->vars[v].type == DS_STRING)
+	for (c = 0; c < ds_decimated_values(d, v); c++) ds_free_string(d, ((char **) d->data[v])[c]);
+      if (!ds_is_mapped(d, d->data[v])) free(d->data[v]);
+      d->data[v] = NULL;
+    }
+  }
+  ds_free_frame_store(d, d->frames);
+  d->frames = NULL;
+}
+
+// Copy a string for another column, into the intern table if possible.
+static char *
+ds_copy_string(dataset_t *d, const char *s)
+{
+  char *interned;
+  if (s == NULL) return NULL;
+  interned = ds_intern_string(d->strings, s);
+  return (interned != NULL) ? interned : strdup(s);
+}
+
+int
+ds_set_frame_layout(dataset_t *d, int frames)
+{
+  struct dsFrameStore *f;
+  unsigned int v, c, size = 0, pass;
+
+  if (d == NULL || d->columns == DS_UNSPECIFIED_LENGTH) return 1;
+  if ((d->frames != NULL) == (frames != 0)) return 0;
+  ds_discard_snapshot_plan(d);
+
+  if (!frames) {
+    // Gather each variable back into a buffer of its own.  The
+    // string pointers move with the values; decimated strings are
+    // copied for the other columns of their group.
+    for (v = 0; v < d->variables; v++) {
+      const char *held = (const char *) d->data[v];
+      unsigned int k = ds_divisor(d, v);
+
+      if (d->frames->offset[v] >= 0) {
+	ds_allocate_variable_data(d, v);
+	ds_gather_frames(d, v, 0, d->columns, d->data[v]);
+      } else if (held != NULL) {
+	size = ds_value_size(d->vars[v].type);
+	ds_allocate_variable_data(d, v);
+	for (c = 0; c < d->columns; c++) {
+	  char *dst = (char *) d->data[v] + (size_t) c * size;
+	  if (ds_quantized(d, v)) {
+	    short q;
+	    memcpy(&q, held + (size_t) (c / k) * sizeof(short), sizeof(short));
+	    ds_expand_value(d, v, q, dst);
+	    continue;
+	  }
+	  memcpy(dst, held + (size_t) (c / k) * size, size);
+	  if (c % k && d->vars[v].type == DS_STRING) *(char **) dst = ds_copy_string(d, *(char **) dst);
+	}
+	if (!ds_is_mapped(d, (void *) held)) free((void *) held);
+      }
+    }
+    ds_free_frame_store(d, d->frames);
+    d->frames = NULL;
+    return 0;
+  }
+
+  f = (struct dsFrameStore *) malloc(sizeof(struct dsFrameStore));
+  f->shared = NULL;
+  f->shared_name = NULL;
+  f->offset = (int *) malloc((d->variables + 1) * sizeof(int));
+  for (v = 0; v < d->variables; v++) f->offset[v] = -1;
+
+  for (pass = 8; pass >= 2; pass /= 2) {
+    for (v = 0; v < d->variables; v++) {
+      if (ds_frame_value_size(d, v) == pass && ds_divisor(d, v) == 1) {
+	f->offset[v] = size;
+	size += pass;
+      }
+    }
+  }
+  f->size = (size + 7) & ~7;
+  if (f->size == 0) f->size = 8;
+  f->data = (unsigned char *) calloc(d->columns, f->size);
+
+  // Scatter each variable buffer into the frames, or keep the first
+  // value of each group of a decimated one, and release it.
+  // Quantized values are converted to their counts.
+  for (v = 0; v < d->variables; v++) {
+    unsigned int k = ds_divisor(d, v), held = ds_frame_value_size(d, v);
+    const char *src = (const char *) d->data[v];
+    int quantized = ds_quantized(d, v);
+
+    size = ds_value_size(d->vars[v].type);
+    if (size == 0) continue;
+
+    if (f->offset[v] >= 0) {
+      unsigned char *dst = f->data + f->offset[v];
+      if (src != NULL) {
+	for (c = 0; c < d->columns; c++, dst += f->size, src += size) {
+	  if (quantized) ds_quantize_value(d, v, src, dst);
+	  else memcpy(dst, src, size);
+	}
+      }
+    } else {
+      char *dst = (char *) calloc((d->columns + k - 1) / k + 1, held);
+      if (src != NULL) {
+	for (c = 0; c < d->columns; c++, src += size) {
+	  if (c % k == 0) {
+	    if (quantized) ds_quantize_value(d, v, src, dst + (size_t) (c / k) * held);
+	    else memcpy(dst + (size_t) (c / k) * size, src, size);
+	  }
+	  else if (d->vars[v].type == DS_STRING) ds_free_string(d, *(char **) src);
+	}
+      }
+      if (d->data[v] != NULL && !ds_is_mapped(d, d->data[v])) free(d->data[v]);
+      d->data[v] = dst;
+      continue;
+    }
+    if (src != NULL && !ds_is_mapped(d, d->data[v])) free(d->data[v]);
+    d->data[v] = NULL;
+  }
+  d->frames = f;
+  return 0;
+}
+
+// Change the decimation of a variable.  In the frame layout its
+// buffer is rebuilt by switching layouts.
+void
+ds_set_decimation(dataset_t *d, int row, unsigned int divisor)
+{
+  int frames;
+
+  if (d == NULL || row < 0 || row >= d->variables) return;
+  if (divisor == 0) divisor = 1;
+  if (ds_divisor(d, row) == divisor) return;
+
+  frames = (d->frames != NULL);
+  ds_set_frame_layout(d, 0);
+  d->vars[row].decimation = divisor;
+  if (frames) ds_set_frame_layout(d, 1);
+}
+
+// Change the quantization of a variable, rebuilding the frames.
+void
+ds_set_quantization(dataset_t *d, int row, double scale, double offset)
+{
+  int frames;
+
+  if (d == NULL || row < 0 || row >= d->variables) return;
+  if (!(scale > 0.0)) scale = offset = 0.0;
+  if (d->vars[row].scale == scale && d->vars[row].offset == offset) return;
+
+  frames = (d->frames != NULL);
+  ds_set_frame_layout(d, 0);
+  d->vars[row].scale = scale;
+  d->vars[row].offset = offset;
+  if (frames) ds_set_frame_layout(d, 1);
+}
+
+unsigned char *
+ds_frame_buffer(dataset_t *d, unsigned int *frame_size)
+{
+  if (d == NULL || d->frames == NULL) return NULL;
+  if (frame_size != NULL) *frame_size = d->frames->size;
+  return d->frames->data;
+}
+
+int
+ds_frame_offset(dataset_t *d, int row)
+{
+  if (d == NULL || d->frames == NULL || row < 0 || row >= d->variables) return -1;
+  return d->frames->offset[row];
+}
+
+void
+ds_copy_columns(dataset_t *dst, dataset_t *src, unsigned int col, unsigned int n)
+{
+  unsigned int v, c, size;
+
+  if (dst == NULL || src == NULL || n > dst->columns || src->columns == 0) return;
+
+  for (v = 0; v < src->variables && v < dst->variables; v++) {
+    if (dst->vars[v].type != src->vars[v].type || dst->data[v] == NULL) continue;
+    size = ds_value_size(src->vars[v].type);
+
+    if (src->vars[v].type == DS_STRING) {
+      // a string on the heap may be freed by the writer at any time
+      for (c = 0; c < n; c++) {
+	char *s = *(char **) ds_value_address(src, v, (col + c) % src->columns);
+	ds_set_string(dst, v, c, ds_is_interned(src, s) ? s : NULL);
+      }
+    } else if (src->frames != NULL) {
+      ds_gather_frames(src, v, col % src->columns, n, dst->data[v]);
+    } else if (src->data[v] != NULL) {
+      unsigned int first = col % src->columns;
+      unsigned int run = (n < src->columns - first) ? n : src->columns - first;
+      memcpy(dst->data[v], (char *) src->data[v] + (size_t) first * size, (size_t) run * size);
+      memcpy((char *) dst->data[v] + (size_t) run * size, src->data[v], (size_t) (n - run) * size);
+    }
+  }
+}
+
+/****************************************************************/
+// Shared frames.  A dataset in the frame layout can keep its frames
+// in a named POSIX shared memory segment, which other processes map
+// read-only.  The segment holds, in order: the header; a table of
+// the shared variables, each entry followed by its name; the frames;
+// and the buffers of the decimated variables.  String values are
+// pointers into the writer's heap, so string variables are left out
+// of the table.
+
+#define DS_SHARED_MAGIC   0x44535348   // "DSSH"
+#define DS_SHARED_VERSION 2
+
+struct dsSharedHeader {
+  volatile unsigned int magic;      // DS_SHARED_MAGIC once the segment is complete
+  unsigned int version;
+  volatile unsigned int sequence;   // the ring indices, see ds_publish_ring
+  volatile unsigned int startpos;
+  volatile unsigned int samples;
+  unsigned int columns;
+  unsigned int variables;           // number of entries in the table
+  unsigned int entry_size;          // bytes per table entry, including the name
+  unsigned int frame_size;
+  unsigned int padding;
+  unsigned long long frames;        // offset of the frames
+  unsigned long long length;        // size of the segment
+};
+
+struct dsSharedVariable {
+  unsigned int type;
+  unsigned int units;
+  unsigned int decimation;
+  int offset;                       // offset within a frame, or -1 if decimated
+  unsigned long long data;          // offset of the buffer of a decimated variable
+  double lower, upper;
+  double scale, bias;               // scale and offset of a quantized variable
+  char name[8];                     // the name, extended to fill the entry
+};
+
+static struct dsSharedVariable *
+ds_shared_entry(struct dsSharedHeader *h, unsigned int i)
+{
+  return (struct dsSharedVariable *) ((char *) (h + 1) + (size_t) i * h->entry_size);
+}
+
+// Round up to a multiple of 64, to keep the frames on cache lines.
+static unsigned long long
+ds_round_64(unsigned long long n)
+{
+  return (n + 63) & ~63ULL;
+}
+
+int
+ds_share_frames(dataset_t *d, const char *name)
+{
+  struct dsSharedHeader *h;
+  unsigned long long length, pos;
+  unsigned int v, count = 0, entry_size = sizeof(struct dsSharedVariable);
+  void *segment;
+  int fd;
+
+  if (d == NULL || d->frames == NULL || d->frames->shared != NULL || d->mapping != NULL) return 1;
+
+  // Lay out the segment.
+  for (v = 0; v < d->variables; v++) {
+    size_t len = (d->vars[v].name != NULL) ? strlen(d->vars[v].name) + 1 : 1;
+    if (d->vars[v].type == DS_STRING || ds_value_size(d->vars[v].type) == 0) continue;
+    count++;
+    if (offsetof(struct dsSharedVariable, name) + len > entry_size)
+      entry_size = (offsetof(struct dsSharedVariable, name) + len + 7) & ~7;
+  }
+  pos = ds_round_64(sizeof(struct dsSharedHeader) + (unsigned long long) count * entry_size);
+  length = pos + (unsigned long long) d->columns * d->frames->size;
+  for (v = 0; v < d->variables; v++) 
+    if (d->vars[v].type != DS_STRING && d->frames->offset[v] < 0 && d->data[v] != NULL) 
+      length = ds_round_64(length) + (unsigned long long) ds_decimated_values(d, v) * ds_frame_value_size(d, v);
+
+  // A segment left by an earlier run may still be mapped by readers,
+  // and shrinking it would fault them, so its name is removed and a
+  // new segment created; the readers keep the old one until they
+  // detach.
+  shm_unlink(name);
+  fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) {
+    ds_errprintf("Unable to create shared memory %s: %s\n", name, strerror(errno));
+    return 1;
+  }
+  if (ftruncate(fd, length) != 0
+      || (segment = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    ds_errprintf("Unable to map shared memory %s: %s\n", name, strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    return 1;
+  }
+  close(fd);  // the mapping remains valid after the descriptor is closed
+
+  h = (struct dsSharedHeader *) segment;
+  h->version    = DS_SHARED_VERSION;
+  h->sequence   = d->sequence;
+  h->startpos   = d->startpos;
+  h->samples    = d->samples;
+  h->columns    = d->columns;
+  h->variables  = count;
+  h->entry_size = entry_size;
+  h->frame_size = d->frames->size;
+  h->frames     = pos;
+  h->length     = length;
+
+  // Move the frames and the decimated buffers into the segment.
+  memcpy((char *) segment + pos, d->frames->data, (size_t) d->columns * d->frames->size);
+  free(d->frames->data);
+  d->frames->data = (unsigned char *) segment + pos;
+  pos += (unsigned long long) d->columns * d->frames->size;
+
+  for (v = 0, count = 0; v < d->variables; v++) {
+    struct dsSharedVariable *e;
+
+    if (d->vars[v].type == DS_STRING || ds_value_size(d->vars[v].type) == 0) continue;
+    e = ds_shared_entry(h, count++);
+    e->type       = d->vars[v].type;
+    e->units      = d->vars[v].units;
+    e->decimation = ds_divisor(d, v);
+    e->offset     = d->frames->offset[v];
+    e->lower      = d->vars[v].lower;
+    e->upper      = d->vars[v].upper;
+    e->scale      = d->vars[v].scale;
+    e->bias       = d->vars[v].offset;
+    strcpy(e->name, (d->vars[v].name != NULL) ? d->vars[v].name : "");
+    e->data = 0;
+
+    if (e->offset < 0 && d->data[v] != NULL) {
+      size_t size = (size_t) ds_decimated_values(d, v) * ds_frame_value_size(d, v);
+      pos = ds_round_64(pos);
+      memcpy((char *) segment + pos, d->data[v], size);
+      free(d->data[v]);
+      d->data[v] = (char *) segment + pos;
+      e->data = pos;
+      pos += size;
+    }
+  }
+
+  ds_discard_snapshot_plan(d);   // the buffers have moved
+  d->mapping = segment;
+  d->mapping_length = length;
+  d->frames->shared = h;
+  d->frames->shared_name = strdup(name);
+
+  __sync_synchronize();   // complete the segment before marking it
+  h->magic = DS_SHARED_MAGIC;
+  return 0;
+}
+
+void
+ds_publish_ring(dataset_t *d)
+{
+  struct dsSharedHeader *h;
+
+  if (d == NULL || d->frames == NULL || d->frames->shared_name == NULL) return;
+  h = d->frames->shared;
+
+  if (d->sequence & 1) {
+    h->sequence = d->sequence;
+    __sync_synchronize();
+  } else {
+    h->startpos = d->startpos;
+    h->samples  = d->samples;
+    __sync_synchronize();
+    h->sequence = d->sequence;
+  }
+}
+
+dataset_t *
+ds_attach_shared(const char *name)
+{
+  struct dsSharedHeader *h;
+  struct dsFrameStore *f;
+  struct stat st;
+  dataset_t *d;
+  void *segment;
+  unsigned int v;
+  int fd;
+
+  fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    ds_errprintf("Unable to open shared memory %s: %s\n", name, strerror(errno));
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct dsSharedHeader)
+      || (segment = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    ds_errprintf("Unable to map shared memory %s.\n", name);
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+
+  h = (struct dsSharedHeader *) segment;
+  if (h->magic != DS_SHARED_MAGIC || h->version != DS_SHARED_VERSION || h->length != (unsigned long long) st.st_size
+      || h->frames + (unsigned long long) h->columns * h->frame_size > h->length
+      || sizeof(struct dsSharedHeader) + (unsigned long long) h->variables * h->entry_size > h->frames) {
+    ds_errprintf("Invalid shared memory %s.\n", name);
+    munmap(segment, st.st_size);
+    return NULL;
+  }
+  __sync_synchronize();   // read the contents after the marker
+
+  d = new_dataset(h->variables);
+  d->columns = h->columns;
+  d->mapping = segment;
+  d->mapping_length = st.st_size;
+
+  f = (struct dsFrameStore *) malloc(sizeof(struct dsFrameStore));
+  f->size = h->frame_size;
+  f->offset = (int *) malloc((d->variables + 1) * sizeof(int));
+  f->data = (unsigned char *) segment + h->frames;
+  f->shared = h;
+  f->shared_name = NULL;
+  d->frames = f;
+
+  for (v = 0; v < d->variables; v++) {
+    struct dsSharedVariable *e = ds_shared_entry(h, v);
+    struct dsVariable *var = &d->vars[v];
+
+    var->name = strndup(e->name, h->entry_size - offsetof(struct dsSharedVariable, name));
+    var->type = (enum dsType) e->type;
+    var->units = (enum dsUnits) e->units;
+    var->lower = e->lower;
+    var->upper = e->upper;
+    var->decimation = e->decimation;
+    var->scale = e->scale;
+    var->offset = e->bias;
+    var->archivable = 1;
+
+    f->offset[v] = e->offset;
+    if (e->offset < 0 && e->data != 0) d->data[v] = (char *) segment + e->data;
+
+    if (var->type == DS_STRING || ds_value_size(var->type) == 0 
+	|| (e->offset >= 0 && e->offset + ds_frame_value_size(d, v) > h->frame_size)
+	|| (e->offset < 0 && (e->data == 0 || e->data + (unsigned long long) ds_decimated_values(d, v) * ds_frame_value_size(d, v) > h->length))) {
+      ds_errprintf("Invalid shared memory %s.\n", name);
+      delete_dataset(d);
+      return NULL;
+    }
+  }
+  if (ds_ring_state(d, NULL, &d->startpos, &d->samples)) {
+    ds_errprintf("The writer of shared memory %s is stuck in an update.\n", name);
+    delete_dataset(d);
+    return NULL;
+  }
+  return d;
+}
+
+// How many times ds_ring_state tries to read the indices between
+// updates before giving up.  An update takes a few microseconds, so
+// this is only reached if the writer has stopped during one.
+#define DS_RING_STATE_ATTEMPTS 100000
+
+int
+ds_ring_state(dataset_t *d, unsigned int *sequence, unsigned int *startpos, unsigned int *samples)
+{
+  struct dsSharedHeader *h = (d->frames != NULL && d->frames->shared_name == NULL) ? d->frames->shared : NULL;
+  volatile unsigned int *count_p = (h != NULL) ? &h->sequence : &d->sequence;
+  unsigned int before, first, count, attempt;
+
+  for (attempt = 0; attempt < DS_RING_STATE_ATTEMPTS; attempt++) {
+    before = *count_p;
+    __sync_synchronize();
+    first = (h != NULL) ? h->startpos : d->startpos;
+    count = (h != NULL) ? h->samples  : d->samples;
+    __sync_synchronize();
+    if (!(before & 1) && *count_p == before) {
+      if (sequence != NULL) *sequence = before;
+      if (startpos != NULL) *startpos = first;
+      if (samples  != NULL) *samples  = count;
+      return 0;
+    }
+    sched_yield();
+  }
+  return 1;
+}
+
+// Make a copy of the description of a dataset in the frame layout,
+// holding no data and owning nothing, through which a writer can be
+// pointed at values gathered from the frames.  view->data is
+// allocated with every buffer NULL.
+static void
+ds_frame_view(dataset_t *d, dataset_t *view, unsigned int columns)
+{
+  *view = *d;
+  view->columns = columns;
+  view->startpos = 0;
+  view->samples = columns;
+  view->data = (void **) calloc(d->variables + 1, sizeof(void *));
+  view->mapping = NULL;
+  view->index = NULL;
+  view->snapshot_plan = NULL;
+  view->frames = NULL;
+}
+
 /****************************************************************/
 // Utility functions to read or write pieces of a data file.  In each
 // case, returns 0 on success or true on error.
@@ -605,39 +1448,197 @@ read_string(FILE *f, char **s)
 
   return 0;
 }
-/****************************************************************/
-// Write out the dataset file header to a stream.  "samples" can
-// be set to the special indicator DS_UNSPECIFIED_LENGTH if the
-// header will precede a stream whose length cannot be determined
-// in advance.
 
+// 64 bit file offsets are written as two 32 bit words, low word first.
+inline static int
+write_u_int64(FILE *f, unsigned long long data)
+{
+  return write_u_int(f, (unsigned int) (data & 0xffffffff)) || write_u_int(f, (unsigned int) (data >> 32));
+}
+
+// Write a run of zero bytes, used to align blocks within a file.
 static int
-ds_write_header(dataset_t *d, FILE* file)
+write_zeros(FILE *f, unsigned count)
 {
-  int writable_vars = 0;
-  int r, v;
-  if (d == NULL) return 1;
+  static const char zeros[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+  return (count > 0) && (fwrite(zeros, 1, count, f) != count);
+}
 
-  // Count the number of variables that will actually be written.
-  for (v = 0; v < d->variables; v++) {
-    if ( d->vars[v].archivable ) writable_vars++;
+// Read and throw away bytes; unlike fseek this also works on pipes.
+static int
+skip_bytes(FILE *f, unsigned long long count)
+{
+  char scratch[4096];
+  while (count > 0) {
+    size_t chunk = (count > sizeof(scratch)) ? sizeof(scratch) : (size_t) count;
+    if (fread(scratch, 1, chunk, f) != chunk) return 1;
+    count -= chunk;
   }
+  return 0;
+}
 
-  // Each of these returns zero on success, which means if r is set 
-  // on an error none of the successive writes will execute.
+// The number of bytes write_string will produce for a given string.
+static unsigned
+string_size(const char *s)
+{
+  unsigned len;
+  if (s == NULL) return 2;
+  len = strlen(s);
+  return 2 + ((len > 0xfffe) ? 0xfffe : len);
+}
 
-  r =      write_u_int(file, DATASET_MAGIC_NUM); // magic number
-  r = r || write_u_int(file, 1);               	 // version code
-  r = r || write_u_int(file, d->samples);      	 // number of samples in file
-  r = r || write_u_int(file, writable_vars );  	 // number of variables in file
-  r = r || write_string(file, d->comment);     	 // global comment
+// The following extract little-endian values from a memory buffer,
+// for readers which fetch whole blocks of a file at once.
+inline static unsigned short
+get_u_short(const unsigned char *p)
+{
+  return (unsigned short) (p[0] | (p[1] << 8));
+}
 
-  r = r || write_u_int(file, d->timestamp);      // 64 bit UNIX time value
-  r = r || write_u_int(file, 0);
+inline static unsigned int
+get_u_int(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+inline static unsigned long long
+get_u_int64(const unsigned char *p)
+{
+  return get_u_int(p) | ((unsigned long long) get_u_int(p+4) << 32);
+}
+
+// CRC-32 (IEEE 802.3), as used by zlib, of a buffer.  The previous
+// value is passed in "crc" to continue a checksum over several
+// buffers; start with 0.
+static const unsigned int crc_table[256] = {
+  0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+  0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+  0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+  0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+  0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+  0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+  0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+  0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+  0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+  0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+  0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+  0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+  0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+  0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+  0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+  0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+  0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+  0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+  0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+  0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+  0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+  0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+  0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+  0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+  0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+  0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+  0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+  0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+  0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+  0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+  0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+  0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+  0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+  0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+  0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+  0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+  0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+  0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+  0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+  0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+  0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+  0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+  0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
+
+static unsigned int
+ds_crc32(unsigned int crc, const unsigned char *p, unsigned long long length)
+{
+  crc = ~crc;
+  while (length-- > 0) crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+// Parse a string in the write_string format out of a buffer holding
+// "avail" bytes.  Returns the number of bytes consumed, or zero if the
+// string runs past the end of the buffer.  The new string or NULL is
+// returned in *s.
+static unsigned
+get_string(const unsigned char *p, unsigned long long avail, char **s)
+{
+  unsigned short length;
+
+  *s = NULL;
+  if (avail < 2) return 0;
+  length = get_u_short(p);
+  if (length == 0xffff) return 2;            // special case, null string
+  if (avail < 2 + (unsigned) length) return 0;
+
+  *s = (char *) malloc(length + 1);
+  memcpy(*s, p + 2, length);
+  (*s)[length] = 0;
+  return 2 + length;
+}
+
+// Convert a block of little-endian values in place to the native
+// byte order; this does nothing on little-endian hosts.
+static void
+swap_block(void *data, unsigned long count, unsigned size)
+{
+#if BYTE_ORDER==BIG_ENDIAN
+  unsigned char *p = (unsigned char *) data;
+  unsigned long i;
+  unsigned j;
+  for (i = 0; i < count; i++, p += size) {
+    for (j = 0; j < size/2; j++) {
+      unsigned char tmp = p[j];
+      p[j] = p[size-1-j];
+      p[size-1-j] = tmp;
+    }
+  }
+#endif
+}
+/****************************************************************/
+// Write out the dataset file header to a stream.  "samples" can
+// be set to the special indicator DS_UNSPECIFIED_LENGTH if the
+// header will precede a stream whose length cannot be determined
+// in advance.  The version code selects the layout of the data
+// which follows: 1 for frames, 2 for per-variable blocks.  The
+// first padding word carries the file flags, which only apply to
+// the frames of version 1.
+
+static int
+ds_write_header(dataset_t *d, FILE* file, unsigned int version)
+{
+  int writable_vars = 0;
+  int r, v;
+  if (d == NULL) return 1;
+
+  // Count the number of variables that will actually be written.
+  for (v = 0; v < d->variables; v++) {
+    if ( d->vars[v].archivable ) writable_vars++;
+  }
+
+  // Each of these returns zero on success, which means if r is set 
+  // on an error none of the successive writes will execute.
+
+  r =      write_u_int(file, DATASET_MAGIC_NUM); // magic number
+  r = r || write_u_int(file, version);           // version code
+  r = r || write_u_int(file, d->samples);      	 // number of samples in file
+  r = r || write_u_int(file, writable_vars );  	 // number of variables in file
+  r = r || write_string(file, d->comment);     	 // global comment
 
-  r = r || write_u_int(file, 0);                 // 64 bits of padding for expansion
+  r = r || write_u_int(file, d->timestamp);      // 64 bit UNIX time value
   r = r || write_u_int(file, 0);
 
+  r = r || write_u_int(file, (version == 1) ? d->flags : 0);  // file flags
+  r = r || write_u_int(file, 0);                 // 32 bits of padding for expansion
+
 
   // Write out all the variable descriptors.  The intent of
   // writing everything separately is to avoid any alignment
@@ -657,29 +1658,43 @@ ds_write_header(dataset_t *d, FILE* file)
       r = r || write_string(file, var->desc);
       r = r || write_double(file, var->upper);
       r = r || write_double(file, var->lower);
-      r = r || write_u_int(file, 0);              // 64 bits of padding for expansion
-      r = r || write_u_int(file, 0);
+      r = r || write_u_int(file, (var->decimation > 1) ? var->decimation : 0);  // decimation, 0 for full rate
+      r = r || write_u_int(file, 0);              // 32 bits of padding for expansion
     }
   }
   // End of the header.  Data frames can follow.
   return r;
 }
 
-// Reads a dataset header from a stream into a new dataset
-// object.  Returns a pointer on success, else NULL.  The object
-// has "columns" set to the number of samples specified in the
-// file, which may be DS_UNSPECIFIED_LENGTH.
+// Compute the number of bytes ds_write_header will produce.  This
+// allows the block offsets of a version 2 file to be determined
+// without seeking, so files can also be written to pipes.
+static unsigned long long
+ds_header_size(dataset_t *d)
+{
+  unsigned long long size = 16 + string_size(d->comment) + 16;
+  int v;
+
+  for (v = 0; v < d->variables; v++) {
+    if ( d->vars[v].archivable ) 
+      size += string_size(d->vars[v].name) + 8 + string_size(d->vars[v].desc) + 16 + 8;
+  }
+  return size;
+}
+
+// Reads the rest of a dataset header from a stream, after the magic
+// number, into a new dataset object.  Returns a pointer on success,
+// else NULL.  The object has "columns" set to the number of samples
+// specified in the file, which may be DS_UNSPECIFIED_LENGTH.
 
 static dataset_t*
-ds_read_header(FILE* file)
+ds_read_header_rest(FILE* file, unsigned int magic, unsigned int *version_out)
 {
-  unsigned int magic=0, version=0, samples, variables, padding, v;
-  struct timeval now; 
+  unsigned int version=0, samples, variables, seconds, padding, v;
   int r;
   dataset_t *d;
   
-  r =      read_u_int(file, &magic);
-  r = r || read_u_int(file, &version);
+  r =      read_u_int(file, &version);
   r = r || read_u_int(file, &samples);
   r = r || read_u_int(file, &variables);
 
@@ -687,10 +1702,11 @@ ds_read_header(FILE* file)
     ds_errprintf("I/O error occurred while reading header.\n");
     return NULL;
   }
-  if ((magic != DATASET_MAGIC_NUM) || (version != 1)) {
+  if ((magic != DATASET_MAGIC_NUM) || (version != 1 && version != 2)) {
     ds_errprintf("Invalid magic number (0x%08x) or version (%d).\n", magic, version);
     return NULL;
   }
+  if (version_out != NULL) *version_out = version;
 
   // if file fingerprint checks out, create the object  
   d = new_dataset(variables);
@@ -699,298 +1715,2273 @@ ds_read_header(FILE* file)
   // and read the remainder of the header
   r = r || read_string(file, &d->comment);
 
-  r = r || read_u_int(file, (unsigned int *) &now.tv_sec);  // 64 bit time value
+  r = r || read_u_int(file, &seconds);         // 64 bit time value
   r = r || read_u_int(file, &padding);           
-  d->timestamp = now.tv_sec;
+  d->timestamp = seconds;
 
-  r = r || read_u_int(file, &padding);        // 64 bits of padding for expansion
-  r = r || read_u_int(file, &padding);
+  r = r || read_u_int(file, &d->flags);       // file flags
+  r = r || read_u_int(file, &padding);        // 32 bits of padding for expansion
 
   if (r) {
     ds_errprintf("Error reading global header.\n");
     delete_dataset(d);
     return NULL;
   }
+  if (d->flags & ~(DS_FILE_COMPRESSED | DS_FILE_CHECKSUMMED)) {
+    ds_errprintf("Unsupported file flags (0x%x).\n", d->flags);
+    delete_dataset(d);
+    return NULL;
+  }
   // and each variable definition
   for (v = 0; v < d->variables; v++) {
     struct dsVariable *var = &(d->vars[v]);
 
-    r = r || read_string(file, &var->name);     // Read each field of the dsVariable structure.
+    r = r || read_string(file, &var->name);     // Read each field of the dsVariable structure.
+
+    if (r) {
+      ds_errprintf("Error reading variable name.\n");
+      break;
+    }
+    
+    // added dummy with change from c to c++
+    unsigned int typeDummy;
+    r = r || read_u_int(file, &typeDummy);
+    var->type = (dsType) typeDummy;
+    
+    r = r || read_u_int(file, &typeDummy);
+    var->units = (dsUnits) typeDummy;
+        
+//    r = r || read_u_int(file, &var->type);
+//    r = r || read_u_int(file, &var->units);
+    r = r || read_string(file, &var->desc);
+    r = r || read_double(file, &var->upper);
+    r = r || read_double(file, &var->lower);
+    r = r || read_u_int(file, &var->decimation);  // decimation, 0 for full rate
+    r = r || read_u_int(file, &padding);        // 32 bits of padding for expansion
+
+    if (var->decimation == 0) var->decimation = 1;
+    var->archivable = 1; // by default everything should be written out
+
+    if (r) {
+      ds_errprintf("Error reading variable description.\n");
+      break;
+    }
+  }
+
+  // If anything failed, free up the new object.
+  if (r) {
+    delete_dataset(d);
+    return NULL;
+  } 
+  return d;
+}
+
+// Reads a dataset header from a stream into a new dataset object, as
+// for ds_read_header_rest.
+static dataset_t*
+ds_read_header(FILE* file, unsigned int *version_out)
+{
+  unsigned int magic = 0;
+
+  if (read_u_int(file, &magic)) {
+    ds_errprintf("I/O error occurred while reading header.\n");
+    return NULL;
+  }
+  return ds_read_header_rest(file, magic, version_out);
+}
+
+
+/****************************************************************/
+// The frame encoder serializes columns of the data matrix into a
+// memory buffer in the file representation, so that many frames can
+// be written out with a single fwrite.  The list of archivable rows
+// is computed once, and since the file is little-endian, values are
+// copied without conversion except on big-endian hosts.
+
+#define DS_ENCODER_BUFFER_SIZE (256 * 1024)   // bytes of frames to collect before each write
+
+typedef struct {
+  int rows;                  // number of archivable variables
+  const char **data;         // data buffer for each archivable variable
+  unsigned char *sizes;      // bytes per value for each, or 0 for strings
+  unsigned fixed_size;       // bytes per frame excluding string values
+  int checksum;              // true if each frame ends with a CRC
+  unsigned char *buffer;     // encoded frames waiting to be written
+  unsigned long long used;   // number of valid bytes in buffer
+  unsigned long long capacity;
+} ds_encoder_t;
+
+// The following store little-endian values into a memory buffer,
+// returning a pointer just past the stored value.
+inline static unsigned char *
+put_u_int(unsigned char *p, unsigned int data)
+{
+#if BYTE_ORDER==BIG_ENDIAN
+  p[0] = data;
+  p[1] = data >> 8;
+  p[2] = data >> 16;
+  p[3] = data >> 24;
+#else
+  memcpy(p, &data, 4);
+#endif
+  return p + 4;
+}
+
+// Copy a 4 or 8 byte value in native order into little-endian order.
+inline static unsigned char *
+put_value(unsigned char *p, const char *src, unsigned size)
+{
+#if BYTE_ORDER==BIG_ENDIAN
+  unsigned i;
+  for (i = 0; i < size; i++) p[i] = src[size-1-i];
+#else
+  memcpy(p, src, size);
+#endif
+  return p + size;
+}
+
+inline static unsigned char *
+put_string(unsigned char *p, const char *s)
+{
+  unsigned len;
+  if (s == NULL) {           // special case for NULL string
+    p[0] = p[1] = 0xff;
+    return p + 2;
+  }
+  len = strlen(s);
+  if (len > 0xfffe) len = 0xfffe;
+  p[0] = len & 0xff;
+  p[1] = len >> 8;
+  memcpy(p + 2, s, len);
+  return p + 2 + len;
+}
+
+static void
+ds_encoder_init(ds_encoder_t *enc, dataset_t *d, unsigned int flags)
+{
+  int v;
+
+  enc->rows = 0;
+  enc->data  = (const char **) calloc(d->variables + 1, sizeof(char *));
+  enc->sizes = (unsigned char *) calloc(d->variables + 1, 1);
+  enc->checksum = (flags & DS_FILE_CHECKSUMMED) != 0;
+  enc->fixed_size = 12 + (enc->checksum ? DS_CHECKSUM_SIZE : 0);
+
+  for (v = 0; v < d->variables; v++) {
+    // check if the variable is flagged for writing to disk
+    if ( d->vars[v].archivable && d->vars[v].type > DS_NOTYPE && d->vars[v].type < DS_TYPE_MAX ) {
+      enc->data[enc->rows]  = (const char *) d->data[v];
+      enc->sizes[enc->rows] = ds_type_size(d->vars[v].type);
+      enc->fixed_size += enc->sizes[enc->rows];
+      enc->rows++;
+    }
+  }
+  enc->capacity = DS_ENCODER_BUFFER_SIZE;
+  if (enc->capacity < 2 * enc->fixed_size) enc->capacity = 2 * enc->fixed_size;
+  enc->buffer = (unsigned char *) malloc(enc->capacity);
+  enc->used = 0;
+}
+
+static void
+ds_encoder_free(ds_encoder_t *enc)
+{
+  free(enc->data);
+  free(enc->sizes);
+  free(enc->buffer);
+}
+
+// Write out all encoded frames.  Returns 0 on success.
+static int
+ds_encoder_flush(ds_encoder_t *enc, FILE *file)
+{
+  int r = (enc->used > 0) && (fwrite(enc->buffer, 1, enc->used, file) != enc->used);
+  enc->used = 0;
+  return r;
+}
+
+// Encode a frame of data, i.e., one column of the data matrix.  col
+// is the column index.  samp is the sample index within the stream.
+// The buffer is written to the stream whenever it fills.  Returns 0
+// on success, else an error code.
+static int
+ds_encoder_add_frame(ds_encoder_t *enc, FILE *file, unsigned int col, unsigned int samp)
+{
+  unsigned long long size = enc->fixed_size;
+  unsigned char *p, *start;
+  int i, r = 0;
+
+  // Strings are the only values of variable size.
+  for (i = 0; i < enc->rows; i++) {
+    if (enc->sizes[i] == 0) size += string_size(((char **) enc->data[i])[col]);
+  }
+
+  if (enc->used + size > enc->capacity) {
+    r = ds_encoder_flush(enc, file);
+    if (size > enc->capacity) {
+      enc->capacity = size;
+      enc->buffer = (unsigned char *) realloc(enc->buffer, enc->capacity);
+    }
+  }
+
+  // First the frame header, then each variable in sequence, then
+  // optionally the checksum of all that.
+  p = start = enc->buffer + enc->used;
+  p = put_u_int(p, HEADER_WORD_1);  // 64 bit marker
+  p = put_u_int(p, HEADER_WORD_2 | (enc->checksum ? DS_FRAME_CHECKSUM : 0));  // and flags
+  p = put_u_int(p, samp);           // sample index
+
+  for (i = 0; i < enc->rows; i++) {
+    unsigned bytes = enc->sizes[i];
+    if (bytes > 0) p = put_value(p, enc->data[i] + (size_t) bytes * col, bytes);
+    else p = put_string(p, ((char **) enc->data[i])[col]);
+  }
+  if (enc->checksum) p = put_u_int(p, ds_crc32(0, start, p - start));
+  enc->used = p - enc->buffer;
+  return r;
+}
+
+/****************************************************************/
+// With DS_FILE_COMPRESSED set, the frames are grouped into blocks
+// coded by ds_codec_encode_block.  Each block has a header in place
+// of the frame header, with the compressed flag set in the free
+// bits of the second marker word:
+//
+//   HEADER_WORD_1, HEADER_WORD_2 | DS_FRAME_COMPRESSED, index of
+//   the first sample, number of frames, number of bytes of data
+//
+// followed by the coded data.  With DS_FILE_CHECKSUMMED the
+// DS_FRAME_CHECKSUM flag is also set, and the data ends with a CRC of
+// the header and coded data, included in the number of bytes.
+
+#define DS_COMPRESSED_HEADER_SIZE 20
+
+// Write "count" columns of a matrix starting at column "col" as
+// compressed blocks, numbering the samples from "first".
+static int
+ds_write_compressed_frames(dataset_t *d, FILE *file, unsigned int flags,
+			   unsigned int col, unsigned int first, unsigned int count)
+{
+  unsigned char header[DS_COMPRESSED_HEADER_SIZE], trailer[DS_CHECKSUM_SIZE], *p;
+  unsigned char *buffer = NULL;
+  unsigned long long capacity = 0, length;
+  unsigned int samp, n, checksum = (flags & DS_FILE_CHECKSUMMED) ? DS_CHECKSUM_SIZE : 0;
+  int r = 0;
+
+  for (samp = first; samp < first + count && !r; samp += n) {
+    n = first + count - samp;
+    if (n > DS_CODEC_BLOCK_FRAMES) n = DS_CODEC_BLOCK_FRAMES;
+    length = ds_codec_encode_block(d, col, n, &buffer, &capacity);
+
+    p = put_u_int(header, HEADER_WORD_1);
+    p = put_u_int(p, HEADER_WORD_2 | DS_FRAME_COMPRESSED | (checksum ? DS_FRAME_CHECKSUM : 0));
+    p = put_u_int(p, samp);
+    p = put_u_int(p, n);
+    put_u_int(p, length + checksum);
+    if (checksum) put_u_int(trailer, ds_crc32(ds_crc32(0, header, DS_COMPRESSED_HEADER_SIZE), buffer, length));
+
+    r = (fwrite(header, 1, DS_COMPRESSED_HEADER_SIZE, file) != DS_COMPRESSED_HEADER_SIZE)
+      || (fwrite(buffer, 1, length, file) != length)
+      || (fwrite(trailer, 1, checksum, file) != checksum);
+
+    // advance the column pointer, wrapping around if necessary
+    col = (col + n) % d->columns;
+  }
+  free(buffer);
+  return r;
+}
+
+// Check a compressed block header held in memory and extract the
+// number of frames and data bytes.  Returns 0 on success.
+static int
+ds_parse_compressed_header(const unsigned char *p, unsigned *frames, unsigned long long *length)
+{
+  unsigned int word = get_u_int(p+4) & ~DS_FRAME_CHECKSUM;
+  if (get_u_int(p) != HEADER_WORD_1 || word != (HEADER_WORD_2 | DS_FRAME_COMPRESSED)) {
+    ds_errprintf("Invalid compressed block header sentinel value: 0x%x%x.\n", get_u_int(p), get_u_int(p+4));
+    return 1;
+  }
+  *frames = get_u_int(p+12);
+  *length = get_u_int(p+16);
+  return (*frames == 0) || ((get_u_int(p+4) & DS_FRAME_CHECKSUM) && *length < DS_CHECKSUM_SIZE);
+}
+
+// Verify the checksum of a compressed block, if it has one, given its
+// header and the "length" bytes which follow it.  Returns 0 if the
+// block is intact.
+static int
+ds_check_compressed_block(const unsigned char *header, const unsigned char *data, unsigned long long length)
+{
+  unsigned long long coded = length - DS_CHECKSUM_SIZE;
+
+  if (!(get_u_int(header+4) & DS_FRAME_CHECKSUM)) return 0;
+  if (ds_crc32(ds_crc32(0, header, DS_COMPRESSED_HEADER_SIZE), data, coded) == get_u_int(data + coded)) return 0;
+  ds_errprintf("Checksum mismatch in compressed block at sample %u.\n", get_u_int(header+8));
+  return 1;
+}
+
+// Decode a compressed block given its header and the "length" bytes
+// which follow it, after checking it; the arguments are otherwise
+// those of ds_codec_decode_block.  Returns 0 on success.
+static int
+ds_decode_compressed_block(dataset_t *d, const unsigned char *header, const unsigned char *data, 
+			   unsigned long long length, unsigned col, unsigned frames, unsigned skip, unsigned store)
+{
+  if (ds_check_compressed_block(header, data, length)) return 1;
+  if (get_u_int(header+4) & DS_FRAME_CHECKSUM) length -= DS_CHECKSUM_SIZE;
+  return ds_codec_decode_block(d, data, length, col, frames, skip, store);
+}
+
+// Read compressed blocks from a stream to fill every column of the
+// matrix.  A final block may extend past the last column.
+static int
+ds_read_compressed_frames(dataset_t *d, FILE *file)
+{
+  unsigned char header[DS_COMPRESSED_HEADER_SIZE];
+  unsigned char *buffer = NULL;
+  unsigned long long capacity = 0, length;
+  unsigned int c, frames = 0;
+  int r = 0;
+
+  for (c = 0; c < d->columns && !r; c += frames) {
+    r = (fread(header, 1, DS_COMPRESSED_HEADER_SIZE, file) != DS_COMPRESSED_HEADER_SIZE)
+      || ds_parse_compressed_header(header, &frames, &length);
+
+    if (!r && length > capacity) {
+      capacity = length;
+      buffer = (unsigned char *) realloc(buffer, capacity);
+    }
+    r = r || (fread(buffer, 1, length, file) != length)
+      || ds_decode_compressed_block(d, header, buffer, length, c, frames, 0, d->columns - c);
+
+    if (r) ds_errprintf("Unable to read compressed block at frame %d.\n", c);
+  }
+  free(buffer);
+  return r;
+}
+
+/****************************************************************/
+static unsigned long long
+ds_decode_data_frame(dataset_t *d, const unsigned char *p, unsigned long long avail, unsigned int col);
+
+// Append "n" bytes from a stream to a growing buffer.
+static int
+ds_fetch_bytes(FILE *file, unsigned char **buffer, unsigned long long *capacity, 
+	       unsigned long long *used, unsigned n)
+{
+  if (*used + n > *capacity) {
+    *capacity = 2 * (*used + n);
+    *buffer = (unsigned char *) realloc(*buffer, *capacity);
+  }
+  if (fread(*buffer + *used, 1, n, file) != n) return 1;
+  *used += n;
+  return 0;
+}
+
+// Read a frame of data from a stream, i.e., one column of the
+// data matrix.  col is the column index.  The frame is collected in
+// *buffer, which is grown as needed, and decoded by
+// ds_decode_data_frame.  The first "used" bytes of the frame may
+// already be in the buffer.  Returns 0 on success, else an error
+// code.
+static int
+ds_read_data_frame(dataset_t *d, FILE* file, unsigned int col,
+		   unsigned char **buffer, unsigned long long *capacity, unsigned long long used)
+{
+  int r, v;
+
+  // First read in the frame header.
+  r = ds_fetch_bytes(file, buffer, capacity, &used, 12 - used);
+  if (r) {
+    ds_errprintf("Unable to read data frame header.\n");
+    return 1;
+  }
+
+  // Read in each variable in sequence; strings are preceded by their
+  // length.
+  for (v = 0; v < d->variables && !r; v++) {
+    if (d->vars[v].type == DS_STRING) {
+      r = ds_fetch_bytes(file, buffer, capacity, &used, 2);
+      if (!r) {
+	unsigned short length = get_u_short(*buffer + used - 2);
+	if (length != 0xffff) r = ds_fetch_bytes(file, buffer, capacity, &used, length);
+      }
+    } else r = ds_fetch_bytes(file, buffer, capacity, &used, ds_type_size(d->vars[v].type));
+
+    if (r) ds_errprintf("Error reading datum for variable \"%s\": %s\n", d->vars[v].name, 
+			feof(file) ? "unexpected end of file" : strerror(errno));
+  }
+  if (!r && (get_u_int(*buffer + 4) & DS_FRAME_CHECKSUM)) 
+    r = ds_fetch_bytes(file, buffer, capacity, &used, DS_CHECKSUM_SIZE);
+
+  return r || (ds_decode_data_frame(d, *buffer, used, col) != used);
+}
+/****************************************************************/
+// Decode a frame of data held in memory, i.e., one column of the
+// data matrix, from a buffer of "avail" bytes.  col is the column
+// index.  Returns the number of bytes consumed, or 0 on error.
+// This is used by the readers which fetch many frames at once.
+
+static unsigned long long
+ds_decode_data_frame(dataset_t *d, const unsigned char *p, unsigned long long avail, unsigned int col)
+{
+  const unsigned char *start = p, *end = p + avail;
+  int v, checksum;
+
+  if (avail < 12) return 0;
+  checksum = (get_u_int(p+4) & DS_FRAME_CHECKSUM) != 0;
+  if (get_u_int(p) != HEADER_WORD_1 || (get_u_int(p+4) & ~DS_FRAME_CHECKSUM) != HEADER_WORD_2) {
+    ds_errprintf("Invalid data frame header sentinel value: 0x%x%x.\n", get_u_int(p), get_u_int(p+4));
+    return 0;
+  }
+  p += 12;      // the sample index is not needed
+
+  for (v = 0; v < d->variables; v++) {
+    switch (d->vars[v].type) {
+
+    case DS_NOTYPE:        // This only happens if a variable was un-initialized.
+    case DS_TYPE_MAX:
+      break;
+
+    case DS_INT:           // 32 bit signed integer
+    case DS_FLOAT:         // 32 bit IEEE floating point
+      {
+	unsigned int value;
+	if (end - p < 4) return 0;
+	value = get_u_int(p);
+	memcpy((char *)(d->data[v]) + 4 * (size_t) col, &value, 4);
+	p += 4;
+      }
+      break;
+
+    case DS_DOUBLE:        // 64 bit IEEE floating point
+      {
+	unsigned long long value;
+	if (end - p < 8) return 0;
+	value = get_u_int64(p);
+	memcpy((char *)(d->data[v]) + 8 * (size_t) col, &value, 8);
+	p += 8;
+      }
+      break;
+
+    case DS_STRING:        // arbitrary length string value
+      {
+	char **ptr = & ((char **)(d->data[v]))[col];
+	unsigned used;
+	SAFE_FREE(*ptr);  // free any existing string
+	used = get_string(p, end - p, ptr);
+	if (used == 0) return 0;
+	p += used;
+      }
+      break;
+    }
+  }
+  if (checksum) {
+    if (end - p < DS_CHECKSUM_SIZE) return 0;
+    if (ds_crc32(0, start, p - start) != get_u_int(p)) {
+      ds_errprintf("Checksum mismatch in data frame %u.\n", get_u_int(start+8));
+      return 0;
+    }
+    p += DS_CHECKSUM_SIZE;
+  }
+  return p - start;
+}
+
+// Measure a frame held in memory without decoding it.  Returns the
+// number of bytes in the frame, or 0 if it is invalid or incomplete.
+static unsigned long long
+ds_frame_length(dataset_t *d, const unsigned char *p, unsigned long long avail)
+{
+  unsigned long long pos = 12;
+  int v;
+
+  if (avail < 12 || get_u_int(p) != HEADER_WORD_1 || (get_u_int(p+4) & ~DS_FRAME_CHECKSUM) != HEADER_WORD_2) return 0;
+
+  for (v = 0; v < d->variables; v++) {
+    if (d->vars[v].type == DS_STRING) {
+      unsigned short length;
+      if (avail - pos < 2) return 0;
+      length = get_u_short(p + pos);
+      pos += 2 + ((length == 0xffff) ? 0 : length);
+    } else pos += ds_type_size(d->vars[v].type);
+
+    if (pos > avail) return 0;
+  }
+  if (get_u_int(p+4) & DS_FRAME_CHECKSUM) pos += DS_CHECKSUM_SIZE;
+  return (pos > avail) ? 0 : pos;
+}
+
+// Return the size in bytes of every frame of a file with the given
+// variables and flags, or 0 if the frames vary in size because of
+// strings.
+static unsigned
+ds_fixed_frame_size(dataset_t *d)
+{
+  unsigned size = 12 + ((d->flags & DS_FILE_CHECKSUMMED) ? DS_CHECKSUM_SIZE : 0);
+  int v;
+  for (v = 0; v < d->variables; v++) {
+    if (d->vars[v].type == DS_STRING) return 0;
+    size += ds_type_size(d->vars[v].type);
+  }
+  return size;
+}
+
+/****************************************************************/
+// Write "count" columns of a matrix starting at column "col" as
+// frames, numbering the samples from "first".  Compressed blocks are
+// written instead if the flags call for them.  Returns 0 on success,
+// else an error code.
+static int
+ds_write_frames(dataset_t *d, FILE *file, unsigned int flags, 
+		unsigned int col, unsigned int first, unsigned int count)
+{
+  ds_encoder_t enc;
+  unsigned int samp;
+  int r = 0;
+
+  if (d->frames != NULL) {
+    // Gather the frames a block at a time into ordinary buffers.
+    dataset_t view;
+    unsigned int n, v;
+
+    ds_frame_view(d, &view, DS_CODEC_BLOCK_FRAMES);
+    for (v = 0; v < d->variables; v++) 
+      if (d->frames->offset[v] >= 0 || d->data[v] != NULL) view.data[v] = malloc(DS_CODEC_BLOCK_FRAMES * ds_value_size(d->vars[v].type));
+
+    for (samp = first; samp < first + count && !r; samp += n) {
+      n = first + count - samp;
+      if (n > DS_CODEC_BLOCK_FRAMES) n = DS_CODEC_BLOCK_FRAMES;
+      for (v = 0; v < d->variables; v++) 
+	if (view.data[v] != NULL) ds_gather_frames(d, v, col, n, view.data[v]);
+      r = ds_write_frames(&view, file, flags, 0, samp, n);
+      col = (col + n) % d->columns;
+    }
+    for (v = 0; v < d->variables; v++) SAFE_FREE(view.data[v]);
+    free(view.data);
+    return r;
+  }
+
+  if (flags & DS_FILE_COMPRESSED) return ds_write_compressed_frames(d, file, flags, col, first, count);
+
+  // Write out the frames of data, collecting them into large writes.
+  ds_encoder_init(&enc, d, flags);
+  for (samp = first; samp < first + count && !r; samp++) {
+    r = ds_encoder_add_frame(&enc, file, col, samp);
+
+    // advance the column pointer, wrapping around if necessary
+    if (++col >= d->columns) col = 0;
+  }
+  r = ds_encoder_flush(&enc, file) || r;
+  ds_encoder_free(&enc);
+  return r;
+}
+
+// Write a partial or entire matrix to the given stream.  Since
+// the data matrix is often used as a ring buffer, the logical
+// beginning and length are specified by the startpos and samples
+// variables.  The file representation is in binary.  Returns 0
+// on success, else an error code.
+int 
+ds_write_dataset(dataset_t *d, FILE* file)
+{
+  int r;
+
+  if (d == NULL) return 1;
+
+  // Limit the number of samples written to the size of the matrix.
+  if (d->samples > d->columns) d->samples = d->columns;
+
+  // Write the header.
+  r = ds_write_header(d, file, 1);
+  if (r) return r;
+
+  return ds_write_frames(d, file, d->flags, d->startpos, 0, d->samples);
+}
+
+/****************************************************************/
+// Version 2 files store the data by rows instead of by frames.
+// The header is identical to version 1 except for the version code.
+// It is followed by one contiguous block per variable, each
+// starting on an 8 byte file offset, which holds every sample in the
+// same little-endian encoding used within frames.  A footer index
+// at the end of the file records where each block lies, so a reader
+// can fetch any subset of the variables without parsing the others:
+//
+//   block offset (64 bits), block length (64 bits)    one entry per variable
+//   index offset (64 bits), variable count, DATASET_FOOTER_MAGIC
+//
+// The fixed size trailer on the last line is always the final 16
+// bytes of the file.
+
+#define DS_FOOTER_TRAILER_SIZE 16
+#define DS_BLOCK_ALIGNMENT     8
+
+// Write all valid samples of one variable as a contiguous block,
+// respecting the ring buffer indicators.  The block length in bytes
+// is returned in *length.
+static int
+ds_write_block(dataset_t *d, FILE *file, int v, unsigned long long *length)
+{
+  unsigned size = ds_type_size(d->vars[v].type);
+  int r = 0;
+
+  if (size > 0) {
+    // The block is written in at most two pieces, since the valid
+    // samples may wrap around the end of the ring buffer.
+    unsigned first  = d->columns - d->startpos;
+    unsigned second = 0;
+    if (first > d->samples) first = d->samples;
+    else second = d->samples - first;
+
+#if BYTE_ORDER==BIG_ENDIAN
+    {
+      unsigned c, n = 0;
+      for (c = d->startpos; n < d->samples; n++) {
+	switch (d->vars[v].type) {
+	case DS_INT:    r = r || write_u_int(file, ((unsigned *)(d->data[v]))[c]); break;
+	case DS_FLOAT:  r = r || write_float(file, ((float *)(d->data[v]))[c]);    break;
+	case DS_DOUBLE: r = r || write_double(file, ((double *)(d->data[v]))[c]);  break;
+	default: break;
+	}
+	if (++c >= d->columns) c = 0;
+      }
+    }
+#else
+    r =      (fwrite((char *) d->data[v] + (size_t) d->startpos * size, size, first, file) != first);
+    r = r || (fwrite(d->data[v], size, second, file) != second);
+#endif
+    *length = (unsigned long long) size * d->samples;
+
+  } else if (d->vars[v].type == DS_STRING) {
+    unsigned c, n;
+    *length = 0;
+    for (c = d->startpos, n = 0; n < d->samples; n++) {
+      char *str = ((char **)(d->data[v]))[c];
+      r = r || write_string(file, str);
+      *length += string_size(str);
+      if (++c >= d->columns) c = 0;
+    }
+
+  } else *length = 0;
+
+  return r;
+}
+
+// Write an in-memory matrix to the given stream in the version 2
+// layout.  Returns 0 on success, else an error code.
+int
+ds_write_dataset_v2(dataset_t *d, FILE* file)
+{
+  unsigned long long pos, index_pos;
+  unsigned long long *offsets, *lengths;
+  int r, v, written = 0;
+
+  if (d == NULL) return 1;
+
+  // Limit the number of samples written to the size of the matrix.
+  if (d->samples > d->columns) d->samples = d->columns;
+
+  r = ds_write_header(d, file, 2);
+  if (r) return r;
+
+  // The position is tracked by counting rather than with ftell so
+  // that unseekable streams may also be used.
+  pos = ds_header_size(d);
+
+  offsets = (unsigned long long *) calloc(d->variables, sizeof(unsigned long long));
+  lengths = (unsigned long long *) calloc(d->variables, sizeof(unsigned long long));
+
+  for (v = 0; v < d->variables && !r; v++) {
+    if ( d->vars[v].archivable ) {
+      unsigned pad = (DS_BLOCK_ALIGNMENT - pos % DS_BLOCK_ALIGNMENT) % DS_BLOCK_ALIGNMENT;
+      r = write_zeros(file, pad);
+      pos += pad;
+
+      offsets[written] = pos;
+      if (d->frames != NULL && !r) {
+	// gather the variable out of the frames to write it
+	dataset_t view;
+	ds_frame_view(d, &view, d->columns);
+	view.startpos = d->startpos;
+	view.samples  = d->samples;
+	view.data[v] = malloc((size_t) d->columns * ds_value_size(d->vars[v].type) + 1);
+	ds_gather_frames(d, v, 0, d->columns, view.data[v]);
+	r = ds_write_block(&view, file, v, &lengths[written]);
+	free(view.data[v]);
+	free(view.data);
+      } else r = r || ds_write_block(d, file, v, &lengths[written]);
+      pos += lengths[written];
+      written++;
+    }
+  }
+
+  // Write the footer index.
+  index_pos = pos;
+  for (v = 0; v < written; v++) {
+    r = r || write_u_int64(file, offsets[v]);
+    r = r || write_u_int64(file, lengths[v]);
+  }
+  r = r || write_u_int64(file, index_pos);
+  r = r || write_u_int(file, written);
+  r = r || write_u_int(file, DATASET_FOOTER_MAGIC);
+
+  free(offsets);
+  free(lengths);
+  return r;
+}
+
+// Read one version 2 data block sequentially from a stream into the
+// buffer for variable v, which holds d->columns values.  The block in
+// the file holds "file_samples" values; any beyond the buffer are
+// skipped.  Returns the number of bytes consumed in *length.
+static int
+ds_read_block(dataset_t *d, FILE *file, int v, unsigned file_samples, unsigned long long *length)
+{
+  unsigned size = ds_type_size(d->vars[v].type);
+  unsigned c;
+  int r = 0;
+
+  if (size > 0) {
+    r = (fread(d->data[v], size, d->columns, file) != d->columns);
+    swap_block(d->data[v], d->columns, size);
+    r = r || skip_bytes(file, (unsigned long long) size * (file_samples - d->columns));
+    *length = (unsigned long long) size * file_samples;
+
+  } else if (d->vars[v].type == DS_STRING) {
+    *length = 0;
+    for (c = 0; c < file_samples && !r; c++) {
+      char *str = NULL;
+      r = read_string(file, &str);
+      *length += string_size(str);
+      if (c < d->columns) ((char **)(d->data[v]))[c] = str;
+      else SAFE_FREE(str);
+    }
+  } else *length = 0;
+
+  return r;
+}
+
+// Read the variable blocks of a version 2 file in sequence from a
+// stream positioned after the header, skipping the alignment padding
+// between them.  The footer index is not read.  Returns 0 on success.
+static int
+ds_read_blocks(dataset_t *d, FILE *file, unsigned file_samples)
+{
+  unsigned long long pos = ds_header_size(d), length;
+  unsigned int v;
+  int r = 0;
+
+  for (v = 0; v < d->variables && !r; v++) {
+    unsigned pad = (DS_BLOCK_ALIGNMENT - pos % DS_BLOCK_ALIGNMENT) % DS_BLOCK_ALIGNMENT;
+    r = skip_bytes(file, pad) || ds_read_block(d, file, v, file_samples, &length);
+    pos += pad + length;
+
+    if (r) ds_errprintf("Unable to read data block for variable \"%s\".\n", d->vars[v].name);
+  }
+  return r;
+}
+
+/****************************************************************/
+// Creates a new dataset object from data from a stream.
+// Returns a pointer on success, else NULL.
+dataset_t *new_dataset_from_stream(FILE* file, unsigned maxcolumns)
+{
+  unsigned int cols, v, c, version, file_samples;
+  int r = 0;
+  dataset_t *d;
+
+  d = ds_read_header(file, &version);
+
+
+  if (d == NULL) {
+    ds_errprintf("Unable to read header.\n");
+    return NULL;
+  }
+
+  // Determine the number of columns for the matrix.
+  file_samples = cols = d->columns;
+  if (cols > maxcolumns) cols = maxcolumns;
+
+  // fail if both samples and maxcolumns are unspecified
+  if (cols == DS_UNSPECIFIED_LENGTH) {
+    delete_dataset(d);
+    ds_errprintf("Error: both the file and the memory object have unspecified length.\n");
+    return NULL;
+  }
+
+  // create a set of buffers
+  d->columns = cols;
+  for (v = 0; v < d->variables; v++)
+    ds_allocate_variable_data(d, v);
+
+  if (version == 2) {
+    r = ds_read_blocks(d, file, file_samples);
+
+  } else if (d->flags & DS_FILE_COMPRESSED) {
+    r = ds_read_compressed_frames(d, file);
+
+  } else if (ds_fixed_frame_size(d) > 0) {
+    // Without strings every frame has the same size, so batches of
+    // frames can be fetched with a single read and decoded in memory.
+    unsigned frame_size = ds_fixed_frame_size(d);
+    unsigned batch = 1 + (1 << 16) / frame_size;
+    unsigned char *buffer = (unsigned char *) malloc((size_t) batch * frame_size);
+
+    for (c = 0; c < d->columns && !r; ) {
+      unsigned n = (d->columns - c < batch) ? d->columns - c : batch, i;
+
+      r = (fread(buffer, frame_size, n, file) != n);
+      for (i = 0; i < n && !r; i++, c++)
+	r = (ds_decode_data_frame(d, buffer + (size_t) i * frame_size, frame_size, c) == 0);
+
+      if (r) ds_errprintf("Unable to read data frame %d.\n", c);
+    }
+    free(buffer);
+
+  } else {
+    // and read in a set of data frames
+    unsigned char *buffer = NULL;
+    unsigned long long capacity = 0;
+
+    for (c = 0; c < d->columns; c++) { 
+      r = r || ds_read_data_frame(d, file, c, &buffer, &capacity, 0);
+
+      if (r) {
+	ds_errprintf("Unable to read data frame %d.\n", c);
+	break;
+      }
+    }
+    free(buffer);
+  }
+
+  // if anything failed, clean up
+  if (r) {
+    delete_dataset(d);
+    return NULL;
+  }
+
+  // If everything succeeded, set the number of valid samples.
+  d->samples = d->columns;
+  return d;
+}
+
+/****************************************************************/
+// Streaming.  ds_read_stream decodes the frames of a stream into a
+// window of a few columns, hands the window to a callback and then
+// reuses it, so a stream of any length is read in constant memory.
+// Each frame or compressed block is recognized by its sentinel, and
+// a header may follow the frames of a file, so that files joined
+// with cat(1) read as one stream.
+
+// Return true if two datasets have the same variables.
+static int
+ds_same_variables(dataset_t *a, dataset_t *b)
+{
+  unsigned int v;
+
+  if (a->variables != b->variables) return 0;
+  for (v = 0; v < a->variables; v++) {
+    const char *x = a->vars[v].name, *y = b->vars[v].name;
+    if (a->vars[v].type != b->vars[v].type || strcmp(x ? x : "", y ? y : "")) return 0;
+  }
+  return 1;
+}
+
+// Hand the first "n" columns of the window to the callback and
+// advance the sample index past them.
+static int
+ds_deliver_window(dataset_t *d, unsigned int n, ds_frames_callback_t callback, void *arg)
+{
+  int r;
+  if (n == 0) return 0;
+  d->samples = n;
+  r = callback(d, arg);
+  d->filepos += n;
+  d->samples = 0;
+  return r;
+}
+
+// Give the window "columns" columns, freeing its strings and buffers.
+static void
+ds_resize_window(dataset_t *d, unsigned int columns)
+{
+  unsigned int v, c;
+
+  for (v = 0; v < d->variables; v++) {
+    if (d->data[v] == NULL) continue;
+    if (d->vars[v].type == DS_STRING)
+      for (c = 0; c < d->columns; c++) ds_free_string(d, ((char **) d->data[v])[c]);
+    free(d->data[v]);
+    d->data[v] = NULL;
+  }
+  d->columns = columns;
+  for (v = 0; v < d->variables; v++) ds_allocate_variable_data(d, v);
+}
+
+// Read the "samples" samples of the data blocks of a version 2 file,
+// and its footer, and hand them to the callback at once.  "hdr" is
+// the header of the file, which may be the window "d" itself.
+static int
+ds_stream_blocks(dataset_t *d, dataset_t *hdr, unsigned int samples, FILE *file, ds_frames_callback_t callback, void *arg)
+{
+  unsigned int block = d->columns;
+  int r;
+
+  if (samples == DS_UNSPECIFIED_LENGTH) {
+    ds_errprintf("Error: a version 2 file of unspecified length.\n");
+    return 1;
+  }
+  ds_resize_window(hdr, samples);
+  r = ds_read_blocks(hdr, file, samples) || skip_bytes(file, 16ULL * hdr->variables + DS_FOOTER_TRAILER_SIZE);
+  if (!r) {
+    hdr->filepos = d->filepos;
+    hdr->samples = samples;
+    if (samples > 0) r = callback(hdr, arg);
+    d->filepos += samples;
+  }
+  hdr->samples = 0;
+  if (hdr == d) ds_resize_window(d, block);
+  return r;
+}
+
+int
+ds_read_stream(FILE *file, unsigned int block, ds_frames_callback_t callback, void *arg)
+{
+  unsigned char *buffer = NULL;
+  unsigned long long capacity = 0, used;
+  unsigned int version, c = 0, v, fixed = 12, length;
+  unsigned int joined = 0;   // samples in the files before this one
+  dataset_t *d, *next;
+  int r = 0;
+
+  d = ds_read_header(file, &version);
+  if (d == NULL) {
+    ds_errprintf("Unable to read header.\n");
+    return 1;
+  }
+  next = d;
+
+  if (block == 0) block = DS_CODEC_BLOCK_FRAMES;
+  length = d->columns;
+  d->columns = block;
+  for (v = 0; v < d->variables; v++) {
+    ds_allocate_variable_data(d, v);
+    fixed = (d->vars[v].type == DS_STRING || fixed == 0) ? 0 : fixed + ds_type_size(d->vars[v].type);
+  }
+  d->filepos = 0;
+  d->samples = 0;
+  r = callback(d, arg);    // the header alone
+  if (!r && version == 2) r = ds_stream_blocks(d, d, length, file, callback, arg);
+
+  while (!r) {
+    unsigned int word;
+
+    if (next != d) {
+      // Another file follows; it must record the same variables.  The
+      // window is handed over first, so that no window spans two
+      // files and filepos counts the samples of each from zero.
+      if (!ds_same_variables(d, next)) {
+	ds_errprintf("The variables change at sample %u of the stream.\n", joined + d->filepos + c);
+	r = 1;
+      } else {
+	r = ds_deliver_window(d, c, callback, arg);
+	c = 0;
+	joined += d->filepos;
+	d->filepos = 0;
+	if (!r && version == 2) r = ds_stream_blocks(d, next, next->columns, file, callback, arg);
+      }
+      delete_dataset(next);
+      next = d;
+      continue;
+    }
+    // Read the sentinel of the next frame, block or header.
+    used = 0;
+    if (ds_fetch_bytes(file, &buffer, &capacity, &used, 4)) {
+      if (!feof(file)) r = 1;
+      break;
+    }
+    word = get_u_int(buffer);
+    if (word == DATASET_MAGIC_NUM) {
+      next = ds_read_header_rest(file, word, &version);
+      if (next == NULL) r = 1;
+      continue;
+    }
+    if (word != HEADER_WORD_1 || ds_fetch_bytes(file, &buffer, &capacity, &used, 4)) {
+      ds_errprintf("Invalid frame at sample %u of the stream.\n", joined + d->filepos + c);
+      r = 1;
+      break;
+    }
+
+    if (get_u_int(buffer + 4) & DS_FRAME_COMPRESSED) {
+      // a block is decoded in pieces if it spans windows
+      const unsigned char *data;
+      unsigned long long length;
+      unsigned int frames, skip, n;
+
+      if (ds_fetch_bytes(file, &buffer, &capacity, &used, DS_COMPRESSED_HEADER_SIZE - used)
+	  || ds_parse_compressed_header(buffer, &frames, &length)
+	  || ds_fetch_bytes(file, &buffer, &capacity, &used, length)) {
+	ds_errprintf("Unable to read the block at sample %u of the stream.\n", joined + d->filepos + c);
+	r = 1;
+	break;
+      }
+      data = buffer + DS_COMPRESSED_HEADER_SIZE;
+      for (skip = 0; skip < frames && !r; skip += n) {
+	n = (frames - skip < block - c) ? frames - skip : block - c;
+	if (ds_decode_compressed_block(d, buffer, data, length, c, frames, skip, n)) {
+	  ds_errprintf("Unable to decode the block at sample %u of the stream.\n", joined + d->filepos + c);
+	  r = 1;
+	  break;
+	}
+	if ((c += n) == block) {
+	  r = ds_deliver_window(d, c, callback, arg);
+	  c = 0;
+	}
+      }
+      continue;
+    }
+
+    if (fixed > 0) {
+      // without strings a frame can be read in one piece
+      unsigned int size = fixed + ((get_u_int(buffer + 4) & DS_FRAME_CHECKSUM) ? DS_CHECKSUM_SIZE : 0);
+      r = ds_fetch_bytes(file, &buffer, &capacity, &used, size - used)
+	|| ds_decode_data_frame(d, buffer, used, c) != used;
+    } else r = ds_read_data_frame(d, file, c, &buffer, &capacity, used);
+    if (r) {
+      ds_errprintf("Unable to read the frame at sample %u of the stream.\n", joined + d->filepos + c);
+      break;
+    }
+    if (++c == block) {
+      r = ds_deliver_window(d, c, callback, arg);
+      c = 0;
+    }
+  }
+
+  // The frames read before any error are still handed over.
+  if (c > 0) {
+    int last = ds_deliver_window(d, c, callback, arg);
+    if (!r) r = last;
+  }
+  free(buffer);
+  delete_dataset(d);
+  return r;
+}
+
+/****************************************************************/
+// Read exactly "length" bytes at a file offset, retrying short reads.
+static int
+pread_fully(int fd, void *buf, unsigned long long length, unsigned long long offset)
+{
+  char *p = (char *) buf;
+  while (length > 0) {
+    ssize_t n = pread(fd, p, length, (off_t) offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 1;
+    p += n;
+    offset += n;
+    length -= n;
+  }
+  return 0;
+}
+
+// Determine whether row v should be kept given a list of names.  A
+// NULL list selects everything.
+static int
+ds_name_selected(const char *name, const char **names, int count)
+{
+  int i;
+  if (names == NULL) return 1;
+  for (i = 0; i < count; i++) 
+    if (names[i] != NULL && name != NULL && !strcmp(names[i], name)) return 1;
+  return 0;
+}
+
+// Locate and fetch the footer index of a version 2 file.  Returns a
+// newly allocated copy of the index, or NULL on error.  The offset
+// of the index, which is also the end of the data blocks, is
+// returned in *index_pos.
+static unsigned char *
+ds_read_footer_index(dataset_t *hdr, int fd, unsigned long long file_size, unsigned long long *index_pos)
+{
+  unsigned char trailer[DS_FOOTER_TRAILER_SIZE];
+  unsigned char *index;
+
+  if (file_size < DS_FOOTER_TRAILER_SIZE || pread_fully(fd, trailer, DS_FOOTER_TRAILER_SIZE, file_size - DS_FOOTER_TRAILER_SIZE)) {
+    ds_errprintf("Unable to read version 2 footer.\n");
+    return NULL;
+  }
+  *index_pos = get_u_int64(trailer);
+  if (get_u_int(trailer+12) != DATASET_FOOTER_MAGIC || get_u_int(trailer+8) != hdr->variables 
+      || *index_pos + 16ULL * hdr->variables + DS_FOOTER_TRAILER_SIZE != file_size) {
+    ds_errprintf("Invalid version 2 footer.\n");
+    return NULL;
+  }
+  index = (unsigned char *) malloc(16 * hdr->variables + 1);
+  if (pread_fully(fd, index, 16ULL * hdr->variables, *index_pos)) {
+    ds_errprintf("Unable to read version 2 footer index.\n");
+    free(index);
+    return NULL;
+  }
+  return index;
+}
+
+// Load the selected rows of a version 2 file, using the footer index
+// to issue a single pread per variable.
+static dataset_t *
+ds_read_selected_blocks(dataset_t *hdr, int fd, unsigned long long file_size, const char **names, int count)
+{
+  unsigned char *index;
+  unsigned long long index_pos;
+  unsigned int v, selected = 0, row;
+  dataset_t *d;
+  int r = 0;
+
+  index = ds_read_footer_index(hdr, fd, file_size, &index_pos);
+  if (index == NULL) return NULL;
+
+  // Create a dataset holding only the selected variables; the
+  // descriptions are moved over from the header object.
+  for (v = 0; v < hdr->variables; v++)
+    if (ds_name_selected(hdr->vars[v].name, names, count)) selected++;
+
+  d = new_dataset(selected);
+  d->columns   = hdr->columns;
+  d->timestamp = hdr->timestamp;
+  d->comment   = hdr->comment;
+  hdr->comment = NULL;
+
+  for (v = 0, row = 0; v < hdr->variables && !r; v++) {
+    unsigned long long offset = get_u_int64(index + 16*v);
+    unsigned long long length = get_u_int64(index + 16*v + 8);
+    unsigned size;
+
+    if (!ds_name_selected(hdr->vars[v].name, names, count)) continue;
+
+    d->vars[row] = hdr->vars[v];
+    hdr->vars[v].name = hdr->vars[v].desc = NULL;
+    ds_allocate_variable_data(d, row);
+
+    size = ds_type_size(d->vars[row].type);
+    if (offset + length > index_pos) r = 1;
+
+    else if (size > 0) {
+      if (length != (unsigned long long) size * d->columns) r = 1;
+      else {
+	r = pread_fully(fd, d->data[row], length, offset);
+	swap_block(d->data[row], d->columns, size);
+      }
+
+    } else if (d->vars[row].type == DS_STRING) {
+      unsigned char *block = (unsigned char *) malloc(length + 1);
+      unsigned long long pos = 0;
+      unsigned c;
+
+      r = pread_fully(fd, block, length, offset);
+      for (c = 0; c < d->columns && !r; c++) {
+	unsigned used = get_string(block + pos, length - pos, &((char **)(d->data[row]))[c]);
+	if (used == 0) r = 1;
+	pos += used;
+      }
+      free(block);
+    }
+    if (r) ds_errprintf("Unable to read data block for variable \"%s\".\n", d->vars[row].name);
+    row++;
+  }
+  free(index);
+
+  if (r) {
+    delete_dataset(d);
+    return NULL;
+  }
+  d->samples = d->columns;
+  return d;
+}
+
+// Creates a new dataset object from a named file, keeping only the
+// named variables.  Returns a pointer on success, else NULL.
+dataset_t *new_dataset_from_file(const char *filename, const char **names, int count)
+{
+  FILE *file;
+  dataset_t *hdr, *d = NULL;
+  unsigned int version;
+  struct stat st;
+
+  // The "b" is for non-UNIX systems.
+  file = fopen(filename, "rb");
+  if (file == NULL) {
+    ds_errprintf("Unable to open %s: %s\n", filename, strerror(errno));
+    return NULL;
+  }
+
+  hdr = ds_read_header(file, &version);
+  if (hdr == NULL) {
+    ds_errprintf("Unable to read header.\n");
+    fclose(file);
+    return NULL;
+  }
+
+  if (version == 2 && fstat(fileno(file), &st) == 0) {
+    d = ds_read_selected_blocks(hdr, fileno(file), st.st_size, names, count);
+    delete_dataset(hdr);
+
+  } else {
+    // Version 1 files are read as a window of all their complete
+    // samples, counted as ds_open_file does, so that files left with
+    // an unspecified length by an unclosed writer can be read too.
+    ds_file_t *f;
+    delete_dataset(hdr);
+    fclose(file);
+    f = ds_open_file(filename);
+    d = ds_read_window(f, 0, (f == NULL) ? 0 : f->samples, names, count);
+    ds_close_file(f);
+    return d;
+  }
+
+  fclose(file);
+  return d;
+}
+
+/****************************************************************/
+// Map a file into memory and create a dataset whose buffers point
+// into the mapping where possible.  The mapping is private, so the
+// buffers may be modified without changing the file.
+
+// Fill in the rows of a version 2 file from its mapped blocks.
+static int
+ds_map_blocks(dataset_t *d, const unsigned char *base, unsigned long long size)
+{
+  unsigned long long index_pos;
+  const unsigned char *index;
+  int v, r = 0;
+
+  if (size < DS_FOOTER_TRAILER_SIZE) return 1;
+  index_pos = get_u_int64(base + size - DS_FOOTER_TRAILER_SIZE);
+  if (get_u_int(base + size - 4) != DATASET_FOOTER_MAGIC || get_u_int(base + size - 8) != d->variables 
+      || index_pos + 16ULL * d->variables + DS_FOOTER_TRAILER_SIZE != size) {
+    ds_errprintf("Invalid version 2 footer.\n");
+    return 1;
+  }
+  index = base + index_pos;
+
+  for (v = 0; v < d->variables && !r; v++) {
+    unsigned long long offset = get_u_int64(index + 16*v);
+    unsigned long long length = get_u_int64(index + 16*v + 8);
+    unsigned typesize = ds_type_size(d->vars[v].type);
+
+    if (offset + length > index_pos) r = 1;
+
+    else if (typesize > 0) {
+      if (length != (unsigned long long) typesize * d->columns) r = 1;
+#if BYTE_ORDER==BIG_ENDIAN
+      else {
+	ds_allocate_variable_data(d, v);
+	memcpy(d->data[v], base + offset, length);
+	swap_block(d->data[v], d->columns, typesize);
+      }
+#else
+      // The blocks are aligned and already in the native byte
+      // order, so the rows can refer directly to the file pages.
+      else d->data[v] = (void *) (base + offset);
+#endif
+
+    } else if (d->vars[v].type == DS_STRING) {
+      unsigned long long pos = 0;
+      unsigned c;
+      ds_allocate_variable_data(d, v);
+      for (c = 0; c < d->columns && !r; c++) {
+	unsigned used = get_string(base + offset + pos, length - pos, &((char **)(d->data[v]))[c]);
+	if (used == 0) r = 1;
+	pos += used;
+      }
+    }
+    if (r) ds_errprintf("Invalid data block for variable \"%s\".\n", d->vars[v].name);
+  }
+  return r;
+}
+
+// Decode the compressed blocks of a mapped version 1 file.
+static int
+ds_map_compressed_frames(dataset_t *d, const unsigned char *p, unsigned long long avail)
+{
+  unsigned long long pos, length;
+  unsigned c, frames = 0;
+  int v;
+
+  // Count the frames if the header didn't.
+  if (d->columns == DS_UNSPECIFIED_LENGTH) {
+    for (c = 0, pos = 0; avail - pos >= DS_COMPRESSED_HEADER_SIZE; c += frames) {
+      if (ds_parse_compressed_header(p + pos, &frames, &length)) break;
+      pos += DS_COMPRESSED_HEADER_SIZE + length;
+      if (pos > avail) break;
+    }
+    d->columns = c;
+  }
+
+  for (v = 0; v < d->variables; v++) 
+    ds_allocate_variable_data(d, v);
+
+  for (c = 0, pos = 0; c < d->columns; c += frames) {
+    if (avail - pos < DS_COMPRESSED_HEADER_SIZE || ds_parse_compressed_header(p + pos, &frames, &length)
+	|| length > avail - pos - DS_COMPRESSED_HEADER_SIZE
+	|| ds_decode_compressed_block(d, p + pos, p + pos + DS_COMPRESSED_HEADER_SIZE, length, c, frames, 0, d->columns - c)) {
+      ds_errprintf("Unable to decode compressed block at frame %d.\n", c);
+      return 1;
+    }
+    pos += DS_COMPRESSED_HEADER_SIZE + length;
+  }
+  return 0;
+}
+
+// Decode the frames of a mapped version 1 file.  The frame layout
+// interleaves the variables, so each value must be copied, but no
+// stdio calls are needed.
+static int
+ds_map_frames(dataset_t *d, const unsigned char *p, unsigned long long avail)
+{
+  unsigned frame_size = ds_fixed_frame_size(d);
+  unsigned c;
+  int v;
+
+  if (d->flags & DS_FILE_COMPRESSED) return ds_map_compressed_frames(d, p, avail);
+
+  // Count the frames if the header didn't.
+  if (d->columns == DS_UNSPECIFIED_LENGTH) {
+    if (frame_size > 0) d->columns = avail / frame_size;
+    else {
+      unsigned long long pos = 0, length;
+      for (c = 0; (length = ds_frame_length(d, p + pos, avail - pos)) > 0; c++) pos += length;
+      d->columns = c;
+    }
+  }
+
+  for (v = 0; v < d->variables; v++) 
+    ds_allocate_variable_data(d, v);
+
+  for (c = 0; c < d->columns; c++) {
+    unsigned long long used = ds_decode_data_frame(d, p, avail, c);
+    if (used == 0) {
+      ds_errprintf("Unable to decode data frame %d.\n", c);
+      return 1;
+    }
+    p += used;
+    avail -= used;
+  }
+  return 0;
+}
+
+dataset_t *ds_map_file(const char *filename)
+{
+  FILE *file;
+  dataset_t *d;
+  unsigned int version;
+  unsigned long long header_size;
+  struct stat st;
+  void *mapping;
+  int r;
+
+  // The "b" is for non-UNIX systems.
+  file = fopen(filename, "rb");
+  if (file == NULL) {
+    ds_errprintf("Unable to open %s: %s\n", filename, strerror(errno));
+    return NULL;
+  }
+
+  d = ds_read_header(file, &version);
+  if (d == NULL || fstat(fileno(file), &st) != 0 || st.st_size == 0) {
+    ds_errprintf("Unable to read header.\n");
+    delete_dataset(d);
+    fclose(file);
+    return NULL;
+  }
+
+  mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file), 0);
+  fclose(file);  // the mapping remains valid after the file is closed
+
+  if (mapping == MAP_FAILED) {
+    ds_errprintf("Unable to map %s: %s\n", filename, strerror(errno));
+    delete_dataset(d);
+    return NULL;
+  }
+  d->mapping = mapping;
+  d->mapping_length = st.st_size;
+
+  header_size = ds_header_size(d);
+  if (header_size > (unsigned long long) st.st_size) r = 1;
+  else if (version == 2) r = ds_map_blocks(d, (unsigned char *) mapping, st.st_size);
+  else r = ds_map_frames(d, (unsigned char *) mapping + header_size, st.st_size - header_size);
+
+  if (r) {
+    delete_dataset(d);
+    return NULL;
+  }
+  d->samples = d->columns;
+  return d;
+}
+
+/****************************************************************/
+// Windowed reads from an open file.  Only the header and the index
+// are kept in memory; each window is fetched with pread starting
+// from the nearest indexed position.
+
+#define DS_INDEX_STRIDE 256             // frames between sparse index entries
+#define DS_WALK_CHUNK   (256 * 1024)    // bytes fetched at once while walking frames
+
+// Frames which vary in size are walked through a buffer which is
+// refilled from the file as needed.
+typedef struct {
+  int fd;
+  unsigned char *buffer;
+  unsigned long long capacity;
+  unsigned long long base;      // file offset of buffer[0]
+  unsigned long long have;      // number of valid bytes in buffer
+  unsigned long long pos;       // offset of the current frame within buffer
+  unsigned long long end;       // file offset at which the frames end
+} ds_frame_walker_t;
+
+static void
+ds_walker_init(ds_frame_walker_t *w, int fd, unsigned long long offset, unsigned long long end)
+{
+  w->fd = fd;
+  w->capacity = DS_WALK_CHUNK;
+  w->buffer = (unsigned char *) malloc(w->capacity);
+  w->base = offset;
+  w->have = 0;
+  w->pos = 0;
+  w->end = end;
+}
+
+// Locate the current frame, reading more of the file as needed.
+// Returns the length of the frame at w->buffer + w->pos, or 0 if no
+// further complete frame exists.  The caller advances w->pos.
+static unsigned long long
+ds_walker_frame(dataset_t *hdr, ds_frame_walker_t *w)
+{
+  unsigned long long length, want;
+
+  while ((length = ds_frame_length(hdr, w->buffer + w->pos, w->have - w->pos)) == 0) {
+    if (w->base + w->have >= w->end) return 0;
+
+    // Move the partial frame to the front and append more data.
+    memmove(w->buffer, w->buffer + w->pos, w->have - w->pos);
+    w->base += w->pos;
+    w->have -= w->pos;
+    w->pos = 0;
+    if (w->have == w->capacity) {
+      w->capacity *= 2;
+      w->buffer = (unsigned char *) realloc(w->buffer, w->capacity);
+    }
+    want = w->capacity - w->have;
+    if (want > w->end - w->base - w->have) want = w->end - w->base - w->have;
+    if (pread_fully(w->fd, w->buffer + w->have, want, w->base + w->have)) return 0;
+    w->have += want;
+  }
+  return length;
+}
+
+// Append an entry to the sparse index, growing the arrays at each
+// power of two.
+static void
+ds_add_index_entry(ds_file_t *f, unsigned int sample, unsigned long long offset)
+{
+  if ((f->entries & (f->entries - 1)) == 0) {
+    unsigned size = (f->entries == 0) ? 1 : 2 * f->entries;
+    f->entry_sample = (unsigned int *) realloc(f->entry_sample, size * sizeof(unsigned int));
+    f->entry_offset = (unsigned long long *) realloc(f->entry_offset, size * sizeof(unsigned long long));
+  }
+  f->entry_sample[f->entries] = sample;
+  f->entry_offset[f->entries] = offset;
+  f->entries++;
+}
+
+// Return the last index entry at or before the given sample.
+static unsigned
+ds_find_index_entry(ds_file_t *f, unsigned int sample)
+{
+  unsigned lo = 0, hi = f->entries;
+  while (hi - lo > 1) {
+    unsigned mid = (lo + hi) / 2;
+    if (f->entry_sample[mid] <= sample) lo = mid;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Index every DS_INDEX_STRIDE'th frame of a file with frames of
+// varying size.  This reads the whole file once.
+static int
+ds_index_frames(ds_file_t *f)
+{
+  ds_frame_walker_t w;
+  unsigned long long length;
+  unsigned int limit = f->header->columns;
+
+  ds_walker_init(&w, f->fd, f->header_size, f->file_size);
+  for (f->samples = 0; f->samples < limit && (length = ds_walker_frame(f->header, &w)) > 0; f->samples++) {
+    if (f->samples % DS_INDEX_STRIDE == 0) ds_add_index_entry(f, f->samples, w.base + w.pos);
+    w.pos += length;
+  }
+  f->data_end = w.base + w.pos;
+  free(w.buffer);
+  return 0;
+}
+
+// Index every block of a file with compressed frames.  Only the
+// block headers are read.
+static int
+ds_index_compressed(ds_file_t *f)
+{
+  unsigned char header[DS_COMPRESSED_HEADER_SIZE];
+  unsigned long long pos = f->header_size, length;
+  unsigned int limit = f->header->columns, frames;
+
+  for (f->samples = 0; f->samples < limit && f->file_size - pos >= DS_COMPRESSED_HEADER_SIZE; f->samples += frames) {
+    if (pread_fully(f->fd, header, DS_COMPRESSED_HEADER_SIZE, pos) 
+	|| ds_parse_compressed_header(header, &frames, &length)
+	|| length > f->file_size - pos - DS_COMPRESSED_HEADER_SIZE) break;
+
+    ds_add_index_entry(f, f->samples, pos);
+    pos += DS_COMPRESSED_HEADER_SIZE + length;
+  }
+  f->data_end = pos;
+  if (f->samples > limit) f->samples = limit;
+  return 0;
+}
+
+// Record the block positions of a version 2 file from its footer.
+static int
+ds_index_blocks(ds_file_t *f)
+{
+  unsigned long long index_pos;
+  unsigned char *index = ds_read_footer_index(f->header, f->fd, f->file_size, &index_pos);
+  unsigned v;
+
+  if (index == NULL) return 1;
+  f->block_offset = (unsigned long long *) calloc(f->header->variables + 1, sizeof(unsigned long long));
+  f->block_length = (unsigned long long *) calloc(f->header->variables + 1, sizeof(unsigned long long));
+
+  for (v = 0; v < f->header->variables; v++) {
+    f->block_offset[v] = get_u_int64(index + 16*v);
+    f->block_length[v] = get_u_int64(index + 16*v + 8);
+    if (f->block_offset[v] + f->block_length[v] > index_pos) {
+      ds_errprintf("Invalid data block for variable \"%s\".\n", f->header->vars[v].name);
+      free(index);
+      return 1;
+    }
+  }
+  f->samples = f->header->columns;
+  f->data_end = f->file_size;
+  free(index);
+  return 0;
+}
+
+ds_file_t *ds_open_file(const char *filename)
+{
+  FILE *file;
+  ds_file_t *f;
+  struct stat st;
+  int r;
+
+  // The "b" is for non-UNIX systems.
+  file = fopen(filename, "rb");
+  if (file == NULL) {
+    ds_errprintf("Unable to open %s: %s\n", filename, strerror(errno));
+    return NULL;
+  }
+
+  f = (ds_file_t *) calloc(1, sizeof(ds_file_t));
+  f->header = ds_read_header(file, &f->version);
+  f->fd = dup(fileno(file));
+  r = (f->header == NULL) || (f->fd < 0) || fstat(f->fd, &st) != 0;
+  fclose(file);
+
+  if (r) {
+    ds_errprintf("Unable to read header.\n");
+    ds_close_file(f);
+    return NULL;
+  }
+  f->file_size = st.st_size;
+  f->header_size = ds_header_size(f->header);
+  f->frame_size = ds_fixed_frame_size(f->header);
+
+  if (f->version == 2) r = ds_index_blocks(f);
+  else if (f->header->flags & DS_FILE_COMPRESSED) {
+    f->frame_size = 0;
+    r = ds_index_compressed(f);
+
+  } else if (f->frame_size > 0) {
+    // Fixed size frames need no index.
+    f->samples = (f->file_size - f->header_size) / f->frame_size;
+    if (f->samples > f->header->columns) f->samples = f->header->columns;
+    f->data_end = f->header_size + (unsigned long long) f->frame_size * f->samples;
+
+  } else r = ds_index_frames(f);
+
+  if (r) {
+    ds_close_file(f);
+    return NULL;
+  }
+  return f;
+}
+
+void ds_close_file(ds_file_t *f)
+{
+  if (f == NULL) return;
+  if (f->fd >= 0) close(f->fd);
+  delete_dataset(f->header);
+  SAFE_FREE(f->entry_sample);
+  SAFE_FREE(f->entry_offset);
+  SAFE_FREE(f->block_offset);
+  SAFE_FREE(f->block_length);
+  free(f);
+}
+
+dataset_t *ds_read_info(const char *filename)
+{
+  ds_file_t *f = ds_open_file(filename);
+  dataset_t *d;
+
+  if (f == NULL) return NULL;
+  d = f->header;
+  f->header = NULL;
+  d->columns = d->samples = f->samples;
+  ds_close_file(f);
+  return d;
+}
+
+// Create an empty window of n columns with copies of the selected
+// variable descriptions from a header.
+static dataset_t *
+ds_new_window(dataset_t *hdr, unsigned n, const char **names, int count)
+{
+  unsigned int v, selected = 0, row;
+  dataset_t *d;
+
+  for (v = 0; v < hdr->variables; v++)
+    if (ds_name_selected(hdr->vars[v].name, names, count)) selected++;
+
+  d = new_dataset(selected);
+  d->columns   = n;
+  d->timestamp = hdr->timestamp;
+  d->flags     = hdr->flags;
+  if (hdr->comment != NULL) d->comment = strdup(hdr->comment);
+
+  for (v = 0, row = 0; v < hdr->variables; v++) {
+    if (!ds_name_selected(hdr->vars[v].name, names, count)) continue;
+    d->vars[row] = hdr->vars[v];
+    if (hdr->vars[v].name != NULL) d->vars[row].name = strdup(hdr->vars[v].name);
+    if (hdr->vars[v].desc != NULL) d->vars[row].desc = strdup(hdr->vars[v].desc);
+    ds_allocate_variable_data(d, row);
+    row++;
+  }
+  return d;
+}
+
+// Fill row "row" of a window from the block of variable v of a
+// version 2 file.  Numeric rows are read directly from their position
+// in the block; string blocks are read in full, since the strings
+// vary in size.
+static int
+ds_read_window_block(ds_file_t *f, dataset_t *d, unsigned v, unsigned row, unsigned first)
+{
+  unsigned long long offset = f->block_offset[v], length = f->block_length[v];
+  unsigned size = ds_type_size(f->header->vars[v].type);
+  int r = 0;
+
+  if (size > 0) {
+    if (length != (unsigned long long) size * f->samples) r = 1;
+    else {
+      r = pread_fully(f->fd, d->data[row], (unsigned long long) size * d->columns, offset + (unsigned long long) size * first);
+      swap_block(d->data[row], d->columns, size);
+    }
+
+  } else if (d->vars[row].type == DS_STRING) {
+    unsigned char *block = (unsigned char *) malloc(length + 1);
+    unsigned long long pos = 0;
+    unsigned c;
+
+    r = pread_fully(f->fd, block, length, offset);
+    for (c = 0; c < first + d->columns && !r; c++) {
+      char *s;
+      unsigned used = get_string(block + pos, length - pos, &s);
+      if (used == 0) r = 1;
+      else if (c < first) free(s);
+      else ((char **)(d->data[row]))[c - first] = s;
+      pos += used;
+    }
+    free(block);
+  }
+  if (r) ds_errprintf("Unable to read data block for variable \"%s\".\n", d->vars[row].name);
+  return r;
+}
+
+// The following fill "n" columns of a window starting at column
+// "col" with the frames starting at sample "first".
+
+// Fixed size frames are located by arithmetic.
+static int
+ds_read_window_fixed(ds_file_t *f, dataset_t *d, unsigned first, unsigned col, unsigned n)
+{
+  unsigned batch = 1 + DS_WALK_CHUNK / f->frame_size;
+  unsigned char *buffer = (unsigned char *) malloc((size_t) batch * f->frame_size);
+  unsigned c, i, count;
+  int r = 0;
+
+  for (c = 0; c < n && !r; c += count) {
+    count = (n - c < batch) ? n - c : batch;
+    r = pread_fully(f->fd, buffer, (unsigned long long) f->frame_size * count, 
+		    f->header_size + (unsigned long long) f->frame_size * (first + c));
+    for (i = 0; i < count && !r; i++)
+      r = (ds_decode_data_frame(d, buffer + (size_t) i * f->frame_size, f->frame_size, col + c + i) == 0);
+  }
+  free(buffer);
+  return r;
+}
+
+// Frames of varying size are walked forward from the nearest indexed
+// frame.
+static int
+ds_read_window_frames(ds_file_t *f, dataset_t *d, unsigned first, unsigned col, unsigned n)
+{
+  unsigned e = ds_find_index_entry(f, first);
+  unsigned int sample = f->entry_sample[e];
+  unsigned long long length;
+  ds_frame_walker_t w;
+  int r = 0;
+
+  ds_walker_init(&w, f->fd, f->entry_offset[e], f->file_size);
+  for (; sample < first + n && !r; sample++) {
+    length = ds_walker_frame(f->header, &w);
+    if (length == 0) r = 1;
+    else if (sample >= first)
+      r = (ds_decode_data_frame(d, w.buffer + w.pos, length, col + sample - first) == 0);
+    w.pos += length;
+  }
+  free(w.buffer);
+  return r;
+}
+
+// Compressed blocks are decoded starting with the block which holds
+// the first sample.
+static int
+ds_read_window_compressed(ds_file_t *f, dataset_t *d, unsigned first, unsigned col, unsigned n)
+{
+  unsigned char header[DS_COMPRESSED_HEADER_SIZE];
+  unsigned char *buffer = NULL;
+  unsigned long long capacity = 0, length;
+  unsigned e, c, frames = 0, skip;
+  int r = 0;
+
+  for (e = ds_find_index_entry(f, first), c = 0; c < n && !r; e++) {
+    r = (e >= f->entries)
+      || pread_fully(f->fd, header, DS_COMPRESSED_HEADER_SIZE, f->entry_offset[e])
+      || ds_parse_compressed_header(header, &frames, &length);
+
+    if (!r && length > capacity) {
+      capacity = length;
+      buffer = (unsigned char *) realloc(buffer, capacity);
+    }
+    skip = (first > f->entry_sample[e]) ? first - f->entry_sample[e] : 0;
+    r = r || pread_fully(f->fd, buffer, length, f->entry_offset[e] + DS_COMPRESSED_HEADER_SIZE)
+      || skip >= frames
+      || ds_decode_compressed_block(d, header, buffer, length, col + c, frames, skip, n - c);
+    c += frames - skip;
+  }
+  free(buffer);
+  return r;
+}
+
+// Fill columns of a window from the frames of a version 1 file, using
+// whichever method suits the frame layout.
+static int
+ds_read_window_range(ds_file_t *f, dataset_t *d, unsigned first, unsigned col, unsigned n)
+{
+  if (n == 0) return 0;
+  else if (f->header->flags & DS_FILE_COMPRESSED) return ds_read_window_compressed(f, d, first, col, n);
+  else if (f->frame_size > 0) return ds_read_window_fixed(f, d, first, col, n);
+  else return ds_read_window_frames(f, d, first, col, n);
+}
+
+dataset_t *ds_read_window(ds_file_t *f, unsigned first_sample, unsigned n_samples,
+			  const char **names, int count)
+{
+  dataset_t *d;
+  int r = 0, v;
+
+  if (f == NULL) return NULL;
+
+  // Truncate the window at the end of the file.
+  if (first_sample > f->samples) first_sample = f->samples;
+  if (n_samples > f->samples - first_sample) n_samples = f->samples - first_sample;
 
-    if (r) {
-      ds_errprintf("Error reading variable name.\n");
-      break;
+  if (f->version == 2) {
+    unsigned int row = 0;
+    d = ds_new_window(f->header, n_samples, names, count);
+
+    for (v = 0; v < f->header->variables && n_samples > 0 && !r; v++) {
+      if (ds_name_selected(f->header->vars[v].name, names, count))
+	r = ds_read_window_block(f, d, v, row++, first_sample);
     }
-    
-    // added dummy with change from c to c++
-    unsigned int typeDummy;
-    r = r || read_u_int(file, &typeDummy);
-    var->type = (dsType) typeDummy;
-    
-    r = r || read_u_int(file, &typeDummy);
-    var->units = (dsUnits) typeDummy;
-        
-//    r = r || read_u_int(file, &var->type);
-//    r = r || read_u_int(file, &var->units);
-    r = r || read_string(file, &var->desc);
-    r = r || read_double(file, &var->upper);
-    r = r || read_double(file, &var->lower);
-    r = r || read_u_int(file, &padding);        // 64 bits of padding for expansion
-    r = r || read_u_int(file, &padding);
 
-    var->archivable = 1; // by default everything should be written out
+  } else {
+    // Frames hold every variable, so the whole window is decoded and
+    // the unwanted rows discarded afterwards.
+    d = ds_new_window(f->header, n_samples, NULL, 0);
+    r = ds_read_window_range(f, d, first_sample, 0, n_samples);
 
-    if (r) {
-      ds_errprintf("Error reading variable description.\n");
-      break;
+    for (v = d->variables - 1; v >= 0 && !r; v--) {
+      if (!ds_name_selected(d->vars[v].name, names, count)) ds_delete_variable(d, v);
     }
   }
 
-  // If anything failed, free up the new object.
   if (r) {
+    ds_errprintf("Unable to read samples %u to %u.\n", first_sample, first_sample + n_samples);
     delete_dataset(d);
     return NULL;
-  } 
+  }
+  d->filepos = first_sample;
+  d->samples = d->columns;
   return d;
 }
 
-
 /****************************************************************/
-// Write a frame of data to a stream, i.e., one column of the
-// data matrix.  col is the column index.  samp is the sample
-// index within the stream.  Returns 0 on success, else an error
-// code.
+// Load a whole file using several threads.  Each thread fills a
+// contiguous range of columns, or for version 2 files every n'th
+// variable, with pread calls on the shared file descriptor.
 
-static int
-ds_write_data_frame(dataset_t *d, FILE* file, unsigned int col, unsigned int samp)
+typedef struct {
+  ds_file_t *f;
+  dataset_t *d;
+  unsigned first;        // first sample of the range
+  unsigned n;            // number of samples in the range
+  unsigned thread;       // index of this thread
+  unsigned threads;      // number of threads
+  int r;                 // result code
+} ds_load_job_t;
+
+static void *
+ds_load_thread(void *arg)
 {
-  int r, v;
+  ds_load_job_t *job = (ds_load_job_t *) arg;
 
-  // First write out the frame header.
-  r =      write_u_int(file, HEADER_WORD_1);  // 64 bit marker
-  r = r || write_u_int(file, HEADER_WORD_2);  // that may eventually include flags
-  r = r || write_u_int(file, samp);           // sample index
+  if (job->f->version == 2) {
+    unsigned v;
+    for (v = job->thread; v < job->d->variables && !job->r; v += job->threads)
+      job->r = ds_read_window_block(job->f, job->d, v, v, 0);
 
-  if (r) return r;
-
-  // Write out each variable in sequence.
-  for (v = 0; v < d->variables; v++) {
-
-    // check if the variable is flagged for writing to disk
-    if ( d->vars[v].archivable ) {
-
-      // then write one element according to the data type
-      switch (d->vars[v].type) {
-
-      case DS_NOTYPE:        // This only happens if a variable was un-initialized.
-      case DS_TYPE_MAX:
-	break;
-
-      case DS_INT:           // 32 bit signed integer
-	r = r || write_u_int(file, ((unsigned *)(d->data[v]))[col]);
-	break;
+  } else job->r = ds_read_window_range(job->f, job->d, job->first, job->first, job->n);
+  return NULL;
+}
 
-      case DS_FLOAT:         // 32 bit IEEE floating point
-	r = r || write_float(file, ((float *)(d->data[v]))[col]);
-	break;
+dataset_t *new_dataset_from_file_parallel(const char *filename, int threads)
+{
+  ds_file_t *f;
+  ds_load_job_t *jobs;
+  pthread_t *ids;
+  char *started;
+  dataset_t *d;
+  int i, r = 0;
+
+  if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads <= 0) threads = 1;
+
+  f = ds_open_file(filename);
+  if (f == NULL) return NULL;
+  d = ds_new_window(f->header, f->samples, NULL, 0);
+
+  jobs = (ds_load_job_t *) calloc(threads, sizeof(ds_load_job_t));
+  ids = (pthread_t *) calloc(threads, sizeof(pthread_t));
+  started = (char *) calloc(threads, 1);
+
+  // Divide the samples evenly, moving each boundary back to an index
+  // entry so that no frames or blocks are decoded twice.
+  for (i = 0; i < threads; i++) {
+    unsigned first = (unsigned long long) f->samples * i / threads;
+    if (f->version == 1 && f->entries > 0) first = f->entry_sample[ds_find_index_entry(f, first)];
+
+    jobs[i].f = f;
+    jobs[i].d = d;
+    jobs[i].first = first;
+    jobs[i].thread = i;
+    jobs[i].threads = threads;
+  }
+  for (i = 0; i < threads; i++) 
+    jobs[i].n = ((i + 1 < threads) ? jobs[i+1].first : f->samples) - jobs[i].first;
+
+  // The calling thread takes the first range, and also any range for
+  // which a thread cannot be created.
+  for (i = 1; i < threads; i++) 
+    started[i] = (pthread_create(&ids[i], NULL, ds_load_thread, &jobs[i]) == 0);
+
+  ds_load_thread(&jobs[0]);
+  for (i = 1; i < threads; i++) {
+    if (started[i]) pthread_join(ids[i], NULL);
+    else ds_load_thread(&jobs[i]);
+  }
+  for (i = 0; i < threads; i++) r = r || jobs[i].r;
 
-      case DS_DOUBLE:        // 64 bit IEEE floating point
-	r = r || write_double(file, ((double *)(d->data[v]))[col]);
-	break;
+  free(jobs);
+  free(ids);
+  free(started);
+  ds_close_file(f);
 
-      case DS_STRING:        // arbitrary length string value
-	r = r || write_string(file, ((char **)(d->data[v]))[col]);
-	break;
-      }
-    }
+  if (r) {
+    ds_errprintf("Unable to read %s.\n", filename);
+    delete_dataset(d);
+    return NULL;
   }
-  return r;
+  d->samples = d->columns;
+  return d;
 }
 
 /****************************************************************/
-// Read a frame of data from a stream, i.e., one column of the
-// data matrix.  col is the column index. Returns 0 on success,
-// else an error code.
-
+// Appending to a version 1 file.  While the file is open the header
+// holds DS_UNSPECIFIED_LENGTH, which the file readers take to mean
+// that the samples run to the end of the file; the true count is
+// patched in on close.  On opening an existing file the complete
+// samples are counted from the data itself, so a file left open by a
+// crash is recovered up to its last complete frame or block.
+
+// Overwrite the sample count in the header of a file.
 static int
-ds_read_data_frame(dataset_t *d, FILE* file, unsigned int col)
+ds_patch_sample_count(FILE *file, unsigned int samples)
 {
-  unsigned int header1, header2, index;
-  int r, v;
-
-  // First read in the frame header.
-  r =      read_u_int(file, &header1);  // 64 bit marker
-  r = r || read_u_int(file, &header2);  // that may eventually include flags
-  r = r || read_u_int(file, &index);    // sample index
+  return fseek(file, 8, SEEK_SET) || write_u_int(file, samples) || fseek(file, 0, SEEK_END);
+}
 
-  if (r) {
-    ds_errprintf("Unable to read data frame header.\n");
-    return 1;
-  }
+// Check that the variables of a file match the archivable variables
+// of a dataset.  Returns 0 if they match.
+static int
+ds_check_variables(dataset_t *hdr, dataset_t *d)
+{
+  unsigned int v, row = 0;
 
-  if ((header1 != HEADER_WORD_1) || (header2 != HEADER_WORD_2)) {
-    ds_errprintf("Invalid data frame header sentinel value: 0x%x%x.\n", header1, header2);
-    return 1;
-  }
-  
-  // Read in each variable in sequence.
   for (v = 0; v < d->variables; v++) {
-    switch (d->vars[v].type) {
-
-    case DS_NOTYPE:        // This only happens if a variable was un-initialized.
-    case DS_TYPE_MAX:
-      break;
-
-    case DS_INT:           // 32 bit signed integer
-      r = r || read_u_int(file, & ((unsigned *)(d->data[v]))[col]);
-      break;
+    if ( !d->vars[v].archivable ) continue;
+    if (row >= hdr->variables) return 1;
+    if (hdr->vars[row].type != d->vars[v].type 
+	|| hdr->vars[row].name == NULL || d->vars[v].name == NULL 
+	|| strcmp(hdr->vars[row].name, d->vars[v].name)) {
+      ds_errprintf("Variable \"%s\" does not match the file.\n", d->vars[v].name ? d->vars[v].name : "");
+      return 1;
+    }
+    row++;
+  }
+  return (row != hdr->variables);
+}
 
-    case DS_FLOAT:         // 32 bit IEEE floating point
-      r = r || read_float(file, & ((float *)(d->data[v]))[col]);
-      break;
+ds_append_t *ds_open_append(const char *filename, dataset_t *d)
+{
+  ds_append_t *a;
+  ds_file_t *f = NULL;
+  struct stat st;
+  int fd, r = 0;
 
-    case DS_DOUBLE:        // 64 bit IEEE floating point
-      r = r || read_double(file, & ((double *)(d->data[v]))[col]);
-      break;
+  if (d == NULL) return NULL;
 
-    case DS_STRING:        // arbitrary length string value
-      {
-	char **ptr = & ((char **)(d->data[v]))[col];	
-	if (!r) {
-	  SAFE_FREE(*ptr);  // free any existing string
-	  r = r || read_string(file, ptr);
-
-	  if (r) {
-	    ds_errprintf("Error reading datum string for variable \"%s\"\n", d->vars[v].name);
-	    return 1;
-	  }
-	}
-      }
-      break;
+  fd = open(filename, O_RDWR | O_CREAT, 0666);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    ds_errprintf("Unable to open %s: %s\n", filename, strerror(errno));
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+  a = (ds_append_t *) calloc(1, sizeof(ds_append_t));
+  a->file = fdopen(fd, "r+b");  // the "b" is for non-UNIX systems
+  a->flags = d->flags;
+
+  if (st.st_size == 0) {
+    // A new file starts with the header of the dataset.
+    r = ds_write_header(d, a->file, 1);
+
+  } else {
+    // An existing file must hold frames of the same variables.  Any
+    // incomplete frame at the end is discarded.
+    f = ds_open_file(filename);
+    if (f == NULL || f->version != 1) {
+      ds_errprintf("Unable to append to %s: not a version 1 dataset file.\n", filename);
+      r = 1;
+    } else if (ds_check_variables(f->header, d)) {
+      ds_errprintf("Unable to append to %s: the variables differ.\n", filename);
+      r = 1;
+    } else {
+      a->samples = f->samples;
+      a->flags = f->header->flags;
+      r = (f->data_end < f->file_size && ftruncate(fd, f->data_end) != 0);
     }
+    ds_close_file(f);
+  }
+  r = r || ds_patch_sample_count(a->file, DS_UNSPECIFIED_LENGTH);
 
-    if (r) {
-      ds_errprintf("Error reading numeric datum for variable \"%s\": %s\n", d->vars[v].name, strerror(errno));
-      break;
-    }
+  if (r) {
+    fclose(a->file);
+    free(a);
+    return NULL;
   }
-  return r;
+  return a;
 }
-/****************************************************************/
-// Write a partial or entire matrix to the given stream.  Since
-// the data matrix is often used as a ring buffer, the logical
-// beginning and length are specified by the startpos and samples
-// variables.  The file representation is in binary.  Returns 0
-// on success, else an error code.
-int 
-ds_write_dataset(dataset_t *d, FILE* file)
-{
-  int r, col, samp;
 
-  if (d == NULL) return 1;
+int ds_append_frames(dataset_t *d, ds_append_t *file, unsigned int first_col, unsigned int n)
+{
+  int r;
 
-  // Limit the number of samples written to the size of the matrix.
-  if (d->samples > d->columns) d->samples = d->columns;
+  if (d == NULL || file == NULL || d->columns == 0) return 1;
+  if (n > d->columns) return 1;
 
-  // Write the header.
-  r = ds_write_header(d, file);
-  if (r) return r;
+  r = ds_write_frames(d, file->file, file->flags, first_col % d->columns, file->samples, n);
+  if (!r) file->samples += n;
+  return r;
+}
 
-  // Write out the frames of data.
-  for (col = d->startpos, samp = 0; samp < d->samples; samp++) {
-    r = r || ds_write_data_frame(d, file, col, samp);
+int ds_close_append(ds_append_t *file)
+{
+  int r;
+  if (file == NULL) return 1;
 
-    // advance the column pointer, wrapping around if necessary
-    if (++col >= d->columns) col = 0;
-  }
+  r = ds_patch_sample_count(file->file, file->samples);
+  r = fclose(file->file) || r;
+  free(file);
   return r;
 }
 
 /****************************************************************/
-// Creates a new dataset object from data from a stream.
-// Returns a pointer on success, else NULL.
-dataset_t *new_dataset_from_stream(FILE* file, unsigned maxcolumns)
+// Recovery of damaged version 1 files.  The frames and blocks are
+// located by scanning the file for the frame sentinel.  Anything
+// which fails to parse, or whose checksum does not match, is skipped
+// by searching for the next sentinel.
+
+// Return the length of a valid frame or compressed block at p, or 0
+// if there is none.  *frames is set to the number of samples it holds.
+static unsigned long long
+ds_salvage_frame(dataset_t *hdr, const unsigned char *p, unsigned long long avail, unsigned *frames)
 {
-  unsigned int cols, v, c;
-  int r = 0;
-  dataset_t *d;
+  unsigned long long length;
+
+  if (avail < DS_COMPRESSED_HEADER_SIZE) {
+    if (avail < 12) return 0;
+  } else if (get_u_int(p) == HEADER_WORD_1 && (get_u_int(p+4) & DS_FRAME_COMPRESSED)) {
+    if (ds_parse_compressed_header(p, frames, &length)
+	|| length > avail - DS_COMPRESSED_HEADER_SIZE
+	|| ds_check_compressed_block(p, p + DS_COMPRESSED_HEADER_SIZE, length)) return 0;
+    return DS_COMPRESSED_HEADER_SIZE + length;
+  }
+
+  length = ds_frame_length(hdr, p, avail);
+  if (length == 0) return 0;
+  if ((get_u_int(p+4) & DS_FRAME_CHECKSUM)
+      && ds_crc32(0, p, length - DS_CHECKSUM_SIZE) != get_u_int(p + length - DS_CHECKSUM_SIZE)) return 0;
+  *frames = 1;
+  return length;
+}
 
-  d = ds_read_header(file);
+dataset_t *ds_recover_file(const char *filename, unsigned long long *discarded)
+{
+  static const unsigned char sentinel[4] = { 
+    HEADER_WORD_1 & 0xff, (HEADER_WORD_1 >> 8) & 0xff, (HEADER_WORD_1 >> 16) & 0xff, HEADER_WORD_1 >> 24 };
+  FILE *file;
+  dataset_t *d;
+  unsigned int version, entries = 0, samples = 0, frames = 0, e, v;
+  unsigned long long *offsets = NULL, pos, length, skipped = 0, size;
+  unsigned char *base;
+  struct stat st;
+  int r = 0;
 
+  if (discarded != NULL) *discarded = 0;
 
-  if (d == NULL) {
-    ds_errprintf("Unable to read header.\n");
+  // The "b" is for non-UNIX systems.
+  file = fopen(filename, "rb");
+  if (file == NULL) {
+    ds_errprintf("Unable to open %s: %s\n", filename, strerror(errno));
     return NULL;
   }
-
-  // Determine the number of columns for the matrix.
-  cols = d->columns;
-  if (cols > maxcolumns) cols = maxcolumns;
-
-  // fail if both samples and maxcolumns are unspecified
-  if (cols == DS_UNSPECIFIED_LENGTH) {
+  d = ds_read_header(file, &version);
+  if (d == NULL || version != 1 || fstat(fileno(file), &st) != 0) {
+    ds_errprintf("Unable to recover %s: no valid version 1 header.\n", filename);
+    delete_dataset(d);
+    fclose(file);
+    return NULL;
+  }
+  size = st.st_size;
+  pos = ds_header_size(d);
+  base = (size > pos) ? (unsigned char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0) : NULL;
+  fclose(file);
+  if (base == MAP_FAILED) {
+    ds_errprintf("Unable to map %s: %s\n", filename, strerror(errno));
     delete_dataset(d);
-    ds_errprintf("Error: both the file and the memory object have unspecified length.\n");
     return NULL;
   }
 
-  // create a set of buffers
-  d->columns = cols;
-  for (v = 0; v < d->variables; v++)
-    ds_allocate_variable_data(d, v);
+  // First locate every valid frame, to learn the number of samples.
+  while (base != NULL && pos < size) {
+    length = ds_salvage_frame(d, base + pos, size - pos, &frames);
+    if (length > 0) {
+      if ((entries & (entries - 1)) == 0)   // grow at each power of two
+	offsets = (unsigned long long *) realloc(offsets, ((entries == 0) ? 1 : 2 * entries) * sizeof(unsigned long long));
+      offsets[entries++] = pos;
+      samples += frames;
+      pos += length;
+    } else {
+      const unsigned char *next = (const unsigned char *) memmem(base + pos + 1, size - pos - 1, sentinel, 4);
+      length = (next == NULL) ? size - pos : (unsigned long long) (next - (base + pos));
+      skipped += length;
+      pos += length;
+    }
+  }
 
-  // and read in a set of data frames
-  for (c = 0; c < d->columns; c++) { 
-    r = r || ds_read_data_frame(d, file, c);
+  // Then decode them.
+  d->columns = samples;
+  for (v = 0; v < d->variables; v++) 
+    ds_allocate_variable_data(d, v);
 
-    if (r) {
-      ds_errprintf("Unable to read data frame %d.\n", c);
-      break;
-    }
+  for (e = 0, samples = 0; e < entries && !r; e++) {
+    const unsigned char *p = base + offsets[e];
+    length = ds_salvage_frame(d, p, size - offsets[e], &frames);
+    if (get_u_int(p+4) & DS_FRAME_COMPRESSED)
+      r = ds_decode_compressed_block(d, p, p + DS_COMPRESSED_HEADER_SIZE, length - DS_COMPRESSED_HEADER_SIZE,
+				     samples, frames, 0, frames);
+    else r = (ds_decode_data_frame(d, p, length, samples) == 0);
+    samples += frames;
   }
+  free(offsets);
+  if (base != NULL) munmap(base, size);
 
-  // if anything failed, clean up
   if (r) {
     delete_dataset(d);
     return NULL;
   }
-
-  // If everything succeeded, set the number of valid samples.
   d->samples = d->columns;
+  if (discarded != NULL) *discarded = skipped;
   return d;
 }
 
 /****************************************************************/
 // Create ASCII output for datum.
 
+// Room for the text of any number.
+#define DS_NUMBER_TEXT 32
+
+// Size of the buffer of text built by ds_print_columns.
+#define DS_TEXT_BUFFER (64 * 1024)
+
+// Write the text of a number of the given type at p, as the shortest
+// text which reads back as the same value.  Returns the end of the
+// text.
+static char *
+ds_format_number(char *p, enum dsType type, const void *value)
+{
+  union { int i; float f; double x; } n;
+
+  memcpy(&n, value, ds_value_size(type));
+  switch(type) {
+  case DS_INT:
+#ifdef __cpp_lib_to_chars
+    return std::to_chars(p, p + DS_NUMBER_TEXT, n.i).ptr;
+#else
+    return p + sprintf(p, "%d", n.i);
+#endif
+  case DS_FLOAT:
+#ifdef __cpp_lib_to_chars
+    return std::to_chars(p, p + DS_NUMBER_TEXT, n.f).ptr;
+#else
+    return p + sprintf(p, "%.9g", n.f);
+#endif
+  case DS_DOUBLE:
+#ifdef __cpp_lib_to_chars
+    return std::to_chars(p, p + DS_NUMBER_TEXT, n.x).ptr;
+#else
+    return p + sprintf(p, "%.17g", n.x);
+#endif
+  default:
+    return p;
+  }
+}
+
 void
 ds_print_value(dataset_t *d, FILE *file, int v, int c)
 {
+  union { int i; float f; double x; } value;
+  const void *p = &value;
+  char text[DS_NUMBER_TEXT];
+
   switch(d->vars[v].type) {
     case DS_NOTYPE:        // This only happens if a variable was un-initialized.
     case DS_TYPE_MAX:
       break;
 
-    case DS_INT:           // 32 bit signed integer
-      fprintf (file, "%d", (ds_int(d, v))[c]);
-      break;
-
-    case DS_FLOAT:         // 32 bit IEEE floating point
-      fprintf (file, "%f", (ds_float(d, v))[c]);
-      break;
-
-    case DS_DOUBLE:        // 64 bit IEEE floating point
-      fprintf (file, "%f", (ds_double(d, v))[c]);
-      break;
-
     case DS_STRING:        // arbitrary length string value
       {
 	const char *ptr = ds_get_string(d, v, c);
 	if (ptr == NULL) ptr = "<null string>";
 	fprintf (file, "\"%s\"", ptr);
       }
+      break;
+
+    default:
+      // a quantized value is expanded first
+      if (d->frames != NULL && ds_quantized(d, v)) ds_gather_frames(d, v, c, 1, &value);
+      else p = ds_value_address(d, v, c);
+      fwrite(text, 1, ds_format_number(text, d->vars[v].type, p) - text, file);
+  }
+}
+
+// Print lines of text, one for each "step"th of the "n" columns from
+// "col", each holding the values of the "count" variables listed in
+// "rows" separated by spaces.  The text is built up in a large buffer
+// and written in blocks.
+int
+ds_print_columns(dataset_t *d, FILE *file, const int *rows, int count, unsigned int col, unsigned int n, unsigned int step)
+{
+  char *text = (char *) malloc(DS_TEXT_BUFFER);
+  unsigned int end = col + n, c;
+  size_t used = 0;
+  int i;
+
+  if (count <= 0) {
+    free(text);
+    return 0;
+  }
+  if (text == NULL) return 1;
+  if (step == 0) step = 1;
+
+  for (c = col; c < end; c += step) {
+    for (i = 0; i < count; i++) {
+      int v = rows[i];
+      enum dsType type = d->vars[v].type;
+
+      if (used + DS_NUMBER_TEXT + 2 > DS_TEXT_BUFFER) {
+	fwrite(text, 1, used, file);
+	used = 0;
+      }
+      if (i > 0) text[used++] = ' ';
+
+      if (type == DS_STRING) {
+	const char *ptr = ds_get_string(d, v, c);
+	size_t length;
+
+	if (ptr == NULL) ptr = "<null string>";
+	length = strlen(ptr);
+	if (used + length + 3 > DS_TEXT_BUFFER) {
+	  // a long string goes straight out
+	  fwrite(text, 1, used, file);
+	  fprintf(file, "\"%s\"", ptr);
+	  used = 0;
+	} else {
+	  text[used++] = '"';
+	  memcpy(text + used, ptr, length);
+	  used += length;
+	  text[used++] = '"';
+	}
+      } else if (d->frames != NULL && ds_quantized(d, v)) {
+	union { int i; float f; double x; } value;
+	ds_gather_frames(d, v, c, 1, &value);
+	used = ds_format_number(text + used, type, &value) - text;
+      } else if (type != DS_NOTYPE && type != DS_TYPE_MAX) 
+	used = ds_format_number(text + used, type, ds_value_address(d, v, c)) - text;
+    }
+    text[used++] = '\n';
   }
+  fwrite(text, 1, used, file);
+  free(text);
+  return ferror(file) ? 1 : 0;
 }
+
 /****************************************************************/
 // Generate diagnostic output to stream.
 void ds_print_info(dataset_t *d, FILE* file, int verbose)
@@ -1017,6 +4008,10 @@ void ds_print_info(dataset_t *d, FILE* file, int verbose)
 	  fprintf(file, "      upper: %g\n", d->vars[v].upper);
 	  fprintf(file, "      lower: %g\n", d->vars[v].lower);
 	}
+	if (d->vars[v].decimation > 1)
+	  fprintf(file, "      every: %u samples\n", d->vars[v].decimation);
+	if (d->vars[v].scale != 0.0)
+	  fprintf(file, "      step:  %g from %g\n", d->vars[v].scale, d->vars[v].offset);
 
 	// For a very extended report, print out all values, one per line.
 	if (verbose > 2) {
@@ -1035,6 +4030,28 @@ void ds_print_info(dataset_t *d, FILE* file, int verbose)
 
 /****************************************************************/
 // Data access functions.
+
+// Find or add a string in an intern table.  Returns a pointer to the
+// interned copy, or NULL if there is no table, the string is too long
+// for a slot, or the table is full.
+static char *
+ds_intern_string(struct dsStringTable *t, const char *s)
+{
+  unsigned int i;
+  size_t len;
+
+  if (t == NULL) return NULL;
+  for (i = ds_hash_name(s) & (t->size - 1); t->hash[i] != -1; i = (i + 1) & (t->size - 1)) {
+    char *text = t->text + (size_t) t->hash[i] * t->length;
+    if (!strcmp(text, s)) return text;
+  }
+  len = strlen(s);
+  if (len >= t->length || t->used >= t->slots) return NULL;
+
+  t->hash[i] = t->used++;
+  return (char *) memcpy(t->text + (size_t) t->hash[i] * t->length, s, len + 1);
+}
+
 void 
 ds_set_string(dataset_t *d, int v, int col, const char *s)
 {
@@ -1042,10 +4059,12 @@ ds_set_string(dataset_t *d, int v, int col, const char *s)
       && d->vars[v].type == DS_STRING 
       && col < d->columns) {
 
-    char **ptr = & ((char **)(d->data[v]))[col];
-    
-    SAFE_FREE(*ptr);   // free any existing string
-    *ptr = strdup(s);  // and copy this one
+    char **ptr = (char **) ds_value_address(d, v, col);
+    char *interned = (s != NULL) ? ds_intern_string(d->strings, s) : NULL;
+
+    ds_free_string(d, *ptr);   // free any existing string
+    if (interned != NULL) *ptr = interned;
+    else *ptr = (s != NULL) ? strdup(s) : NULL;  // and copy this one
   }
 }
 const char *
@@ -1055,20 +4074,20 @@ ds_get_string(dataset_t *d, int v, int col)
       && d->vars[v].type == DS_STRING 
       && col < d->columns) {
 
-    return ((char **)(d->data[v])) [col];    
+    return *(char **) ds_value_address(d, v, col);
 
   } else return NULL;
 }
 
 
 // Return array pointer for the specified variable, or NULL if the
-// type doesn't match.  The pointer can be used for reading or writing,
+// type doesn't match or the dataset is in the frame layout.  The pointer can be used for reading or writing,
 // but be sure to mind the columns limit.
 
 int *
 ds_int(dataset_t *d, int v)
 {
-  if (d != NULL && d->vars[v].type == DS_INT) 
+  if (d != NULL && d->vars[v].type == DS_INT && d->frames == NULL) 
     return (int *)(d->data[v]);
   else 
     return NULL;
@@ -1077,7 +4096,7 @@ ds_int(dataset_t *d, int v)
 float  *
 ds_float(dataset_t *d, int v)
 {
-  if (d != NULL && d->vars[v].type == DS_FLOAT) 
+  if (d != NULL && d->vars[v].type == DS_FLOAT && d->frames == NULL) 
     return (float *)(d->data[v]);
   else 
     return NULL;
@@ -1086,24 +4105,134 @@ ds_float(dataset_t *d, int v)
 double *
 ds_double(dataset_t *d, int v)
 {
-  if (d != NULL && d->vars[v].type == DS_DOUBLE) 
+  if (d != NULL && d->vars[v].type == DS_DOUBLE && d->frames == NULL) 
     return (double *)(d->data[v]);
   else 
     return NULL;
 }
 
+/****************************************************************/
+// Variable names are looked up through an open addressing hash table
+// of row indices, built on the first lookup.  The named rows are also
+// kept sorted by name, so that a prefix selects a contiguous range.
+
+struct dsNameIndex {
+  unsigned int size;       // number of hash slots, a power of two
+  int *slots;              // row held in each slot, or -1 if empty
+  unsigned int count;      // number of named rows
+  int *sorted;             // named rows in order of name
+};
+
+static void
+ds_discard_index(dataset_t *d)
+{
+  if (d->index == NULL) return;
+  free(d->index->slots);
+  free(d->index->sorted);
+  free(d->index);
+  d->index = NULL;
+}
+
+// Pair of a name and its row, used while sorting.
+typedef struct {
+  const char *name;
+  int row;
+} ds_named_row_t;
+
+static int
+ds_compare_named_rows(const void *a, const void *b)
+{
+  const ds_named_row_t *x = (const ds_named_row_t *) a, *y = (const ds_named_row_t *) b;
+  int c = strcmp(x->name, y->name);
+  return (c != 0) ? c : x->row - y->row;
+}
+
+static int
+ds_compare_rows(const void *a, const void *b)
+{
+  return *(const int *) a - *(const int *) b;
+}
+
+// Build the lookup table.  Where a name is duplicated the first row
+// is found, as with a linear search.
+static struct dsNameIndex *
+ds_build_index(dataset_t *d)
+{
+  struct dsNameIndex *index = (struct dsNameIndex *) malloc(sizeof(struct dsNameIndex));
+  ds_named_row_t *named = (ds_named_row_t *) malloc((d->variables + 1) * sizeof(ds_named_row_t));
+  unsigned int v, i;
+
+  index->size = 16;
+  while (index->size < 2 * d->variables) index->size *= 2;
+  index->slots = (int *) malloc(index->size * sizeof(int));
+  for (i = 0; i < index->size; i++) index->slots[i] = -1;
+
+  index->count = 0;
+  for (v = 0; v < d->variables; v++) {
+    const char *name = d->vars[v].name;
+    if (name == NULL) continue;
+
+    for (i = ds_hash_name(name) & (index->size - 1); index->slots[i] != -1; i = (i + 1) & (index->size - 1))
+      if (!strcmp(d->vars[index->slots[i]].name, name)) break;
+    if (index->slots[i] == -1) index->slots[i] = v;
+
+    named[index->count].name = name;
+    named[index->count].row = v;
+    index->count++;
+  }
+
+  qsort(named, index->count, sizeof(ds_named_row_t), ds_compare_named_rows);
+  index->sorted = (int *) malloc((index->count + 1) * sizeof(int));
+  for (i = 0; i < index->count; i++) index->sorted[i] = named[i].row;
+  free(named);
+
+  return index;
+}
+
 // Find a variable, returns the index or -1.
 extern int ds_find_variable(dataset_t *d, const char *name)
 {
-  int v;
-  if (d == NULL) return -1;
+  unsigned int i;
+  if (d == NULL || name == NULL) return -1;
+  if (d->index == NULL) d->index = ds_build_index(d);
 
-  for (v = 0; v < d->variables; v++) {
-    if (!strcmp(d->vars[v].name, name)) return v;
+  for (i = ds_hash_name(name) & (d->index->size - 1); d->index->slots[i] != -1; i = (i + 1) & (d->index->size - 1)) {
+    if (!strcmp(d->vars[d->index->slots[i]].name, name)) return d->index->slots[i];
   }
   return -1;
 }
 
+// Find all variables beginning with a prefix.
+extern int ds_find_variables_with_prefix(dataset_t *d, const char *prefix, int **rows)
+{
+  unsigned int low = 0, high, first, length;
+  int found;
+
+  if (rows != NULL) *rows = NULL;
+  if (d == NULL || prefix == NULL) return 0;
+  if (d->index == NULL) d->index = ds_build_index(d);
+
+  // Binary search for the first name not less than the prefix; every
+  // match then follows it.
+  high = d->index->count;
+  while (low < high) {
+    unsigned int mid = low + (high - low) / 2;
+    if (strcmp(d->vars[d->index->sorted[mid]].name, prefix) < 0) low = mid + 1;
+    else high = mid;
+  }
+  first = low;
+  length = strlen(prefix);
+  while (low < d->index->count && !strncmp(d->vars[d->index->sorted[low]].name, prefix, length)) low++;
+  found = low - first;
+
+  if (rows != NULL && found > 0) {
+    *rows = (int *) malloc(found * sizeof(int));
+    memcpy(*rows, d->index->sorted + first, found * sizeof(int));
+    qsort(*rows, found, sizeof(int), ds_compare_rows);
+  }
+  return found;
+}
+
 // Return a row of a dataset as a newly allocated array of doubles, or
 // NULL if the row is not a numeric type.  The caller is responsible
 // for freeing the array.  The array is of length "samples".
@@ -1117,29 +4246,42 @@ double *ds_row_as_double_array( dataset_t *d, int row )
       double *result = (double *) calloc (d->samples, sizeof(double) );
       int samples = d->samples;
       int srcpos  = d->startpos;
+      int columns = d->columns;
       void *data  = d->data[row];
+      void *gathered = NULL;
       int i = 0;
 
+      // In the frame layout the values are first gathered in order,
+      // which also expands decimated and quantized ones.
+      if ( d->frames != NULL ) {
+	gathered = malloc( (size_t) samples * ds_value_size( var->type ) + 1 );
+	ds_gather_frames( d, row, srcpos, samples, gathered );
+	data = gathered;
+	srcpos = 0;
+	columns = samples;
+      }
+
       switch ( var->type ) {
       case DS_DOUBLE:
 	while ( samples-- > 0 ) {
 	  result[i++] = ((double *) data) [ srcpos++ ];
-	  if ( srcpos >= d->columns ) srcpos = 0;
+	  if ( srcpos >= columns ) srcpos = 0;
 	}
 	break;
       case DS_FLOAT:
 	while ( samples-- > 0 ) {
 	  result[i++] = (double) (((float *) data) [ srcpos++ ]);
-	  if ( srcpos >= d->columns ) srcpos = 0;
+	  if ( srcpos >= columns ) srcpos = 0;
 	}
 	break;
       case DS_INT:
 	while ( samples-- > 0 ) {
 	  result[i++] = (double) (((int *) data) [ srcpos++ ]);
-	  if ( srcpos >= d->columns ) srcpos = 0;
+	  if ( srcpos >= columns ) srcpos = 0;
 	}
 	break;
       }
+      free( gathered );
       return result;
     }
   }
@@ -1157,6 +4299,28 @@ void ds_set_row_from_double_array( dataset_t *d, int row, double *array )
       void *data  = d->data[row];
       int i = 0;
 
+      // In the frame layout each value is stored where it is held, as
+      // a count if the variable is quantized.  A decimated variable
+      // keeps the first value of each group, or of the window.
+      if ( d->frames != NULL ) {
+	for ( ; samples-- > 0; i++ ) {
+	  if ( i == 0 || dstpos % ds_divisor( d, row ) == 0 ) {
+	    union { int i; float f; double x; } value;
+	    void *dst = ds_value_address( d, row, dstpos );
+
+	    switch ( var->type ) {
+	    case DS_DOUBLE: value.x = array[i]; break;
+	    case DS_FLOAT:  value.f = (float) array[i]; break;
+	    default:        value.i = (int) array[i]; break;
+	    }
+	    if ( ds_quantized( d, row ) ) ds_quantize_value( d, row, &value, dst );
+	    else memcpy( dst, &value, ds_value_size( var->type ) );
+	  }
+	  if ( ++dstpos >= d->columns ) dstpos = 0;
+	}
+	return;
+      }
+
       switch ( var->type ) {
       case DS_DOUBLE:
 	while ( samples-- > 0 ) {
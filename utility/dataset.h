@@ -62,6 +62,9 @@ struct dsVariable {
   double lower;         // the "normal" lower bound for a numerical variable
 
   unsigned archivable : 1;  // true if this variable should be included in files
+  unsigned int decimation;   // recorded every this many samples, see ds_set_decimation
+  double scale;         // step of the 16 bit values kept in the frame layout, or 0, see ds_set_quantization
+  double offset;        // the value represented by 0 in them
 
   // It might also be useful to have an active flag to control
   // whether the variable is available at all, although that
@@ -81,16 +84,28 @@ struct dsVariable {
 // the index of the sample (in file coordinates) that corresponds
 // with the "startpos" column in memory.
 
+struct dsNameIndex;             // lookup table of variable names, private to dataset.cpp
+struct dsStringTable;           // interned string values, private to dataset.cpp
+struct dsFrameStore;            // frame-major value storage, private to dataset.cpp
+
 typedef struct {
   unsigned int variables;      // number of variables (number of rows)
   unsigned int columns;        // number of columns of each variable in memory
   unsigned int startpos;       // the index of the "first" sample in the data in memory 
   unsigned int samples;        // number of valid samples in memory
+  volatile unsigned int sequence; // count of ring index updates, odd during one (see record.h)
   unsigned int filepos;        // the sample index within a file that startpos represents
   char *comment;               // description string for the whole set or file
   struct dsVariable *vars;     // array of variable descriptions
   void **data;                 // array of pointers to data buffers
   time_t timestamp;            // UNIX timestamp when object was created or file written
+  void *mapping;               // file mapping holding some data buffers, or NULL (see ds_map_file)
+  size_t mapping_length;       // size of the mapping in bytes
+  unsigned int flags;          // file encoding options, see ds_set_file_flags
+  struct dsNameIndex *index;   // name lookup table built by ds_find_variable, or NULL
+  struct dsStringTable *strings; // interned string values (see ds_intern_strings), or NULL
+  void *snapshot_plan;         // copy plan for ring_buffer_snapshot (see record.cpp), or NULL
+  struct dsFrameStore *frames; // values in the frame layout (see ds_set_frame_layout), or NULL
 } dataset_t;
 
 /****************************************************************/
@@ -117,6 +132,106 @@ extern void ds_set_columns(dataset_t *d, int cols);
 // Set the timestamp to the current time.
 extern void ds_set_timestamp(dataset_t *d);
 
+// Select options for the encoding of files written by
+// ds_write_dataset.  The readers recognize every encoding, so this
+// only affects the size of the output.  Datasets read from a file
+// start out with the options of that file.
+#define DS_FILE_COMPRESSED 0x0001   // store frames in losslessly compressed blocks
+#define DS_FILE_CHECKSUMMED 0x0002  // end each frame or block with a CRC-32, see ds_recover_file
+
+extern void ds_set_file_flags(dataset_t *d, unsigned int flags);
+
+// Preallocate a table of "slots" distinct string values of up to
+// "length" bytes each, including the terminator.  ds_set_string then
+// stores a pointer to the interned copy of each string instead of
+// allocating one, so that string rows can be recorded without any
+// heap traffic, e.g. from a realtime thread.  Values are never
+// removed from the table; strings which are too long, or arrive
+// after the table is full, are copied onto the heap as usual.  The
+// file format is unaffected.  Does nothing if a table exists.
+extern void ds_intern_strings(dataset_t *d, unsigned int slots, unsigned int length);
+
+// Switch the storage of the values between the usual layout, with a
+// buffer for each variable, and a frame-major layout, in which the
+// values of each column are kept together in one record of a single
+// buffer.  Recording a whole column, as a ring buffer snapshot does,
+// then writes one short run of memory instead of touching a cache
+// line in every variable buffer.  The values are kept either way.
+//
+// In the frame layout the variable buffers are released, so ds_int,
+// ds_float and ds_double return NULL.  The string and print
+// functions and the writers work in both layouts; adding, deleting,
+// or reinitializing variables and ds_resize_columns switch back to
+// the usual layout first.  Returns 0 on success.
+extern int ds_set_frame_layout(dataset_t *d, int frames);
+
+// For a dataset in the frame layout, return the frame buffer, i.e.
+// column 0, and the number of bytes per frame in *frame_size.
+// Returns NULL for the usual layout.
+extern unsigned char *ds_frame_buffer(dataset_t *d, unsigned int *frame_size);
+
+// Return the byte offset of a variable's value within each frame, or
+// -1 if the dataset is not in the frame layout or the variable is
+// decimated.  The value is two bytes if the variable is quantized.
+extern int ds_frame_offset(dataset_t *d, int row);
+
+// Move the frames of a dataset in the frame layout into a new named
+// POSIX shared memory segment (see shm_open(3)), such as "/ring",
+// with a header describing the variables, so that other processes
+// can read the values where they are written, with ds_attach_shared.
+// String variables are not shared.  A segment of the same name left
+// by an earlier run is unlinked first, so processes still attached to
+// it keep their copy intact.  The segment is removed when the dataset
+// is deleted or leaves the frame layout.  Returns 0 on success.
+extern int ds_share_frames(dataset_t *d, const char *name);
+
+// Copy the ring indices and sequence count of a shared dataset into
+// its segment; ring_buffer_snapshot and clear_ring_buffer call this
+// after each change of the count.  Does nothing for other datasets.
+extern void ds_publish_ring(dataset_t *d);
+
+// Map a segment created by ds_share_frames read-only, as a dataset
+// in the frame layout whose values are those being written by the
+// other process.  The startpos and samples fields are only copied
+// from the segment as it is attached; use ds_ring_state or
+// ring_buffer_read_recent to follow the writer.  Deleting the
+// dataset unmaps the segment, and switching it to the usual layout
+// makes a private copy.  Returns a pointer on success, else NULL.
+extern dataset_t *ds_attach_shared(const char *name);
+
+// Read the ring indices of a dataset as of one moment, waiting out
+// any change in progress, and the sequence count they belong to.
+// For a dataset from ds_attach_shared they are read from the
+// segment.  Any pointer may be NULL.  Returns 0 on success, or
+// nonzero if the writer seems to have stopped in the middle of a
+// change, such as a process which died while recording.
+extern int ds_ring_state(dataset_t *d, unsigned int *sequence, unsigned int *startpos, unsigned int *samples);
+
+// Set a variable to be recorded only every "divisor" samples; 1 is
+// the full rate.  The value recorded at a multiple of the divisor
+// holds for the following columns, and files store it repeated, so
+// readers see an ordinary variable with the decimation in its
+// descriptor.  In the frame layout a decimated variable is kept out
+// of the frames, in d->data[row], with one value for each group of
+// columns, so a low rate variable costs proportionally less memory
+// and copying.  In the usual layout the divisor is only recorded.
+extern void ds_set_decimation(dataset_t *d, int row, unsigned int divisor);
+
+// Keep a numeric variable in the frame layout as a signed 16 bit
+// count of "scale" from "offset", e.g. an encoder angle as its counts,
+// rather than a full int, float or double; a scale of 0 turns this
+// off.  Values are rounded to the nearest step and saturate at
+// +/-32767 steps; a NaN is kept as -32768.  The values are expanded
+// back to the type of the variable whenever they leave the frames,
+// so readers, files and copies see an ordinary variable; only the
+// memory and the resolution differ.  In the usual layout the scale
+// is only recorded.
+extern void ds_set_quantization(dataset_t *d, int row, double scale, double offset);
+
+// Return the 16 bit count which represents a value of a quantized
+// variable, as ring_buffer_snapshot stores it.
+extern short ds_quantize(dataset_t *d, int row, double value);
+
 // Initialize each individual variable entry, which was already allocated by new_dataset.
 extern void 
 ds_init_variable(dataset_t *d, int row, 
@@ -161,6 +276,150 @@ extern int ds_write_dataset(dataset_t *d, FILE* file);
 
 extern dataset_t *new_dataset_from_stream(FILE* file, unsigned maxcolumns);
 
+// Read a stream a window of frames at a time, for files too long to
+// hold in memory or still being written.  The callback is first
+// called once the header is read, with no samples, so that it can
+// look up the variables; then with each window of up to "block"
+// samples (or DS_CODEC_BLOCK_FRAMES if block is zero) in columns 0
+// onward, with filepos set to the index of the first within its
+// file.  The window is reused for the next samples after the
+// callback returns.  The stream is read to its end regardless of the
+// length in the header, and files joined end to end are read as one
+// if they have the same variables, though no window spans two of
+// them.  Version 2 files can only be read
+// whole, and are handed over in one call.  Reading stops if the
+// callback returns nonzero, which is then returned.  Returns 0 on
+// success, else an error code; the samples read before an error
+// have been handed over.
+typedef int (*ds_frames_callback_t)(dataset_t *d, void *arg);
+
+extern int ds_read_stream(FILE *file, unsigned int block, ds_frames_callback_t callback, void *arg);
+
+// Write an in-memory matrix to the given stream in the version 2
+// (columnar) file format.  Each variable is stored as a contiguous
+// block, followed by a footer index of block offsets, so that
+// individual variables can be loaded without reading the rest of
+// the file.  The stream need not be seekable.  Returns 0 on
+// success, else an error code.
+extern int ds_write_dataset_v2(dataset_t *d, FILE* file);
+
+// Creates a new dataset object from a named file, keeping only the
+// "count" variables listed in "names", or all variables if names is
+// NULL.  Names not present in the file are ignored.  For version 2
+// files only the selected blocks are read, with one pread each;
+// version 1 files are read in full and then trimmed.  A version 1
+// file of unspecified length, such as one whose writer never closed
+// it, yields all of its complete samples.  Returns a pointer on
+// success, else NULL.
+extern dataset_t *new_dataset_from_file(const char *filename, const char **names, int count);
+
+// Creates a new dataset object by mapping a named file into
+// memory.  For version 2 files on little-endian hosts the numeric
+// rows point directly into the mapping, so opening a file costs
+// little more than reading its header and the pages are shared
+// with the page cache.  Strings, and the interleaved frames of
+// version 1 files, are decoded from the mapping into ordinary
+// buffers.  The mapping is private: the data may be modified in
+// memory without changing the file.  delete_dataset releases the
+// mapping.  Returns a pointer on success, else NULL.
+extern dataset_t *ds_map_file(const char *filename);
+
+// An open dataset file, for reading windows of samples out of files
+// too long to load at once.  The header is read and the file indexed
+// when it is opened, so that each window can be fetched with a few
+// reads at its position in the file:
+//
+//   - frames of fixed size (no strings) are located by arithmetic;
+//   - other frames, and compressed blocks, through a sparse index of
+//     sample numbers and file offsets;
+//   - version 2 variable blocks through the footer index.
+typedef struct {
+  int fd;                          // file descriptor
+  unsigned int version;            // file format version
+  dataset_t *header;               // variable descriptions, without data buffers
+  unsigned int samples;            // number of complete samples in the file
+  unsigned long long header_size;  // offset of the first frame or block
+  unsigned long long file_size;
+  unsigned frame_size;             // bytes per frame, or 0 if the size varies
+  unsigned int entries;            // length of the sparse index
+  unsigned int *entry_sample;      // first sample of each indexed frame or block
+  unsigned long long *entry_offset; // file offset of each indexed frame or block
+  unsigned long long *block_offset; // version 2 only: offset and length of
+  unsigned long long *block_length; // each variable block
+  unsigned long long data_end;     // offset just past the last complete sample
+} ds_file_t;
+
+// Open a dataset file for windowed reads.  Returns a pointer on
+// success, else NULL.
+extern ds_file_t *ds_open_file(const char *filename);
+
+// Close a file opened by ds_open_file and free the index.
+extern void ds_close_file(ds_file_t *f);
+
+// Creates a new dataset object holding "n_samples" samples of a file
+// starting at sample "first_sample", keeping only the "count"
+// variables listed in "names", or all variables if names is NULL.
+// The window is truncated at the end of the file.  The filepos field
+// of the result is set to first_sample.  Returns a pointer on
+// success, else NULL.
+extern dataset_t *ds_read_window(ds_file_t *f, unsigned first_sample, unsigned n_samples,
+				 const char **names, int count);
+
+// Creates a new dataset object holding only the variable descriptions
+// of a named file, without data buffers, with columns and samples set
+// to the number of complete samples in the file.  Only the header is
+// parsed: for frames of fixed size (no strings) the samples are
+// counted from the file size, and otherwise by skipping from frame
+// to frame or block to block.  Returns a pointer on success, else
+// NULL.
+extern dataset_t *ds_read_info(const char *filename);
+
+// Creates a new dataset object from a named file like
+// new_dataset_from_file, but decodes it with several threads, each
+// reading its own range of frames (or, for version 2 files, its own
+// variables).  If threads is zero or less, one thread is used per
+// processor.  Files with strings must first be indexed with a
+// sequential pass, so they gain less.  Programs using this need to
+// link with -lpthread.  Returns a pointer on success, else NULL.
+extern dataset_t *new_dataset_from_file_parallel(const char *filename, int threads);
+
+// A version 1 file open for appending frames.
+typedef struct {
+  FILE *file;
+  unsigned int samples;            // number of samples in the file
+  unsigned int flags;              // encoding of the frames, see ds_set_file_flags
+} ds_append_t;
+
+// Open a version 1 file to append frames of the archivable variables
+// of a dataset, creating it with the header of the dataset if it is
+// empty or does not exist.  The variables of an existing file must
+// match the dataset, and its encoding is kept.  Returns a pointer on
+// success, else NULL.
+extern ds_append_t *ds_open_append(const char *filename, dataset_t *d);
+
+// Append "n" columns of a dataset starting at column "first_col" to a
+// file, wrapping around the end of the matrix as for a ring buffer.
+// The sample indices continue from the end of the file.  Returns 0 on
+// success, else an error code.
+extern int ds_append_frames(dataset_t *d, ds_append_t *file, unsigned int first_col, unsigned int n);
+
+// Record the number of samples in the header and close the file.
+// Until then the header holds DS_UNSPECIFIED_LENGTH; ds_open_file
+// and ds_map_file can still read the file, and ds_open_append
+// recovers its complete samples.  Returns 0 on success, else an
+// error code.
+extern int ds_close_append(ds_append_t *file);
+
+// Creates a new dataset object from whatever can be salvaged of a
+// damaged version 1 file, such as one cut short by a crash or holding
+// a torn write.  After each invalid frame or block, reading resumes
+// at the next frame sentinel.  Frames written with
+// DS_FILE_CHECKSUMMED are only accepted if their checksum matches;
+// other frames can only be checked for consistency.  The number of
+// bytes skipped is returned in *discarded if it is not NULL.  The
+// header must be intact.  Returns a pointer on success, else NULL.
+extern dataset_t *ds_recover_file(const char *filename, unsigned long long *discarded);
+
 // Return points to strings to describe the codes that define a variable.
 extern const char * ds_get_type_string(enum dsType t);
 extern const char * ds_get_units_string(enum dsUnits t);
@@ -183,22 +442,52 @@ extern void ds_set_string(dataset_t *d, int row, int col, const char *s);
 // be NULL) .  Returns NULL if variable is not a string type.
 extern const char *ds_get_string(dataset_t *d, int row, int col);
 
+// Copy n values of every variable of src, from column "col" onward
+// and wrapping around the end, into columns 0 to n-1 of dst, which
+// must have the same variables in the usual layout.  Only the string
+// values interned in src are copied, the others are left NULL, so
+// that src can be a ring buffer a concurrent writer is changing; see
+// ring_buffer_read_recent.
+extern void ds_copy_columns(dataset_t *dst, dataset_t *src, unsigned int col, unsigned int n);
+
 // Print out diagnostics about a dataset to a stream.
 extern void ds_print_info(dataset_t *d, FILE* file, int verbose);
 
-// Print out ASCII representation of a datum.
+// Print out ASCII representation of a datum.  Numbers are printed
+// as the shortest text which reads back as the same value.
 extern void ds_print_value(dataset_t *d, FILE *file, int row, int col);
 
+// Print out a table of values as ASCII text, much faster than value
+// by value: one line for each "step"th of the "n" columns from "col",
+// holding the values of the "count" variables listed in "rows"
+// separated by spaces.  Returns 0 on success, else nonzero.
+extern int ds_print_columns(dataset_t *d, FILE *file, const int *rows, int count, 
+			    unsigned int col, unsigned int n, unsigned int step);
+
 // Find the index of a variable given the name.  Returns -1 if
-// an exact match is not found.
+// an exact match is not found.  The first call builds a hash table
+// of the names, so that later calls take constant time; it is
+// discarded whenever variables are added, deleted, or renamed.
+// Since the table is built on demand, concurrent calls on a dataset
+// without a table are not safe.
 extern int ds_find_variable(dataset_t *d, const char *name); 
 
+// Find every variable whose name begins with "prefix", for example
+// "joints.l.", using the table of ds_find_variable.  Returns the
+// number of matches.  If rows is not NULL, *rows is set to a newly
+// allocated array of their indices in ascending order, or NULL if
+// there are none.  The caller is responsible for freeing the array.
+extern int ds_find_variables_with_prefix(dataset_t *d, const char *prefix, int **rows);
+
 // Return a row of a dataset as a newly allocated array of doubles, or
 // NULL if the row is not a numeric type.  The caller is responsible
-// for freeing the array.  The array is of length "samples".
+// for freeing the array.  The array is of length "samples".  Either
+// layout can be read; see ds_set_frame_layout.
 extern double *ds_row_as_double_array( dataset_t *d, int row );
 
-// Set an entire row at once.
+// Set an entire row at once.  In the frame layout a quantized value
+// is stored as its count, and a decimated variable keeps the first
+// value of each group.
 extern void ds_set_row_from_double_array( dataset_t *d, int row, double *array );
 
 
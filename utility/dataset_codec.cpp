@@ -0,0 +1,414 @@
+// dataset_codec.c : compressed encoding of blocks of dataset frames.
+//
+// Copyright (C) 1995-2001 Garth Zeglin.  Provided under the terms of the
+// GNU General Public License as included in the top level directory.
+//
+// See dataset_codec.h for a description of the coding.  Bits are
+// packed most significant first, and the block is padded with zero
+// bits to a whole number of bytes, so the layout does not depend on
+// the byte order of the host.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dataset_codec.h"
+
+/****************************************************************/
+// Bit stream output into a growable memory buffer.
+
+typedef struct {
+  unsigned char *buffer;
+  unsigned long long capacity;
+  unsigned long long bytes;    // number of complete bytes in buffer
+  unsigned long long acc;      // pending bits, right aligned
+  int count;                   // number of pending bits, always < 8 between calls
+} bit_writer_t;
+
+// Make room for at least n more bytes.
+static void
+reserve_bytes(bit_writer_t *w, unsigned long long n)
+{
+  if (w->bytes + n + 1 > w->capacity) {
+    w->capacity = 2 * w->capacity;
+    if (w->capacity < w->bytes + n + 1) w->capacity = w->bytes + n + 1;
+    w->buffer = (unsigned char *) realloc(w->buffer, w->capacity);
+  }
+}
+
+// Append the low n bits of value, for 1 <= n <= 32.
+inline static void
+put_bits(bit_writer_t *w, unsigned int value, int n)
+{
+  if (n < 32) value &= (1U << n) - 1;
+  w->acc = (w->acc << n) | value;
+  w->count += n;
+  while (w->count >= 8) {
+    w->count -= 8;
+    w->buffer[w->bytes++] = (unsigned char) (w->acc >> w->count);
+  }
+}
+
+// Append the low n bits of value, for 1 <= n <= 64.
+inline static void
+put_bits64(bit_writer_t *w, unsigned long long value, int n)
+{
+  if (n > 32) {
+    put_bits(w, (unsigned int) (value >> 32), n - 32);
+    n = 32;
+  }
+  put_bits(w, (unsigned int) value, n);
+}
+
+// Pad out the final partial byte with zeros.
+static void
+flush_bits(bit_writer_t *w)
+{
+  if (w->count > 0) put_bits(w, 0, 8 - w->count);
+}
+
+/****************************************************************/
+// Bit stream input from a memory buffer.  Reading past the end
+// returns zeros and sets the error flag.
+
+typedef struct {
+  const unsigned char *p;
+  unsigned long long length;
+  unsigned long long pos;      // number of bytes consumed
+  unsigned long long acc;
+  int count;
+  int error;
+} bit_reader_t;
+
+// Fetch n bits, for 1 <= n <= 32.
+inline static unsigned int
+get_bits(bit_reader_t *r, int n)
+{
+  while (r->count < n) {
+    if (r->pos >= r->length) {
+      r->error = 1;
+      return 0;
+    }
+    r->acc = (r->acc << 8) | r->p[r->pos++];
+    r->count += 8;
+  }
+  r->count -= n;
+  if (n < 32) return (unsigned int) (r->acc >> r->count) & ((1U << n) - 1);
+  else return (unsigned int) (r->acc >> r->count);
+}
+
+// Fetch n bits, for 1 <= n <= 64.
+inline static unsigned long long
+get_bits64(bit_reader_t *r, int n)
+{
+  unsigned long long value = 0;
+  if (n > 32) {
+    value = (unsigned long long) get_bits(r, n - 32) << 32;
+    n = 32;
+  }
+  return value | get_bits(r, n);
+}
+
+/****************************************************************/
+// Integers: delta-of-delta with a variable length prefix code on
+// the zigzag mapped value.
+//
+//   0                 unchanged delta
+//   10   + 7 bits     |delta of delta| < 64
+//   110  + 9 bits     |delta of delta| < 256
+//   1110 + 12 bits    |delta of delta| < 2048
+//   1111 + 32 bits    anything else
+//
+// Arithmetic is unsigned, so wrap around is handled exactly.
+
+static void
+encode_ints(bit_writer_t *w, const int *data, unsigned columns, unsigned col, unsigned frames)
+{
+  unsigned int prev = 0, delta = 0;
+  unsigned i;
+
+  reserve_bytes(w, 5ULL * frames);
+
+  for (i = 0; i < frames; i++) {
+    unsigned int value = (unsigned int) data[col];
+
+    if (i == 0) put_bits(w, value, 32);
+    else {
+      unsigned int dod = (value - prev) - delta;
+      unsigned int zz = (dod << 1) ^ (unsigned int) ((int) dod >> 31);
+      delta = value - prev;
+
+      if      (zz == 0)        put_bits(w, 0, 1);
+      else if (zz < (1 << 7))  put_bits(w, (0x2 << 7) | zz, 9);
+      else if (zz < (1 << 9))  put_bits(w, (0x6 << 9) | zz, 12);
+      else if (zz < (1 << 12)) put_bits(w, (0xe << 12) | zz, 16);
+      else {
+	put_bits(w, 0xf, 4);
+	put_bits(w, zz, 32);
+      }
+    }
+    prev = value;
+    if (++col >= columns) col = 0;
+  }
+}
+
+static void
+decode_ints(bit_reader_t *r, int *data, unsigned frames, unsigned skip, unsigned store)
+{
+  unsigned int value = 0, delta = 0;
+  unsigned i;
+
+  for (i = 0; i < frames && !r->error; i++) {
+    if (i == 0) value = get_bits(r, 32);
+    else {
+      unsigned int zz;
+      if      (get_bits(r, 1) == 0) zz = 0;
+      else if (get_bits(r, 1) == 0) zz = get_bits(r, 7);
+      else if (get_bits(r, 1) == 0) zz = get_bits(r, 9);
+      else if (get_bits(r, 1) == 0) zz = get_bits(r, 12);
+      else                          zz = get_bits(r, 32);
+
+      delta += (zz >> 1) ^ (0U - (zz & 1));
+      value += delta;
+    }
+    if (i >= skip && i - skip < store) data[i - skip] = (int) value;
+  }
+}
+
+/****************************************************************/
+// Floating point: XOR with the previous value.  The bit patterns of
+// "width" bits (32 or 64) are handled as integers.
+//
+//   0                                        same value
+//   10 + meaningful bits                     fits within the previous window
+//   11 + 5 bits leading zeros + length-1 + meaningful bits
+//
+// The length field is 5 bits for floats and 6 bits for doubles.
+
+inline static unsigned long long
+load_value(const char *p, unsigned width)
+{
+  if (width == 32) {
+    unsigned int v;
+    memcpy(&v, p, 4);
+    return v;
+  } else {
+    unsigned long long v;
+    memcpy(&v, p, 8);
+    return v;
+  }
+}
+
+inline static void
+store_value(char *p, unsigned long long v, unsigned width)
+{
+  if (width == 32) {
+    unsigned int u = (unsigned int) v;
+    memcpy(p, &u, 4);
+  } else memcpy(p, &v, 8);
+}
+
+static void
+encode_xor(bit_writer_t *w, const char *data, unsigned width, unsigned columns, unsigned col, unsigned frames)
+{
+  unsigned long long prev = 0;
+  int length_bits = (width == 32) ? 5 : 6;
+  int prev_lead = width, prev_trail = 0;    // no window yet
+  unsigned i;
+
+  reserve_bytes(w, (width == 32 ? 6ULL : 10ULL) * frames);
+
+  for (i = 0; i < frames; i++) {
+    unsigned long long value = load_value(data + (size_t) col * (width / 8), width);
+    unsigned long long x = value ^ prev;
+
+    if (i == 0) put_bits64(w, value, width);
+    else if (x == 0) put_bits(w, 0, 1);
+    else {
+      int lead = __builtin_clzll(x) - (64 - width);
+      int trail = __builtin_ctzll(x);
+      if (lead > 31) lead = 31;
+
+      if (lead >= prev_lead && trail >= prev_trail) {
+	put_bits(w, 0x2, 2);
+	put_bits64(w, x >> prev_trail, width - prev_lead - prev_trail);
+      } else {
+	int length = width - lead - trail;
+	put_bits(w, 0x3, 2);
+	put_bits(w, lead, 5);
+	put_bits(w, length - 1, length_bits);
+	put_bits64(w, x >> trail, length);
+	prev_lead = lead;
+	prev_trail = trail;
+      }
+    }
+    prev = value;
+    if (++col >= columns) col = 0;
+  }
+}
+
+static void
+decode_xor(bit_reader_t *r, char *data, unsigned width, unsigned frames, unsigned skip, unsigned store)
+{
+  unsigned long long value = 0;
+  int length_bits = (width == 32) ? 5 : 6;
+  int lead = width, trail = 0;
+  unsigned i;
+
+  for (i = 0; i < frames && !r->error; i++) {
+    if (i == 0) value = get_bits64(r, width);
+    else if (get_bits(r, 1) != 0) {
+      if (get_bits(r, 1) != 0) {
+	lead  = get_bits(r, 5);
+	trail = width - lead - (get_bits(r, length_bits) + 1);
+	if (trail < 0) {
+	  r->error = 1;
+	  break;
+	}
+      } else if (lead >= (int) width) {   // a window must be defined first
+	r->error = 1;
+	break;
+      }
+      value ^= get_bits64(r, width - lead - trail) << trail;
+    }
+    if (i >= skip && i - skip < store) store_value(data + (size_t) (i - skip) * (width / 8), value, width);
+  }
+}
+
+/****************************************************************/
+// Strings: a single 0 bit for a repeated value, else a 1 bit, the
+// 16 bit length code (0xffff for NULL) and the bytes.
+
+static int
+same_string(const char *a, const char *b)
+{
+  if (a == NULL || b == NULL) return a == b;
+  return !strcmp(a, b);
+}
+
+static void
+encode_strings(bit_writer_t *w, char **data, unsigned columns, unsigned col, unsigned frames)
+{
+  const char *prev = NULL;
+  unsigned i, j;
+
+  for (i = 0; i < frames; i++) {
+    const char *s = data[col];
+
+    reserve_bytes(w, 3);
+    if (i > 0 && same_string(s, prev)) put_bits(w, 0, 1);
+    else if (s == NULL) put_bits(w, 0x1ffff, 17);
+    else {
+      unsigned len = strlen(s);
+      if (len > 0xfffe) len = 0xfffe;
+      reserve_bytes(w, 3 + len);
+      put_bits(w, 0x10000 | len, 17);
+      for (j = 0; j < len; j++) put_bits(w, (unsigned char) s[j], 8);
+    }
+    prev = s;
+    if (++col >= columns) col = 0;
+  }
+}
+
+static void
+decode_strings(bit_reader_t *r, char **data, unsigned frames, unsigned skip, unsigned store)
+{
+  char *value = NULL;
+  unsigned i, j;
+
+  for (i = 0; i < frames && !r->error; i++) {
+    if (get_bits(r, 1) != 0) {
+      unsigned len = get_bits(r, 16);
+      if (value != NULL) free(value);
+      value = NULL;
+      if (len != 0xffff) {
+	value = (char *) malloc(len + 1);
+	for (j = 0; j < len; j++) value[j] = (char) get_bits(r, 8);
+	value[len] = 0;
+      }
+    }
+    if (i >= skip && i - skip < store) {
+      char **ptr = &data[i - skip];
+      if (*ptr != NULL) free(*ptr);   // free any existing string
+      *ptr = (value == NULL) ? NULL : strdup(value);
+    }
+  }
+  if (value != NULL) free(value);
+}
+
+/****************************************************************/
+unsigned long long
+ds_codec_encode_block(dataset_t *d, unsigned col, unsigned frames,
+		      unsigned char **buffer, unsigned long long *capacity)
+{
+  bit_writer_t w;
+  int v;
+
+  w.buffer = *buffer;
+  w.capacity = (*buffer == NULL) ? 0 : *capacity;
+  w.bytes = 0;
+  w.acc = 0;
+  w.count = 0;
+  reserve_bytes(&w, 1024);
+
+  for (v = 0; v < d->variables; v++) {
+    if ( !d->vars[v].archivable ) continue;
+
+    switch (d->vars[v].type) {
+    case DS_INT:
+      encode_ints(&w, (int *) d->data[v], d->columns, col, frames);
+      break;
+    case DS_FLOAT:
+      encode_xor(&w, (char *) d->data[v], 32, d->columns, col, frames);
+      break;
+    case DS_DOUBLE:
+      encode_xor(&w, (char *) d->data[v], 64, d->columns, col, frames);
+      break;
+    case DS_STRING:
+      encode_strings(&w, (char **) d->data[v], d->columns, col, frames);
+      break;
+    default:               // un-initialized variables are not written
+      break;
+    }
+  }
+  flush_bits(&w);
+
+  *buffer = w.buffer;
+  *capacity = w.capacity;
+  return w.bytes;
+}
+
+int
+ds_codec_decode_block(dataset_t *d, const unsigned char *p, unsigned long long length,
+		      unsigned col, unsigned frames, unsigned skip, unsigned store)
+{
+  bit_reader_t r;
+  int v;
+
+  r.p = p;
+  r.length = length;
+  r.pos = 0;
+  r.acc = 0;
+  r.count = 0;
+  r.error = 0;
+
+  for (v = 0; v < d->variables && !r.error; v++) {
+    switch (d->vars[v].type) {
+    case DS_INT:
+      decode_ints(&r, (int *) d->data[v] + col, frames, skip, store);
+      break;
+    case DS_FLOAT:
+      decode_xor(&r, (char *) d->data[v] + 4 * (size_t) col, 32, frames, skip, store);
+      break;
+    case DS_DOUBLE:
+      decode_xor(&r, (char *) d->data[v] + 8 * (size_t) col, 64, frames, skip, store);
+      break;
+    case DS_STRING:
+      decode_strings(&r, (char **) d->data[v] + col, frames, skip, store);
+      break;
+    default:
+      break;
+    }
+  }
+  // Everything but the final padding bits must have been used.
+  return r.error || r.pos != length;
+}
@@ -0,0 +1,48 @@
+// dataset_codec.h : compressed encoding of blocks of dataset frames.
+//
+// Copyright (C) 1995-2001 Garth Zeglin.  Provided under the terms of the
+// GNU General Public License as included in the top level directory.
+//
+// This is used by dataset.cpp to write and read files with the
+// DS_FILE_COMPRESSED flag set.  A block holds a run of consecutive
+// frames, stored variable by variable as a bit stream:
+//
+//   DS_INT      the first value verbatim, then the difference between
+//               successive deltas, zigzag coded with a variable
+//               length prefix; a constant rate costs one bit.
+//   DS_FLOAT,   the first value verbatim, then the XOR with the
+//   DS_DOUBLE   previous value, storing only the meaningful bits
+//               (as in Facebook's Gorilla time series database); a
+//               repeated value costs one bit.
+//   DS_STRING   one bit for a repeat of the previous value, else
+//               the string in the usual length and bytes form.
+//
+// Each block is coded independently, so a damaged block does not
+// affect its neighbours.  The coding is lossless.
+
+#ifndef DATASET_CODEC_H_INCLUDED
+#define DATASET_CODEC_H_INCLUDED
+
+#include "dataset.h"
+
+// Default number of frames in each compressed block.
+#define DS_CODEC_BLOCK_FRAMES 1024
+
+// Encode "frames" columns of the archivable variables of a dataset,
+// starting at column "col" and wrapping at the end of the matrix,
+// into *buffer, which is grown as needed.  Returns the number of
+// bytes of the encoded block.
+extern unsigned long long
+ds_codec_encode_block(dataset_t *d, unsigned col, unsigned frames,
+		      unsigned char **buffer, unsigned long long *capacity);
+
+// Decode a block of "length" bytes holding "frames" columns of every
+// variable of a dataset into the columns starting at "col".  The
+// first "skip" frames are discarded and at most "store" frames are
+// kept, so a block can be trimmed to fit a window of the matrix.
+// Returns 0 on success, else an error code.
+extern int
+ds_codec_decode_block(dataset_t *d, const unsigned char *p, unsigned long long length,
+		      unsigned col, unsigned frames, unsigned skip, unsigned store);
+
+#endif /**************** DATASET_CODEC_H_INCLUDED ****************/
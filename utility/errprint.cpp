@@ -19,7 +19,7 @@
 
 /****************************************************************/
 // Common entry point for error messages. Adds a timestamp.
-void errprintf(char *format, ...)
+void errprintf(const char *format, ...)
 {
   va_list args;
   char nowstr[26];
@@ -39,7 +39,7 @@ void errprintf(char *format, ...)
 // Common entry point for normal logging messages, to allow
 // future redirection to a log file.
 
-void logprintf(char *format, ...)
+void logprintf(const char *format, ...)
 {
   va_list args;
 
@@ -8,11 +8,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "record.h"
 #include "dataset.h"
+#include "dataset_codec.h"
 #include "utility.h"
 #include "system_state_var.h"
 
+// The number of distinct string values a ring buffer can record
+// without allocating memory.
+#define RING_BUFFER_STRINGS 1024
+
+// The longest line of a variable selection file.
+#define RULE_LENGTH 200
+
+static void compile_snapshot_plan(system_state_var_t *sys_vars, dataset_t *d, int NumVars);
+static void quantize_rows(dataset_t *d, const char *pattern, double scale, double offset);
+
+static unsigned
+least_common_multiple(unsigned a, unsigned b)
+{
+  unsigned x = a, y = b;
+  while ( y != 0 ) { unsigned t = x % y; x = y; y = t; }
+  return a / x * b;
+}
+
 
 // Create a ring buffer for storing data from the system state
 // variable description and the specified number of samples.
@@ -21,32 +44,209 @@
 
 dataset_t *
 create_ring_buffer(system_state_var_t *sys_vars, unsigned length, int NumVars)
+{
+  return create_masked_ring_buffer(sys_vars, length, NumVars, NULL);
+}
+
+dataset_t *
+create_masked_ring_buffer(system_state_var_t *sys_vars, unsigned length, int NumVars, const unsigned char *record)
 {
   dataset_t *d;   // The dataset object used for the buffer.
-  int v;
+  int v, rows = 0, row;
+  unsigned period = 1;
+
+  for ( v = 0 ; v < NumVars ; v++ ) if ( record == NULL || record[v] ) rows++;
+
+  // Round the length up to a whole number of periods of the
+  // decimated variables, so that each group of columns sharing a
+  // value lies within the ring and starts at a sample number which
+  // is a multiple of the divisor.
+  for ( v = 0 ; record != NULL && v < NumVars && period <= length ; v++ ) 
+    if ( record[v] > 1 ) period = least_common_multiple( period, record[v] );
+  if ( period > 1 && period <= length ) length = (length + period - 1) / period * period;
 
   // Allocate a data object.
-  d = new_dataset(NumVars);
+  d = new_dataset(rows);
   ds_set_columns(d, length);
 
-  // Loop through all variables to initialize each row of the matrix.
-  for ( v = 0 ; v < NumVars  ; v++ ) {
+  // String values are recorded from the realtime thread, so they are
+  // interned into preallocated storage rather than copied onto the heap.
+  for ( v = 0 ; v < NumVars ; v++ ) {
+    if ( sys_vars[v].type == SYS_STRING && ( record == NULL || record[v] ) ) {
+      ds_intern_strings(d, RING_BUFFER_STRINGS, SYS_STRING_LEN + 1);
+      break;
+    }
+  }
+
+  // Loop through the recorded variables to initialize each row of the matrix.
+  for ( v = 0, row = 0 ; v < NumVars  ; v++ ) {
 
 	// The dataset and system_state_var type codes are now interchangable.
     enum dsType type = (enum dsType) sys_vars[v].type;
+
+    if ( record != NULL && !record[v] ) continue;
     
     // set the properties of the data set variable and create a buffer 
-    ds_init_variable(d, v, 
+    ds_init_variable(d, row++, 
 		     sys_vars[v].name, 
 		     NULL,              // description string
 		     type, 
 		     DS_DIMENSIONLESS,  // units
 		     -1.0, 1.0);        // lower, upper
+
+    if ( record != NULL && record[v] > 1 ) ds_set_decimation(d, row - 1, record[v]);
   }
 
+  compile_snapshot_plan(sys_vars, d, NumVars);
+
   return d;
 }
 
+// Copy the pattern of a rule, which runs from "rule" to the end of
+// the line less any space around it, into "pattern".  Returns 0 on
+// success, or 1 if it is empty or too long.
+static int
+rule_pattern(const char *rule, char *pattern)
+{
+  size_t len;
+
+  while ( isspace( (unsigned char) *rule ) ) rule++;
+  len = strlen( rule );
+  while ( len > 0 && isspace( (unsigned char) rule[len-1] ) ) len--;
+  if ( len == 0 || len >= RULE_LENGTH ) return 1;
+  memcpy( pattern, rule, len );
+  pattern[len] = 0;
+  return 0;
+}
+
+// Apply one selection rule, "+pattern", "-pattern" or "/N pattern",
+// to the recording flags.  Quantization rules are accepted and
+// ignored.
+int
+ring_buffer_select_variables(system_state_var_t *sys_vars, int NumVars, unsigned char *record, const char *rule)
+{
+  char pattern[RULE_LENGTH];
+  unsigned char value;
+  int v;
+
+  while ( isspace( (unsigned char) *rule ) ) rule++;
+  if ( *rule == '~' ) return ring_buffer_quantize_variables( NULL, rule );
+  if ( *rule == '+' ) value = 1;
+  else if ( *rule == '-' ) value = 0;
+  else if ( *rule == '/' ) {
+    char *end;
+    long divisor = strtol( rule + 1, &end, 10 );
+    if ( end == rule + 1 || divisor < 1 || divisor > 255 ) return 1;
+    value = (unsigned char) divisor;
+    rule = end - 1;
+  }
+  else return 1;
+
+  if ( rule_pattern( rule + 1, pattern ) ) return 1;
+
+  for ( v = 0 ; v < NumVars ; v++ ) {
+    if ( sys_vars[v].name != NULL && !fnmatch( pattern, sys_vars[v].name, 0 ) ) record[v] = value;
+  }
+  return 0;
+}
+
+// Apply one quantization rule, "~step pattern" or "~step,offset
+// pattern", to the rows of a dataset, or just check it if d is NULL.
+// Other rules are accepted and ignored.
+int
+ring_buffer_quantize_variables(dataset_t *d, const char *rule)
+{
+  char pattern[RULE_LENGTH];
+  double scale, offset = 0.0;
+  char *end;
+
+  while ( isspace( (unsigned char) *rule ) ) rule++;
+  if ( *rule == '+' || *rule == '-' || *rule == '/' ) return 0;
+  if ( *rule != '~' ) return 1;
+
+  scale = strtod( rule + 1, &end );
+  if ( end == rule + 1 || !( scale > 0.0 ) ) return 1;
+  if ( *end == ',' ) {
+    rule = end + 1;
+    offset = strtod( rule, &end );
+    if ( end == rule ) return 1;
+  }
+  if ( !isspace( (unsigned char) *end ) || rule_pattern( end, pattern ) ) return 1;
+
+  if ( d != NULL ) quantize_rows( d, pattern, scale, offset );
+  return 0;
+}
+
+// Read the rules in a file, one per line, and pass each to the
+// selection function if sys_vars is given, else to the quantization
+// function.
+static int
+apply_rule_file(system_state_var_t *sys_vars, int NumVars, unsigned char *record, dataset_t *d, const char *filename)
+{
+  char buffer[RULE_LENGTH];
+  FILE *f;
+  int r = 0, line = 0;
+
+  f = fopen( filename, "r" );
+  if ( f == NULL ) return -1;
+
+  while ( fgets( buffer, RULE_LENGTH, f ) != NULL ) {
+    char *p = buffer, *comment = strchr( buffer, '#' );
+    size_t len;
+
+    line++;
+    if ( comment != NULL ) *comment = 0;
+    while ( isspace( (unsigned char) *p ) ) p++;
+    len = strlen( p );
+    while ( len > 0 && isspace( (unsigned char) p[len-1] ) ) p[--len] = 0;
+    if ( len == 0 ) continue;
+
+    if ( sys_vars != NULL ? ring_buffer_select_variables( sys_vars, NumVars, record, p ) 
+	                  : ring_buffer_quantize_variables( d, p ) ) {
+      errprintf( "%s:%d: ignoring invalid rule: %s\n", filename, line, p );
+      r = 1;
+    }
+  }
+  fclose( f );
+  return r;
+}
+
+int
+ring_buffer_select_from_file(system_state_var_t *sys_vars, int NumVars, unsigned char *record, const char *filename)
+{
+  return apply_rule_file( sys_vars, NumVars, record, NULL, filename );
+}
+
+int
+ring_buffer_quantize_from_file(dataset_t *d, const char *filename)
+{
+  return apply_rule_file( NULL, 0, NULL, d, filename );
+}
+
+// Choose the name for a new data file, within the "data"
+// subdirectory if there is one.  The directory is searched by path
+// rather than by changing into it, since the writer threads call
+// this while the rest of the process runs.  Returns a newly
+// allocated string, or NULL on failure.
+static char *
+choose_data_file_name(void)
+{
+  char *filename, *newname;
+  struct stat st;
+
+  // The "data" subdirectory may well be a link, which stat follows.
+  if ( stat( "data", &st ) != 0 || !S_ISDIR( st.st_mode ) ) return new_data_file_name();
+
+  // search the directory to figure out the correct new file name
+  filename = new_data_file_name_in( "data" );
+  if ( filename == NULL ) return NULL;
+
+  // prepend the path
+  if ( asprintf( &newname, "data/%s", filename ) < 0 ) newname = NULL;
+  free(filename);
+  return newname;
+}
+
 // Write the ring buffer out to a new file.  Returns a newly
 // allocated string with the name on success or NULL on failure.
 // The string must be freed by the caller.
@@ -56,33 +256,10 @@ write_ring_buffer(dataset_t *d)
 {
   int r;
   FILE *file;
-  char *filename;
-  char current_dir[500];
-  int switched_dirs = 0;
-
-  // Try to save the current directory and change into the "data"
-  // subdirectory, which may well be a link.
-  if ( ( getcwd( current_dir, (size_t) 500) != NULL ) && ( chdir ("data") == 0 )) {
-    // logprintf("  moved to data subdirectory.\n");
-    switched_dirs = 1;
-  }
-
-  // search the directory to figure out the correct new file name
-  filename = new_data_file_name();
-
-  // switch back to the initial directory
-  if (switched_dirs) chdir (current_dir);
+  char *filename = choose_data_file_name();
 
   if ( filename == NULL ) return NULL;
 
-  // if needed, prepend a path
-  if ( switched_dirs ) {
-    char *newname;
-    asprintf( &newname, "data/%s", filename );
-    free(filename);
-    filename = newname;
-  }
-
   // the "b" is for non-UNIX systems
   file = fopen(filename, "wb");
 
@@ -105,15 +282,379 @@ write_ring_buffer(dataset_t *d)
   return filename;
 }
 
+/****************************************************************/
+// The snapshot plan is the list of copies made by each snapshot,
+// compiled once from the system state variable table so that the
+// per-tick loop needs no type dispatch.  Ints and floats are copied
+// alike as four byte words, and doubles as eight byte words, straight
+// from the variable to its value in column 0; the value for another
+// column lies a fixed stride further on, which is the value size for
+// the usual layout or the frame size for the frame layout.  The plan
+// is a single malloc'd block kept in d->snapshot_plan; the dataset
+// code discards it whenever the data buffers are reallocated.
+//
+// The rows of a masked ring buffer are the recorded variables in
+// table order, so the table and the rows are paired up by walking
+// them together and matching the names.  Unrecorded variables have
+// no copy at all.
+//
+// In the frame layout a decimated variable has a buffer of its own
+// with one value for each group of "divisor" columns.  These copies
+// are held in groups of equal divisor, and a group is only copied
+// when the column is a multiple of its divisor, so a variable
+// recorded every tenth sample costs a tenth of the time.  In the
+// usual layout decimated variables are copied every tick like the
+// others.
+//
+// In the frame layout a quantized variable (see ds_set_quantization)
+// is stored as its 16 bit count rather than copied, whether it is
+// decimated or not.
+
+typedef struct {
+  const char *src;     // address of the variable
+  char *dst;           // address of its value in column 0
+} snapshot_copy_t;
+
+typedef struct {
+  const char *src;     // address of the string
+  int row;             // its dataset row
+} snapshot_string_t;
+
+typedef struct {
+  const char *src;     // address of the variable
+  char *dst;           // address of its count in column 0
+  int type;            // its system type
+  int row;             // its dataset row
+} snapshot_quantum_t;
+
+typedef struct {
+  const char *src;     // address of the variable
+  char *dst;           // address of its first value
+  int size;            // bytes per value, 2 for a count, or 0 for a string
+  int type;            // its system type
+  int row;             // its dataset row
+} snapshot_held_t;
+
+typedef struct {
+  unsigned int divisor;  // columns per value
+  int first;             // index of the first copy of the group
+  int count;             // number of copies
+} snapshot_group_t;
+
+typedef struct {
+  system_state_var_t *sys_vars;   // the table the plan was compiled from
+  int NumVars;
+  size_t word_stride;             // bytes between the columns of a four byte value or a count
+  size_t double_stride;           // bytes between the columns of an eight byte value
+  int words;                      // number of four byte copies
+  int doubles;                    // number of eight byte copies
+  int strings;                    // number of string values
+  int quanta;                     // number of quantized values
+  snapshot_copy_t *word;
+  snapshot_copy_t *dbl;
+  snapshot_string_t *string;
+  snapshot_quantum_t *quantum;
+  int groups;                     // number of divisors of the decimated copies
+  unsigned int period;            // least common multiple of the divisors, or 1
+  snapshot_held_t *held;          // decimated copies, in order of group
+  snapshot_group_t *group;
+} snapshot_plan_t;
+
+// Return the divisor of a row held apart from the frames, or 1.
+static unsigned
+held_divisor(dataset_t *d, int row)
+{
+  if ( ds_frame_buffer(d, NULL) == NULL || ds_frame_offset(d, row) >= 0 ) return 1;
+  return ( d->vars[row].decimation > 1 ) ? d->vars[row].decimation : 1;
+}
+
+// Return the period after which the decimated groups all start
+// together, or 1.
+static unsigned
+ring_period(dataset_t *d)
+{
+  snapshot_plan_t *plan = (snapshot_plan_t *) d->snapshot_plan;
+  return ( plan != NULL ) ? plan->period : 1;
+}
+
+// Return true if a row is held as 16 bit counts.
+static int
+held_quantized(dataset_t *d, int row)
+{
+  enum dsType t = d->vars[row].type;
+  return ds_frame_buffer(d, NULL) != NULL && d->vars[row].scale != 0.0 
+    && ( t == DS_INT || t == DS_FLOAT || t == DS_DOUBLE );
+}
+
+// Return the count representing the current value of a variable.
+static inline short
+quantize_variable(dataset_t *d, int row, int type, const char *src)
+{
+  switch ( type ) {
+  case SYS_INT:    return ds_quantize(d, row, *(const int *) src);
+  case SYS_FLOAT:  return ds_quantize(d, row, *(const float *) src);
+  default:         return ds_quantize(d, row, *(const double *) src);
+  }
+}
+
+static void
+compile_snapshot_plan(system_state_var_t *sys_vars, dataset_t *d, int NumVars)
+{
+  snapshot_plan_t *plan;
+  unsigned int frame_size;
+  unsigned char *frames = ds_frame_buffer(d, &frame_size);
+  int *rows = (int *) malloc( (NumVars + 1) * sizeof(int) );
+  int words = 0, doubles = 0, strings = 0, quanta = 0, held = 0, groups = 0;
+  int v, row;
+
+  for ( v = 0, row = 0 ; v < NumVars ; v++ ) {
+    rows[v] = -1;
+    if ( row < (int) d->variables
+	 && sys_vars[v].name != NULL && d->vars[row].name != NULL
+	 && !strcmp( sys_vars[v].name, d->vars[row].name )
+	 && d->vars[row].type == (enum dsType) sys_vars[v].type ) {
+      if ( frames != NULL || d->data[row] != NULL ) rows[v] = row;
+      row++;
+    }
+  }
+
+  for ( v = 0 ; v < NumVars ; v++ ) {
+    if ( rows[v] < 0 ) continue;
+    if ( held_divisor(d, rows[v]) > 1 ) {
+      if ( sys_vars[v].type != SYS_NOTYPE ) held++;
+      continue;
+    }
+    if ( held_quantized(d, rows[v]) ) {
+      quanta++;
+      continue;
+    }
+    switch(sys_vars[v].type) {
+    case SYS_FLOAT:
+    case SYS_INT:    words++;   break;
+    case SYS_DOUBLE: doubles++; break;
+    case SYS_STRING: strings++; break;
+    case SYS_NOTYPE: break;
+    }
+  }
+
+  // The copy lists follow the header within the same block.
+  plan = (snapshot_plan_t *) malloc( sizeof(snapshot_plan_t)
+				     + (words + doubles) * sizeof(snapshot_copy_t)
+				     + strings * sizeof(snapshot_string_t)
+				     + quanta * sizeof(snapshot_quantum_t)
+				     + held * (sizeof(snapshot_held_t) + sizeof(snapshot_group_t)) );
+  plan->sys_vars = sys_vars;
+  plan->NumVars  = NumVars;
+  plan->word_stride   = ( frames != NULL ) ? frame_size : 4;
+  plan->double_stride = ( frames != NULL ) ? frame_size : 8;
+  plan->word   = (snapshot_copy_t *) (plan + 1);
+  plan->dbl    = plan->word + words;
+  plan->string = (snapshot_string_t *) (plan->dbl + doubles);
+  plan->quantum = (snapshot_quantum_t *) (plan->string + strings);
+  plan->held   = (snapshot_held_t *) (plan->quantum + quanta);
+  plan->group  = (snapshot_group_t *) (plan->held + held);
+  plan->words = plan->doubles = plan->strings = plan->quanta = plan->groups = 0;
+
+  for ( v = 0 ; v < NumVars ; v++ ) {
+    snapshot_copy_t *c = NULL;
+
+    row = rows[v];
+    if ( row < 0 || held_divisor(d, row) > 1 ) continue;
+    if ( held_quantized(d, row) ) {
+      snapshot_quantum_t *q = &plan->quantum[plan->quanta++];
+      q->src  = (const char *) sys_vars[v].data;
+      q->dst  = (char *) frames + ds_frame_offset(d, row);
+      q->type = sys_vars[v].type;
+      q->row  = row;
+      continue;
+    }
+    switch(sys_vars[v].type) {
+    case SYS_FLOAT:
+    case SYS_INT:    c = &plan->word[plan->words++];  break;
+    case SYS_DOUBLE: c = &plan->dbl[plan->doubles++]; break;
+    case SYS_STRING: 
+      plan->string[plan->strings].src = (const char *) sys_vars[v].data;
+      plan->string[plan->strings].row = row;
+      plan->strings++;
+      break;
+    case SYS_NOTYPE: break;
+    }
+    if ( c != NULL ) {
+      c->src = (const char *) sys_vars[v].data;
+      c->dst = ( frames != NULL ) ? (char *) frames + ds_frame_offset(d, row) : (char *) d->data[row];
+    }
+  }
+
+  // Collect the decimated copies a divisor at a time, smallest first.
+  for ( held = 0 ; ; ) {
+    unsigned divisor = 0;
+    snapshot_group_t *g;
+
+    for ( v = 0 ; v < NumVars ; v++ ) {
+      unsigned k;
+      if ( rows[v] < 0 || sys_vars[v].type == SYS_NOTYPE ) continue;
+      k = held_divisor(d, rows[v]);
+      if ( k > 1 && ( groups == 0 || k > plan->group[groups-1].divisor ) && ( divisor == 0 || k < divisor ) ) divisor = k;
+    }
+    if ( divisor == 0 ) break;
+
+    g = &plan->group[groups++];
+    g->divisor = divisor;
+    g->first = held;
+    for ( v = 0 ; v < NumVars ; v++ ) {
+      snapshot_held_t *h = &plan->held[held];
+      row = rows[v];
+      if ( row < 0 || sys_vars[v].type == SYS_NOTYPE || held_divisor(d, row) != divisor ) continue;
+      h->src  = (const char *) sys_vars[v].data;
+      h->dst  = (char *) d->data[row];
+      h->size = ( sys_vars[v].type == SYS_STRING ) ? 0 : held_quantized(d, row) ? 2 : ( sys_vars[v].type == SYS_DOUBLE ) ? 8 : 4;
+      h->type = sys_vars[v].type;
+      h->row  = row;
+      held++;
+    }
+    g->count = held - g->first;
+  }
+  plan->groups = groups;
+
+  plan->period = 1;
+  for ( v = 0 ; v < groups && plan->period <= d->columns ; v++ ) 
+    plan->period = least_common_multiple( plan->period, plan->group[v].divisor );
+  if ( plan->period > d->columns || d->columns % plan->period ) plan->period = 1;
+  free( rows );
+
+  if ( d->snapshot_plan != NULL ) free( d->snapshot_plan );
+  d->snapshot_plan = plan;
+}
+
+// Copy the values of all variables into a column of the data set.
+static void
+copy_snapshot(system_state_var_t *sys_vars, dataset_t *d, int col, int NumVars)
+{
+  snapshot_plan_t *plan = (snapshot_plan_t *) d->snapshot_plan;
+  const snapshot_copy_t *c;
+  const snapshot_copy_t *end;
+  size_t offset;
+  int v;
+
+  // The plan is normally compiled by create_ring_buffer; it only
+  // needs compiling here if the dataset has been changed since.
+  if ( plan == NULL || plan->sys_vars != sys_vars || plan->NumVars != NumVars ) {
+    compile_snapshot_plan(sys_vars, d, NumVars);
+    plan = (snapshot_plan_t *) d->snapshot_plan;
+  }
+
+  // The fixed size memcpy calls compile to single moves.
+  offset = plan->word_stride * col;
+  for ( c = plan->word, end = c + plan->words ; c < end ; c++ )
+    memcpy( c->dst + offset, c->src, 4 );
+
+  offset = plan->double_stride * col;
+  for ( c = plan->dbl, end = c + plan->doubles ; c < end ; c++ )
+    memcpy( c->dst + offset, c->src, 8 );
+
+  for ( v = 0 ; v < plan->strings ; v++ )
+    ds_set_string(d, plan->string[v].row, col, plan->string[v].src);
+
+  offset = plan->word_stride * col;
+  for ( v = 0 ; v < plan->quanta ; v++ ) {
+    const snapshot_quantum_t *q = &plan->quantum[v];
+    short count = quantize_variable(d, q->row, q->type, q->src);
+    memcpy( q->dst + offset, &count, 2 );
+  }
+
+  for ( v = 0 ; v < plan->groups ; v++ ) {
+    const snapshot_group_t *g = &plan->group[v];
+    const snapshot_held_t *h, *hend;
+
+    if ( col % g->divisor ) continue;
+    for ( h = plan->held + g->first, hend = h + g->count ; h < hend ; h++ ) {
+      offset = (size_t) h->size * (col / g->divisor);
+      switch ( h->size ) {
+      case 2:  {
+	short count = quantize_variable(d, h->row, h->type, h->src);
+	memcpy( h->dst + offset, &count, 2 );
+	break;
+      }
+      case 4:  memcpy( h->dst + offset, h->src, 4 ); break;
+      case 8:  memcpy( h->dst + offset, h->src, 8 ); break;
+      default: ds_set_string(d, h->row, col, h->src); break;
+      }
+    }
+  }
+}
+
+// Switch a ring buffer between the usual and the frame-major layout,
+// keeping its snapshot plan.
+void
+ring_buffer_frame_layout(dataset_t *d, int frames)
+{
+  snapshot_plan_t *plan;
+
+  if ( d == NULL ) return;
+  plan = (snapshot_plan_t *) d->snapshot_plan;
+
+  if ( plan == NULL ) {
+    ds_set_frame_layout(d, frames);
+  } else {
+    system_state_var_t *sys_vars = plan->sys_vars;
+    int NumVars = plan->NumVars;
+
+    ds_set_frame_layout(d, frames);   // this discards the plan
+    compile_snapshot_plan(sys_vars, d, NumVars);
+  }
+}
+
+// Quantize the rows whose names match a pattern, keeping the
+// snapshot plan.
+static void
+quantize_rows(dataset_t *d, const char *pattern, double scale, double offset)
+{
+  snapshot_plan_t *plan = (snapshot_plan_t *) d->snapshot_plan;
+  system_state_var_t *sys_vars = ( plan != NULL ) ? plan->sys_vars : NULL;
+  int NumVars = ( plan != NULL ) ? plan->NumVars : 0;
+  int v;
+
+  for ( v = 0 ; v < (int) d->variables ; v++ ) {
+    if ( d->vars[v].name != NULL && !fnmatch( pattern, d->vars[v].name, 0 ) ) 
+      ds_set_quantization( d, v, scale, offset );   // this may discard the plan
+  }
+  if ( plan != NULL && d->snapshot_plan == NULL ) compile_snapshot_plan(sys_vars, d, NumVars);
+}
+
+// Move the frames of a ring buffer into shared memory, keeping its
+// snapshot plan.
+int
+share_ring_buffer(dataset_t *d, const char *name)
+{
+  snapshot_plan_t *plan;
+  int r;
+
+  if ( d == NULL ) return 1;
+  plan = (snapshot_plan_t *) d->snapshot_plan;
+
+  if ( plan == NULL ) return ds_share_frames(d, name);
+  else {
+    system_state_var_t *sys_vars = plan->sys_vars;
+    int NumVars = plan->NumVars;
+
+    r = ds_share_frames(d, name);     // this discards the plan on success
+    if ( d->snapshot_plan == NULL ) compile_snapshot_plan(sys_vars, d, NumVars);
+    return r;
+  }
+}
+
 // Copy a snapshot of all variables into a column of the data set.
 void
 ring_buffer_snapshot(system_state_var_t *sys_vars, dataset_t *d, int NumVars)
 {
   int col;        // the column to fill
-  int v;
 
   if ( d == NULL || sys_vars == NULL ) return;
 
+  d->sequence++;          // odd: the indices and a column are changing
+  __sync_synchronize();
+  ds_publish_ring(d);
+
   // figure out the next column to write
   col = (d->startpos + d->samples) % d->columns;
 
@@ -127,39 +668,446 @@ ring_buffer_snapshot(system_state_var_t *sys_vars, dataset_t *d, int NumVars)
   // the number of valid samples increases until the buffer is full
   if (++d->samples > d->columns) d->samples = d->columns;
 
-  // Loop through all variables and copy over the data.
-  for ( v = 0 ; v < NumVars  ; v++ ) {
-    // determine the dataset variable type.
-    switch(sys_vars[v].type) {
+  copy_snapshot(sys_vars, d, col, NumVars);
 
-    case SYS_FLOAT:  
-      (ds_float(d, v))[col] = *((float *) sys_vars[v].data);
-      break;
+  // Overwriting the first column of a group of decimated values also
+  // changes the value the rest of the group shows, so once the ring
+  // has wrapped the oldest samples up to the next whole period are
+  // dropped.  The buffer then always starts on a group boundary.
+  // Dropping samples leaves the next column to write unchanged.
+  {
+    unsigned period = ring_period(d);
+    unsigned n = (period - d->startpos % period) % period;
+    if ( n > d->samples ) n = d->samples;
+    if ( n > 0 ) {
+      d->startpos = (d->startpos + n) % d->columns;
+      d->samples -= n;
+    }
+  }
 
-    case SYS_DOUBLE: 
-      (ds_double(d, v))[col] = *((double *) sys_vars[v].data);
-      break;
+  __sync_synchronize();
+  d->sequence++;          // even: consistent again
+  ds_publish_ring(d);
+}
 
-    case SYS_INT: 
-      (ds_int(d, v))[col] = *((int *) sys_vars[v].data);
-      break;
+// Clear the ring buffer by emptying it.  The next sample goes into
+// the first column of a whole period at or after the last one, so
+// that the buffer starts on a group boundary, as it does once it has
+// wrapped.  ring_buffer_read_recent allows for one column written per
+// update, so each column skipped counts as another update.
+void
+clear_ring_buffer(dataset_t *d)
+{
+  if ( d != NULL && d->columns > 0 ) {
+    unsigned period = ring_period(d);
+    unsigned head = (d->startpos + d->samples) % d->columns;
+    unsigned skip = (period - head % period) % period;
 
-    case SYS_STRING: 
-      ds_set_string(d, v, col, (char *) sys_vars[v].data);
-      break;
+    d->sequence++;
+    __sync_synchronize();
+    ds_publish_ring(d);
+    d->startpos = (head + skip) % d->columns;
+    d->samples = 0;
+    __sync_synchronize();
+    d->sequence += 1 + 2 * skip;
+    ds_publish_ring(d);
+  }
+}
 
-    case SYS_NOTYPE:
-      break;
+// How many times a reader tries before giving up.
+#define READ_RECENT_ATTEMPTS 100
+
+dataset_t *
+ring_buffer_read_recent(dataset_t *d, unsigned int n)
+{
+  dataset_t *r;
+  unsigned int slack = 0, attempt, v;
+
+  if ( d == NULL || d->columns == 0 ) return NULL;
+
+  // A decimated value is written for its whole group at once, so
+  // that many columns beyond each written one may change as well.
+  for ( v = 0 ; v < d->variables ; v++ ) 
+    if ( held_divisor(d, v) - 1 > slack ) slack = held_divisor(d, v) - 1;
+  if ( slack >= d->columns ) return NULL;
+  if ( n > d->columns - slack ) n = d->columns - slack;
+
+  r = new_dataset(d->variables);
+  ds_set_columns(r, n);
+  for ( v = 0 ; v < d->variables ; v++ ) {
+    ds_init_variable(r, v, d->vars[v].name, d->vars[v].desc, d->vars[v].type, d->vars[v].units, d->vars[v].lower, d->vars[v].upper);
+    r->vars[v].decimation = d->vars[v].decimation;
+    r->vars[v].scale = d->vars[v].scale;
+    r->vars[v].offset = d->vars[v].offset;
+  }
+
+  for ( attempt = 0 ; attempt < READ_RECENT_ATTEMPTS ; attempt++ ) {
+    unsigned int before, after, startpos, samples, head, m, updates;
+
+    // Copy the latest samples as of one moment, then check that none
+    // of the columns was written meanwhile.  Each update since writes
+    // at most the next column past the head.
+    if ( ds_ring_state(d, &before, &startpos, &samples) ) break;
+    m = ( samples < n ) ? samples : n;
+    head = (startpos + samples) % d->columns;
+    ds_copy_columns(r, d, (head + d->columns - m) % d->columns, m);
+    __sync_synchronize();
+    if ( ds_ring_state(d, &after, NULL, NULL) ) break;
+    updates = (after - before) / 2;
+
+    if ( updates + slack + m <= d->columns ) {
+      r->samples = m;
+      return r;
+    }
+  }
+  delete_dataset( r );
+  return NULL;
+}
+
+/****************************************************************/
+// Streaming the ring buffer to a file.  The realtime thread and the
+// writer thread share the ring through two running sample counts:
+// the realtime thread fills the column of sample "produced" and then
+// advances it, and the writer appends the samples from "consumed" up
+// to "produced" to the file and then advances "consumed".  Each
+// count is written by only one thread, so no lock is needed, only
+// memory barriers to order the data against the counts.
+
+// How long the writer sleeps between checks for new samples.
+#define STREAM_POLL_MICROSECONDS 50000
+
+// Append the available samples to the file.  Unless "all" is set,
+// only whole blocks of "block" samples are written, which keeps the
+// compressed blocks full.  Returns 0 on success.
+static int
+drain_ring_buffer_stream(ring_buffer_stream_t *s, int all)
+{
+  unsigned int available, n;
+  int r = 0;
+
+  __sync_synchronize();   // read the count before the data it covers
+  available = s->produced - s->consumed;
+
+  // the samples before the first group boundary are passed over
+  if ( s->skip > 0 && available > 0 ) {
+    n = ( available < s->skip ) ? available : s->skip;
+    s->tail = (s->tail + n) % s->d->columns;
+    s->skip -= n;
+    available -= n;
+    __sync_synchronize();
+    s->consumed += n;
+  }
+  n = all ? available : available - available % s->block;
+
+  if ( n > 0 ) {
+    r = ds_append_frames( s->d, s->file, s->tail, n );
+    r = fflush( s->file->file ) || r;  // hand the data to the kernel in case of a crash
+    s->tail = (s->tail + n) % s->d->columns;
+
+    __sync_synchronize();   // finish reading the data before releasing it
+    s->consumed += n;
+  }
+  return r;
+}
+
+static void *
+ring_buffer_stream_writer(void *arg)
+{
+  ring_buffer_stream_t *s = (ring_buffer_stream_t *) arg;
+
+  while ( s->running ) {
+    if ( drain_ring_buffer_stream( s, 0 ) ) s->errors++;
+    usleep( STREAM_POLL_MICROSECONDS );
+  }
+  return NULL;
+}
+
+ring_buffer_stream_t *
+start_ring_buffer_stream(dataset_t *d, unsigned int block)
+{
+  ring_buffer_stream_t *s;
+  unsigned int divisor = 1;
+  int v;
+
+  if ( d == NULL || d->columns == 0 ) return NULL;
+
+  s = (ring_buffer_stream_t *) calloc( 1, sizeof(ring_buffer_stream_t) );
+  s->d = d;
+  // A value held apart for a group of columns is overwritten when the
+  // first column of the group comes round again, so the writer must
+  // have finished the whole group from the previous lap by then.
+  for ( v = 0 ; v < (int) d->variables ; v++ ) 
+    if ( held_divisor(d, v) > divisor ) divisor = held_divisor(d, v);
+  s->limit = ( divisor < d->columns ) ? d->columns - (divisor - 1) : 1;
+  // Leave room in the ring for recording while a block is written.
+  s->block = ( block == 0 ) ? DS_CODEC_BLOCK_FRAMES : block;
+  if ( s->block > d->columns / 2 ) s->block = d->columns / 2;
+  if ( s->block == 0 ) s->block = 1;
+  // The first sample goes into the column after the last one
+  // recorded.  The file starts at the next group boundary, as a
+  // wrapped ring does, so the samples up to it are not written.
+  s->tail = (d->startpos + d->samples) % d->columns;
+  s->skip = (ring_period(d) - s->tail % ring_period(d)) % ring_period(d);
+  s->filename = choose_data_file_name();
+  if ( s->filename != NULL ) s->file = ds_open_append( s->filename, d );
+
+  if ( s->file == NULL ) {
+    if ( s->filename != NULL ) free( s->filename );
+    free( s );
+    return NULL;
+  }
+
+  s->running = 1;
+  if ( pthread_create( &s->thread, NULL, ring_buffer_stream_writer, s ) != 0 ) {
+    ds_close_append( s->file );
+    unlink( s->filename );
+    free( s->filename );
+    free( s );
+    return NULL;
+  }
+  return s;
+}
+
+void
+ring_buffer_stream_snapshot(system_state_var_t *sys_vars, ring_buffer_stream_t *s, int NumVars)
+{
+  if ( s == NULL || sys_vars == NULL ) return;
+
+  // If the writer has fallen a whole ring behind, the sample is
+  // dropped rather than overwriting data not yet written.
+  if ( s->produced - s->consumed >= s->limit ) {
+    s->overruns++;
+    return;
+  }
+  // The ring indices advance as usual, under the sequence count, so
+  // that readers can follow a streamed ring as well.
+  ring_buffer_snapshot( sys_vars, s->d, NumVars );
+
+  __sync_synchronize();   // publish the data before the count
+  s->produced++;
+}
+
+char *
+stop_ring_buffer_stream(ring_buffer_stream_t *s, int keep)
+{
+  char *filename;
+  int r;
+
+  if ( s == NULL ) return NULL;
+
+  s->running = 0;
+  pthread_join( s->thread, NULL );
+
+  r = drain_ring_buffer_stream( s, 1 ) || s->errors > 0;
+  r = ds_close_append( s->file ) || r;
+  filename = s->filename;
+
+  if ( r || !keep ) {
+    if ( !keep ) unlink( filename );
+    free( filename );
+    filename = NULL;
+  }
+  free( s );
+  return filename;
+}
+
+/****************************************************************/
+// Triggered captures.  The realtime thread records each sample into
+// a side buffer as well as the main ring.  When the condition
+// becomes true the buffer records "post" more samples and is then
+// handed to the writer thread, which saves it to a new file, clears
+// it and hands it back.  The state word is written by the realtime
+// thread to hand the buffer over and by the writer to return it.
+
+enum { TRIGGER_ARMED, TRIGGER_POST, TRIGGER_SAVING };
+
+enum { TRIGGER_EQ, TRIGGER_NE, TRIGGER_LT, TRIGGER_LE, TRIGGER_GT, TRIGGER_GE };
+
+// Evaluate the predicate set by ring_buffer_trigger_when.
+static int
+trigger_predicate(ring_buffer_trigger_t *t)
+{
+  double x;
+
+  switch ( t->type ) {
+  case SYS_INT:    x = *(const int *) t->var;    break;
+  case SYS_FLOAT:  x = *(const float *) t->var;  break;
+  case SYS_DOUBLE: x = *(const double *) t->var; break;
+  case SYS_STRING: 
+    x = strncmp( (const char *) t->var, t->text, SYS_STRING_LEN );
+    return ( t->op == TRIGGER_EQ ) ? ( x == 0 ) : ( x != 0 );
+  default: return 0;
+  }
+  switch ( t->op ) {
+  case TRIGGER_EQ: return x == t->value;
+  case TRIGGER_NE: return x != t->value;
+  case TRIGGER_LT: return x <  t->value;
+  case TRIGGER_LE: return x <= t->value;
+  case TRIGGER_GT: return x >  t->value;
+  case TRIGGER_GE: return x >= t->value;
+  }
+  return 0;
+}
+
+// Save the side buffer and rearm.  Returns 0 on success.
+static int
+save_trigger_capture(ring_buffer_trigger_t *t)
+{
+  char *filename = write_ring_buffer( t->d );
+
+  clear_ring_buffer( t->d );
+  if ( filename == NULL ) return 1;
+  logprintf( "Saved triggered capture in %s.\n", filename );
+  free( filename );
+  t->captures++;
+  return 0;
+}
+
+static void *
+ring_buffer_trigger_writer(void *arg)
+{
+  ring_buffer_trigger_t *t = (ring_buffer_trigger_t *) arg;
+
+  while ( t->running ) {
+    if ( t->state == TRIGGER_SAVING ) {
+      __sync_synchronize();   // read the state before the data it covers
+      if ( save_trigger_capture( t ) ) t->errors++;
+      __sync_synchronize();   // finish with the buffer before returning it
+      t->state = TRIGGER_ARMED;
     }
-  }    
+    usleep( STREAM_POLL_MICROSECONDS );
+  }
+  return NULL;
+}
+
+ring_buffer_trigger_t *
+start_ring_buffer_trigger(system_state_var_t *sys_vars, int NumVars, const unsigned char *record,
+			  unsigned int pre, unsigned int post, ring_buffer_condition_t condition, void *arg)
+{
+  ring_buffer_trigger_t *t;
+
+  if ( sys_vars == NULL || pre + post == 0 ) return NULL;
+
+  t = (ring_buffer_trigger_t *) calloc( 1, sizeof(ring_buffer_trigger_t) );
+  t->d = create_masked_ring_buffer( sys_vars, pre + post, NumVars, record );
+  ring_buffer_frame_layout( t->d, 1 );
+  t->post = post;
+  t->condition = condition;
+  t->arg = arg;
+  t->type = SYS_NOTYPE;
+  t->state = TRIGGER_ARMED;
+
+  t->running = 1;
+  if ( pthread_create( &t->thread, NULL, ring_buffer_trigger_writer, t ) != 0 ) {
+    delete_dataset( t->d );
+    free( t );
+    return NULL;
+  }
+  return t;
+}
+
+int
+ring_buffer_trigger_when(ring_buffer_trigger_t *t, system_state_var_t *sys_vars, int NumVars, const char *predicate)
+{
+  static const char *ops[] = { "==", "!=", "<=", ">=", "<", ">", NULL };
+  static const int codes[] = { TRIGGER_EQ, TRIGGER_NE, TRIGGER_LE, TRIGGER_GE, TRIGGER_LT, TRIGGER_GT };
+  char name[RULE_LENGTH];
+  const char *p = predicate, *rest;
+  size_t len;
+  int v, i;
+
+  if ( t == NULL || predicate == NULL ) return 1;
+
+  // the name runs up to the operator
+  while ( isspace( (unsigned char) *p ) ) p++;
+  for ( len = 0 ; p[len] && !isspace( (unsigned char) p[len] ) && !strchr( "=!<>", p[len] ) ; len++ );
+  if ( len == 0 || len >= RULE_LENGTH ) return 1;
+  memcpy( name, p, len );
+  name[len] = 0;
+
+  for ( p += len ; isspace( (unsigned char) *p ) ; p++ );
+  for ( i = 0 ; ops[i] != NULL && strncmp( p, ops[i], strlen( ops[i] ) ) ; i++ );
+  if ( ops[i] == NULL ) return 1;
+  for ( p += strlen( ops[i] ) ; isspace( (unsigned char) *p ) ; p++ );
+
+  for ( v = 0 ; v < NumVars ; v++ ) 
+    if ( sys_vars[v].name != NULL && !strcmp( sys_vars[v].name, name ) ) break;
+  if ( v == NumVars || sys_vars[v].type == SYS_NOTYPE ) return 1;
+
+  if ( sys_vars[v].type == SYS_STRING ) {
+    // the text runs to the end, less any trailing space
+    if ( codes[i] != TRIGGER_EQ && codes[i] != TRIGGER_NE ) return 1;
+    len = strlen( p );
+    while ( len > 0 && isspace( (unsigned char) p[len-1] ) ) len--;
+    if ( len > SYS_STRING_LEN ) return 1;
+    memcpy( t->text, p, len );
+    t->text[len] = 0;
+  } else {
+    char *end;
+    t->value = strtod( p, &end );
+    for ( rest = end ; isspace( (unsigned char) *rest ) ; rest++ );
+    if ( end == p || *rest != 0 ) return 1;
+  }
+
+  t->var  = sys_vars[v].data;
+  t->op   = codes[i];
+  t->type = sys_vars[v].type;
+  return 0;
 }
 
-// Clear the ring buffer by resetting the pointers.
 void
-clear_ring_buffer(dataset_t *d)
+ring_buffer_trigger_snapshot(system_state_var_t *sys_vars, ring_buffer_trigger_t *t, int NumVars)
 {
-  if ( d != NULL ) {
-    d->startpos = 0;
-    d->samples = 0;
+  int active;
+
+  if ( t == NULL || sys_vars == NULL ) return;
+
+  active = ( t->condition != NULL && t->condition( t->arg ) ) 
+    || ( t->type != SYS_NOTYPE && trigger_predicate( t ) );
+
+  switch ( t->state ) {
+  case TRIGGER_ARMED:
+    ring_buffer_snapshot( sys_vars, t->d, NumVars );
+    if ( active && !t->previous ) {
+      t->triggers++;
+      t->remaining = t->post;
+      t->state = TRIGGER_POST;
+    }
+    break;
+
+  case TRIGGER_POST:
+    // a further incident is part of this capture
+    ring_buffer_snapshot( sys_vars, t->d, NumVars );
+    break;
+
+  default:
+    // the buffer belongs to the writer until it is saved
+    if ( active && !t->previous ) t->missed++;
+    break;
   }
+
+  if ( t->state == TRIGGER_POST && t->remaining-- == 0 ) {
+    __sync_synchronize();   // publish the data before handing it over
+    t->state = TRIGGER_SAVING;
+  }
+  t->previous = active;
+}
+
+unsigned int
+stop_ring_buffer_trigger(ring_buffer_trigger_t *t)
+{
+  unsigned int captures;
+
+  if ( t == NULL ) return 0;
+
+  t->running = 0;
+  pthread_join( t->thread, NULL );
+
+  // save an incident which was still being recorded
+  if ( t->state != TRIGGER_ARMED && save_trigger_capture( t ) ) t->errors++;
+
+  captures = t->captures;
+  delete_dataset( t->d );
+  free( t );
+  return captures;
 }
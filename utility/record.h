@@ -8,6 +8,7 @@
 #ifndef RECORD_H_INCLUDED
 #define RECORD_H_INCLUDED
 
+#include <pthread.h>
 #include "system_state_var.h"
 #include "dataset.h"
 
@@ -15,6 +16,48 @@
 // variable description and the specified number of samples.
 extern dataset_t *create_ring_buffer(system_state_var_t *sys_vars, unsigned length, int NumVars);
 
+// Create a ring buffer holding only the variables whose entry in the
+// array "record" is nonzero, or all of them if it is NULL.  The other
+// variables have neither a row nor a buffer, and are skipped by the
+// snapshots.  The rows are the recorded variables in table order,
+// and ring_buffer_snapshot takes the full table as usual.  An entry
+// greater than one records the variable only every that many samples
+// (see ds_set_decimation); the length is then rounded up to a
+// multiple of the divisors.  The savings in memory and time apply
+// once the buffer is in the frame layout, see ring_buffer_frame_layout.
+extern dataset_t *create_masked_ring_buffer(system_state_var_t *sys_vars, unsigned length, int NumVars, const unsigned char *record);
+
+// Choose the variables to record with a list of rules matching their
+// names, such as "-offset*" or "+k.walk*".  A rule beginning with '+'
+// sets the flag in "record" of every variable whose name matches the
+// shell wildcard pattern which follows (see fnmatch(3)), and one
+// beginning with '-' clears it, so later rules override earlier
+// ones.  A rule beginning with '/' and a divisor from 1 to 255, such
+// as "/10 temp*", records the matching variables every that many
+// samples.  Returns 0 on success, or 1 if the rule is malformed.
+extern int ring_buffer_select_variables(system_state_var_t *sys_vars, int NumVars, unsigned char *record, const char *rule);
+
+// Apply the rules in a file, one per line, to the recording flags.
+// Blank lines and text from a '#' onward are ignored.  Returns 0 on
+// success, -1 if the file can't be opened, or 1 if any line was
+// invalid; those lines are reported and skipped.
+extern int ring_buffer_select_from_file(system_state_var_t *sys_vars, int NumVars, unsigned char *record, const char *filename);
+
+// Quantize the rows of a ring buffer matching a rule such as
+// "~0.001 *.q" or "~0.01,-20 temp*": a '~', the step, optionally a
+// comma and the value represented by zero, and a shell wildcard
+// pattern.  In the frame layout the matching numeric variables are
+// then held as 16 bit counts, see ds_set_quantization.  The
+// selection rules are ignored here, and these are ignored by
+// ring_buffer_select_variables, so both kinds can share a file.  Call
+// this before recording starts; it rebuilds the frames.  Returns 0 on
+// success, or 1 if the rule is malformed.
+extern int ring_buffer_quantize_variables(dataset_t *d, const char *rule);
+
+// Apply the quantization rules in a file, as for
+// ring_buffer_select_from_file.
+extern int ring_buffer_quantize_from_file(dataset_t *d, const char *filename);
+
 // Write the ring buffer out to a new file.  Returns a newly
 // allocated string with the name on success or NULL on nfailure.
 // The string must be freed by the caller.
@@ -23,9 +66,144 @@ extern char *write_ring_buffer(dataset_t *d);
 // Copy a snapshot of all variables into a column of the data set.
 extern void ring_buffer_snapshot(system_state_var_t *sys_vars, dataset_t *d, int NumVars);
 
-// Clear the ring buffer by resetting the pointers.
+// Clear the ring buffer by emptying it.  Recording resumes at the
+// next boundary of the groups of decimated variables, so that files
+// always start on one; this may skip a few columns.  Not for a ring
+// being streamed.
 extern void clear_ring_buffer(dataset_t *d);
 
+// The ring indices are guarded by a sequence count in the dataset,
+// which ring_buffer_snapshot and clear_ring_buffer make odd while they
+// change them and even again after, as a seqlock does.  Another
+// thread can thus read the live buffer without locking the realtime
+// thread: this copies the latest n samples, or as many as there are,
+// into a new dataset in the usual layout.  Each snapshot writes just
+// the column after the last, and a clear counts as one update for
+// each column it skips, so the copy is good unless the writer got a
+// whole ring ahead; the copy is then retried.
+// String values are copied only if the ring has interned them.
+// Returns NULL if no consistent copy could be made, which only
+// happens if the ring is too short for the copying time or the writer
+// stopped in the middle of a snapshot.  The ring may also be one
+// recorded by another process and attached with ds_attach_shared.
+extern dataset_t *ring_buffer_read_recent(dataset_t *d, unsigned int n);
+
+// Switch a ring buffer to the frame-major layout, or back if frames
+// is zero; see ds_set_frame_layout.  In the frame layout each
+// snapshot fills one contiguous record rather than a value in every
+// variable buffer, which touches far fewer cache lines.  The values
+// are converted back to one buffer per variable as they are written
+// out.  Call this before recording starts; it allocates memory.
+extern void ring_buffer_frame_layout(dataset_t *d, int frames);
+
+// Move the frames of a ring buffer into a named shared memory segment
+// so that other processes can follow the recording with
+// ds_attach_shared, whether it is recorded by ring_buffer_snapshot or
+// streamed by ring_buffer_stream_snapshot; see ds_share_frames.  The buffer must already be
+// in the frame layout.  Call this before recording starts.  Returns 0
+// on success.
+extern int share_ring_buffer(dataset_t *d, const char *name);
+
+// A ring buffer which is continuously written to a file by a
+// background thread while the realtime thread records into it, so
+// that the length of a recording is not limited by the ring.
+typedef struct {
+  dataset_t *d;                    // the ring buffer
+  ds_append_t *file;               // the file being written
+  char *filename;
+  unsigned int block;              // number of samples written at once
+  volatile unsigned int produced;  // number of samples recorded, advanced by the realtime thread
+  volatile unsigned int consumed;  // number of samples written, advanced by the writer
+  unsigned int tail;               // next column to write, used by the writer
+  unsigned int skip;               // samples to pass over to reach a group boundary
+  unsigned int limit;              // most samples recorded but not yet written
+  volatile int running;            // cleared to stop the writer
+  unsigned int overruns;           // samples dropped because the ring was full
+  unsigned int errors;             // failed writes
+  pthread_t thread;
+} ring_buffer_stream_t;
+
+// Open a new data file for a ring buffer and start a writer thread
+// which appends the recorded samples to it in groups of "block", or
+// of one compressed block if that is zero.  The ring only needs to
+// hold the samples recorded while the writer catches up.  Returns a
+// pointer on success, else NULL.
+extern ring_buffer_stream_t *start_ring_buffer_stream(dataset_t *d, unsigned int block);
+
+// Copy a snapshot of all variables into the next column of a
+// streamed ring buffer.  This neither blocks nor allocates memory,
+// so it is safe to call from the realtime thread.  If the writer has
+// fallen a whole ring behind the sample is dropped and counted in
+// "overruns".
+extern void ring_buffer_stream_snapshot(system_state_var_t *sys_vars, ring_buffer_stream_t *s, int NumVars);
+
+// Stop the writer, write out the remaining samples and close the
+// file.  If keep is false the file is deleted.  Returns a newly
+// allocated string with the name of the kept file, or NULL if it was
+// deleted or on failure.  The string must be freed by the caller.
+extern char *stop_ring_buffer_stream(ring_buffer_stream_t *s, int keep);
+
+// A condition for triggered captures, evaluated by the realtime
+// thread at each sample; it must not block.  Returns true while the
+// triggering condition holds.
+typedef int (*ring_buffer_condition_t)(void *arg);
+
+// A side buffer which captures the samples around an incident, such
+// as a fall, and saves them to a file of their own while recording
+// into the main ring goes on.  A capture is triggered when the
+// condition becomes true, i.e., on a rising edge.
+typedef struct {
+  dataset_t *d;                    // the side buffer
+  ring_buffer_condition_t condition;
+  void *arg;                       // passed to the condition
+  const void *var;                 // the variable of the predicate, see ring_buffer_trigger_when
+  enum system_state_var_type_t type; // its type, or SYS_NOTYPE for no predicate
+  int op;                          // the comparison
+  double value;                    // the value compared with a numeric variable
+  char text[SYS_STRING_LEN + 1];   // the value compared with a string variable
+  unsigned int post;               // samples recorded after the trigger
+  unsigned int remaining;          // samples still to record, used by the realtime thread
+  int previous;                    // the condition at the last sample
+  volatile int state;              // whether armed, recording or saving
+  volatile int running;            // cleared to stop the writer
+  unsigned int triggers;           // incidents captured
+  unsigned int captures;           // files saved
+  unsigned int missed;             // incidents while a capture was being saved
+  unsigned int errors;             // failed writes
+  pthread_t thread;
+} ring_buffer_trigger_t;
+
+// Start capturing incidents of "pre" samples up to and including the
+// trigger and "post" samples after it, of the variables selected by
+// "record" as for create_masked_ring_buffer.  Each capture is saved
+// by a writer thread to a new file named by new_data_file_name, as
+// write_ring_buffer does, and the buffer is then armed again.  An
+// incident occurring while a capture is saved is counted in "missed".
+// The capture is triggered by the condition, which may be NULL, or by
+// a predicate set with ring_buffer_trigger_when.  The file flags of
+// the captures can be set on t->d.  Returns a pointer on success,
+// else NULL.
+extern ring_buffer_trigger_t *start_ring_buffer_trigger(system_state_var_t *sys_vars, int NumVars, const unsigned char *record,
+							 unsigned int pre, unsigned int post, ring_buffer_condition_t condition, void *arg);
+
+// Also trigger a capture on a predicate comparing a named variable
+// with a value, such as "walk_state == 7" or "pitch > 0.8".  The
+// operators are ==, !=, <, <=, > and >=; a string variable may only
+// be compared for equality, with the text to the end of the
+// predicate.  Call this before recording starts.  Returns 0 on
+// success, or 1 if the predicate is malformed or the variable is not
+// found.
+extern int ring_buffer_trigger_when(ring_buffer_trigger_t *t, system_state_var_t *sys_vars, int NumVars, const char *predicate);
+
+// Record a sample into the side buffer and check the trigger.  This
+// neither blocks nor allocates memory, so it is safe to call from the
+// realtime thread.
+extern void ring_buffer_trigger_snapshot(system_state_var_t *sys_vars, ring_buffer_trigger_t *t, int NumVars);
+
+// Stop the writer, saving any capture in progress, and free the side
+// buffer.  Returns the number of captures saved.
+extern unsigned int stop_ring_buffer_trigger(ring_buffer_trigger_t *t);
+
 #endif /**************** RECORD_H_INCLUDED ****************/
 
 
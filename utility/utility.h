@@ -9,8 +9,8 @@
 
 
 // errprint.c
-extern void errprintf(char *format, ...);
-extern void logprintf(char *format, ...);
+extern void errprintf(const char *format, ...);
+extern void logprintf(const char *format, ...);
 extern void redirect_stderr_to_file(char *errlog);
 
 // delay.c
@@ -23,6 +23,11 @@ extern void delay_microseconds( unsigned long usecs );
 // NULL on an error.
 extern char *new_data_file_name(void);
 
+// The same, searching the named directory.  The name returned does
+// not include the directory.  The current directory is left alone,
+// so this is safe to call while other threads are running.
+extern char *new_data_file_name_in(const char *directory);
+
 // kbhit.c
 extern int kbhit(void);
 